@@ -4,6 +4,8 @@
     @brief  VUT FIT 2020 / ISA Project variant DNS resolver
 */
 
+// recvmmsg(), sendmmsg()
+#define _GNU_SOURCE
 // standart C stuff
 #include <stdio.h>
 #include <stdlib.h>
@@ -12,11 +14,26 @@
 #include <unistd.h>
 #include <getopt.h>
 #include <errno.h>
+#include <stdint.h>
+#include <inttypes.h>			// PRIu64
+#include <stdarg.h>				// va_start()
+#include <ctype.h>				// isalnum()
 // POSIX
-#include <strings.h>			// bzero()
+#include <strings.h>			// bzero(), strncasecmp()
 #include <signal.h>				// signal()
+#include <pthread.h>			// pthread_create()
 #include <poll.h>				// poll()
-#include <netdb.h>				// gethostbyname()
+#include <fcntl.h>				// open()
+#include <sys/stat.h>			// fstat()
+#include <sys/mman.h>			// mmap()
+#include <sys/random.h>			// getrandom()
+#include <time.h>				// clock_gettime()
+#include <sys/epoll.h>			// epoll_wait()
+#include <sys/syscall.h>		// io_uring_setup(), io_uring_enter()
+#include <linux/io_uring.h>
+#include <netdb.h>				// getaddrinfo()
+#include <syslog.h>				// syslog()
+#include <sys/uio.h>			// writev()
 // network stuff
 #include <sys/socket.h>
 #include <netinet/in.h>
@@ -24,517 +41,5582 @@
 #include <arpa/nameser.h>
 //#include <linux/ip.h>
 #include <netinet/udp.h>
+#include <netinet/tcp.h>			// TCP_NODELAY
+// vector instructions (selected at runtime)
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#include <arm_acle.h>
+#include <sys/auxv.h>			// getauxval()
+#endif
 
-// size for recvfrom() buffer
-#define BUFFER_SIZE 1000
+// UDP payload sizes of EDNS(0) (RFC 6891), classic DNS without OPT record has 512 bytes, the default is the size
+// which is not fragmented on usual paths
+#define EDNS_MIN_PAYLOAD 512
+#define EDNS_DEFAULT_PAYLOAD 1232
+#define EDNS_MAX_PAYLOAD 4096
+// extended response code for unsupported EDNS version (its upper 8 bits are in the OPT record)
+#define EDNS_BADVERS 16
+
+// UDP payload size advertised to the servers and clients (-b)
+unsigned ednsPayload = EDNS_DEFAULT_PAYLOAD;
+
+// size for recvfrom() buffer (the largest UDP payload size which can be advertised)
+#define BUFFER_SIZE EDNS_MAX_PAYLOAD
 
 // verbose mode turned on/off
 bool verbose = false;
 
-//socket descriptors
-int clientSocketDescritor = -1;
-int serverSocketDescritor = -1;
+// maximal number of sockets for server queries (each has its own random source port)
+#define MAX_SERVER_SOCKETS 64
+
+// maximal number of worker threads
+#define MAX_WORKERS 256
+
+// maximal number of upstream servers (-s can be repeated)
+#define MAX_UPSTREAMS 16
+
+// number of server sockets of each worker
+int serverSocketCount = 1;
+// addresses of the upstream servers
+struct sockaddr_in6 upstreams[MAX_UPSTREAMS];
+int upstreamCount = 0;
+
+// upstream is considered down when it does not answer anything for UPSTREAM_TIMEOUT_RTTS smoothed round trip
+// times (bounded by the minimum and maximum in microseconds), then it gets no queries for UPSTREAM_RETRY_TIME
+#define UPSTREAM_TIMEOUT_RTTS 4
+#define UPSTREAM_MIN_TIMEOUT 250000
+#define UPSTREAM_MAX_TIMEOUT 2000000
+#define UPSTREAM_RETRY_TIME 5000000
+// failure rate is a fixed point number (UPSTREAM_RATE_ONE is 100 %), it makes the rtt of the upstream look
+// up to UPSTREAM_RATE_PENALTY times longer
+#define UPSTREAM_RATE_ONE 1024
+#define UPSTREAM_RATE_PENALTY 4
+
+// TCP (RFC 7766): maximal number of client connections of each worker, buffer of one framed message (two byte length
+// and the message), maximal queued output of one connection, idle time of the client connection before it is closed (ms),
+// maximal number of queries sent over one upstream connection at the same time and backlog of the listening socket
+#define TCP_MAX_CLIENTS 128
+#define TCP_BUFFER_SIZE (2 + 65535)
+#define TCP_MAX_OUTPUT (16 * TCP_BUFFER_SIZE)
+#define TCP_IDLE_TIMEOUT 10000
+#define TCP_MAX_PIPELINE 64
+#define TCP_LISTEN_BACKLOG 128
+
+// number of packets received or sent by one recvmmsg()/sendmmsg() call and maximal number of batches
+// read from one socket after one poll()
+#define BATCH_SIZE 32
+#define BATCH_ROUNDS 8
+
+// packets received by recvmmsg() ->count ->messages ->iov ->addresses ->buffers
+struct packetBatch {
+	unsigned count;
+	struct mmsghdr messages[BATCH_SIZE];
+	struct iovec iov[BATCH_SIZE];
+	struct sockaddr_in6 addresses[BATCH_SIZE];
+	char buffers[BATCH_SIZE][BUFFER_SIZE];
+};
+
+// packets waiting for sendmmsg(), they point to the buffers of the received batch ->count ->messages ->iov
+struct sendQueue {
+	unsigned count;
+	struct mmsghdr messages[BATCH_SIZE];
+	struct iovec iov[BATCH_SIZE];
+};
+
+// what to do with the processed packet (answer the client, send the query to the server or throw it away)
+enum packetAction {
+	ACTION_DROP,
+	ACTION_REPLY,
+	ACTION_FORWARD
+};
+
+// maximal length of one label and of the whole name (RFC 1035)
+#define MAX_LABEL_LENGTH 63
+#define MAX_NAME_LENGTH 255
+// maximal number of labels of the name (each label takes at least two bytes of the name)
+#define MAX_LABELS 127
+
+// parsed packet, only offsets into the receive buffer are stored (nothing is copied)
+// ->packet ->length ->labelCount ->labels (offsets of the length bytes of the question labels, compression pointers are
+// followed) ->nameLength (of the uncompressed question name in wire format) ->type ->class ->questionEnd
+// ->sections (offsets of the answer, authority and additional sections) ->recordsEnd (end of the last record)
+// ->opt (offset of the OPT record in the additional section, 0 when there is none)
+struct dnsView {
+	const unsigned char *packet;
+	unsigned length;
+	unsigned labelCount;
+	uint16_t labels[MAX_LABELS];
+	uint16_t nameLength;
+	uint16_t type;
+	uint16_t class;
+	uint16_t questionEnd;
+	uint16_t sections[3];
+	uint16_t recordsEnd;
+	uint16_t opt;
+};
+
+// question name folded to lowercase with the hash of every suffix (name from the label to the root), so every
+// suffix of the name is looked up in the filter by one probe ->length (including the root label) ->labelCount
+// ->labels (offsets of the length bytes) ->suffixHashes (index labelCount is the root) ->bytes (name in wire format)
+struct nameKey {
+	unsigned length;
+	unsigned labelCount;
+	uint8_t labels[MAX_LABELS];
+	uint32_t suffixHashes[MAX_LABELS + 1];
+	unsigned char bytes[MAX_NAME_LENGTH];
+};
+
+// node of the blacklist suffix trie, one label per node ->label (offset to the pool) ->parent
+// ->hash (suffix hash of the name ending with this node) ->length ->rules
+struct filterNode {
+	uint32_t label;
+	uint32_t parent;
+	uint32_t hash;
+	uint8_t length;
+	uint8_t rules;
+};
+
+// rules of the filter node, plain name blocks the name and its subdomains, *.name only the subdomains, =name only
+// the name and @@ in front of them allows instead of blocking (allow rule wins over every block rule)
+#define RULE_BLOCK_NAME 1
+#define RULE_BLOCK_SUBDOMAINS 2
+#define RULE_ALLOW_NAME 4
+#define RULE_ALLOW_SUBDOMAINS 8
+
+// magic number ("DNSF" in native byte order) and version of the compiled filter file (labels are lowercase since 2,
+// edges are keyed on suffix hashes since 3, Bloom prefilter since 4, rule types since 5)
+#define FILTER_MAGIC 0x46534e44u
+#define FILTER_VERSION 5
+
+// split block Bloom prefilter of blocked names: bits per name (about 3 % false positives per suffix, million names
+// take 1 MB and fit in L2 cache) and 32 bit words of one block (256 bits, 8 bits are set per name, one in every word)
+#define BLOOM_BITS_PER_NAME 8
+#define BLOOM_BLOCK_WORDS 8
 
-// response from recvfrom() ->buffer ->length
-struct response {
-	char* buffer;
-	int length;
+// size of the chunks read from the text filter files, the longest parsed line (longer lines are skipped), nodes
+// allocated for the filter at the start (the arrays double when full) and most filter files given by -f
+#define FILTER_CHUNK_SIZE (1 << 20)
+#define FILTER_LINE_SIZE 4096
+#define FILTER_INITIAL_NODES 4096
+#define MAX_FILTER_FILES 16
+
+// header of the blacklist data [header][nodes][edges][bloom][label pool], all positions are offsets from the header
+// so the compiled filter file is exactly this data and can be used directly by mmap()
+// edges is open addressing table suffix hash -> node index, 0 is empty slot (root is never a child)
+// bloom contains suffix hashes of all nodes with rules
+// ->magic ->version ->nodeCount ->tableMask ->size (rules) ->allowSize (allow rules) ->poolSize ->nodesOffset ->edgesOffset ->bloomOffset ->bloomBlocks
+// ->poolOffset ->totalSize
+struct filterHeader {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t nodeCount;
+	uint32_t tableMask;
+	uint64_t size;
+	uint64_t allowSize;
+	uint64_t poolSize;
+	uint64_t nodesOffset;
+	uint64_t edgesOffset;
+	uint64_t bloomOffset;
+	uint64_t bloomBlocks;
+	uint64_t poolOffset;
+	uint64_t totalSize;
 };
 
-// dynamicly allocated blacklist ->size ->allocated ->r
+// blacklist stored as a trie keyed on reversed labels (com -> example -> ads)
+// built filter lives in one arena [struct blacklist_s][header][nodes][edges][bloom][label pool] freed by a single
+// free(), compiled filter is mapped read only and only this structure is allocated
+// ->header ->nodes ->edges ->bloom ->pool ->tableMask ->bloomBlocks ->mapped ->mappedSize
 struct blacklist_s {
-	unsigned long size;
+	struct filterHeader *header;
+	struct filterNode *nodes;
+	uint32_t *edges;
+	uint32_t *bloom;
+	char *pool;
+	uint32_t tableMask;
+	uint32_t bloomBlocks;
+	void *mapped;
+	size_t mappedSize;
+} __attribute__((aligned(16)));
+
+// blacklist being built from the filter files, its nodes, edges and label pool are separate arrays growing with the
+// rules (not with the size of the files) and they are moved to one arena at the end
+// ->list ->header ->nodeCapacity ->poolCapacity
+struct filterBuilder {
+	struct blacklist_s list;
+	struct filterHeader header;
+	size_t nodeCapacity;
+	size_t poolCapacity;
+};
+
+// what the client gets for the blacklisted name (-a)
+enum blockAction {
+	BLOCK_REFUSED,
+	BLOCK_NXDOMAIN,
+	BLOCK_ADDRESS
+};
+
+// TTL of the synthesized answer for the blacklisted name (-l)
+#define BLOCK_DEFAULT_TTL 300
+
+// answer for the blacklisted names built once from the block action, only the id, the rd bit and the question of
+// the query are patched in ->rcode ->answers (number of answer records) ->authorities (number of authority records)
+// ->records (behind the question, their name is a pointer to the question) ->length (of the records)
+struct blockTemplate {
+	uint8_t rcode;
+	uint16_t answers;
+	uint16_t authorities;
+	unsigned char records[48];
+	unsigned length;
+};
+
+// client waiting for the answer of the same question asked by another client ->id ->rd (recursion desired)
+// ->edns (query had OPT record) ->payload (UDP payload size of the client) ->address
+struct waiter {
+	uint16_t id;
+	bool rd;
+	bool edns;
+	uint16_t payload;
+	struct sockaddr_in6 address;
+};
+
+// size classes of the packet buffer pool (classic answer, answer of the default EDNS payload size and the largest
+// UDP packet, all multiples of the cache line) and the number of buffers allocated at once for the empty class
+#define POOL_CLASSES 3
+#define POOL_CHUNK_BUFFERS 64
+const unsigned poolSizes[POOL_CLASSES] = {512, 1536, BUFFER_SIZE};
+
+// buffers of one size class, free buffers are linked through their first bytes ->free ->chunks (blocks of
+// POOL_CHUNK_BUFFERS buffers, freed only with the pool) ->chunkCount ->chunkAllocated ->buffers (all buffers)
+// ->inUse ->highWater (the most buffers in use at once)
+struct poolClass {
+	void *free;
+	char **chunks;
+	unsigned chunkCount;
+	unsigned chunkAllocated;
+	uint64_t buffers;
+	uint64_t inUse;
+	uint64_t highWater;
+};
+
+// pool of aligned packet buffers of the worker for the copies of pending queries, the waiters and the cached
+// answers, it only grows, so the steady state does not allocate ->classes
+struct bufferPool {
+	struct poolClass classes[POOL_CLASSES];
+};
+
+// query forwarded to the server and waiting for the answer
+// ->used ->key (server socket index << 16 | random id sent to the server) ->clientId ->upstream (index of the server)
+// ->tries (number of sends) ->tcp (sent over the upstream TCP connection) ->connection (TCP client connection, -1 for
+// UDP client) ->connectionSerial ->edns (client query had OPT record) ->payload (UDP payload size of the client)
+// ->questionHash ->serial (of the current deadline timer) ->sentTime (microseconds) ->packet (copy of the forwarded query for retries, NULL when it could not be allocated) ->packetLength ->clientAddress
+// ->waiters (other clients with the same question) ->waiterCount ->waiterAllocated
+struct pendingQuery {
+	bool used;
+	uint32_t key;
+	uint16_t clientId;
+	uint8_t upstream;
+	uint8_t tries;
+	bool tcp;
+	int16_t connection;
+	uint32_t connectionSerial;
+	bool edns;
+	uint16_t payload;
+	uint32_t questionHash;
+	uint32_t serial;
+	uint64_t sentTime;
+	char *packet;
+	unsigned packetLength;
+	struct sockaddr_in6 clientAddress;
+	struct waiter *waiters;
+	uint16_t waiterCount;
+	uint16_t waiterAllocated;
+};
+
+// table of pending queries, open addressing (linear probing) keyed by the server socket and the id sent to
+// the server, it grows with the number of queries ->allocated ->count ->randomLeft ->randomPool ->entries
+// ->pool (owner of the packets and waiters of the queries)
+struct pendingTable {
+	unsigned long allocated;
+	unsigned long count;
+	unsigned randomLeft;
+	uint16_t randomPool[128];
+	struct pendingQuery *entries;
+	struct bufferPool *pool;
+};
+
+// initial size of the pending table, maximal number of pending queries (the table is at most half full
+// and random ids are unlikely to collide) and number of tries to draw unused random id
+#define PENDING_INITIAL_SIZE 64
+#define PENDING_MAX_QUERIES 32768
+#define PENDING_ID_TRIES 8
+// number of sends of one query (to different servers if possible) before the client gets SERVFAIL
+#define PENDING_MAX_TRIES 3
+
+// index of the pending queries by their question (same questions are sent to the server only once),
+// open addressing keyed by the question hash ->used ->questionHash ->key (of the pending query)
+struct inflightQuery {
+	bool used;
+	uint32_t questionHash;
+	uint32_t key;
+};
+
+// ->allocated ->count ->entries
+struct inflightTable {
 	unsigned long allocated;
-	char **r;
+	unsigned long count;
+	struct inflightQuery *entries;
+};
+
+// maximal number of clients waiting for one forwarded question (other clients get their own query)
+#define COALESCE_MAX_WAITERS 128
+
+// hierarchical timer wheel of the query deadlines, level 0 has TIMER_TICK milliseconds slots, each slot of the
+// next level covers all slots of the previous one, timers behind the last level wait in its last slot
+#define TIMER_TICK 8
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_LEVELS 2
+#define TIMER_NONE UINT32_MAX
+
+// deadline of the pending query, timers are not cancelled, expired timer is ignored when the query with its key
+// and serial is not pending anymore ->key ->serial ->deadline (milliseconds) ->next (index of the next timer in the slot)
+struct timer {
+	uint32_t key;
+	uint32_t serial;
+	uint64_t deadline;
+	uint32_t next;
+};
+
+// timer wheel, timers are kept in one growing array and linked by indices
+// ->tick (last processed tick) ->count ->allocated ->freeTimers ->slots ->timers
+struct timerWheel {
+	uint64_t tick;
+	unsigned count;
+	unsigned allocated;
+	uint32_t freeTimers;
+	uint32_t slots[WHEEL_LEVELS][WHEEL_SLOTS];
+	struct timer *timers;
+};
+
+// maximal number of resource records in cached answer (their TTLs are patched), default number of cached
+// answers and maximal time to keep the answer (seconds)
+#define CACHE_MAX_RECORDS 48
+#define CACHE_DEFAULT_SIZE 10000
+#define CACHE_MAX_TTL 86400
+// maximal time to keep negative answer (NXDOMAIN or no data) according to RFC 2308
+#define CACHE_MAX_NEGATIVE_TTL 10800
+
+// cached answer ->used ->referenced (CLOCK bit) ->next (next entry in the bucket) ->hash ->type ->class
+// ->length ->ttlCount ->stored (ms) ->expires (ms) ->questionEnd ->opt (offset of the OPT record, 0 when there is none)
+// ->nameLength ->name (lowercase wire format) ->packet ->ttlOffsets
+struct cacheEntry {
+	bool used;
+	bool referenced;
+	int32_t next;
+	uint32_t hash;
+	uint16_t type;
+	uint16_t class;
+	uint16_t length;
+	uint16_t ttlCount;
+	uint64_t stored;
+	uint64_t expires;
+	uint16_t questionEnd;
+	uint16_t opt;
+	uint16_t nameLength;
+	unsigned char name[MAX_NAME_LENGTH];
+	char *packet;
+	uint16_t ttlOffsets[CACHE_MAX_RECORDS];
+};
+
+// cache of answers keyed by (name, type, class) with fixed number of entries evicted by CLOCK algorithm
+// ->capacity ->hand ->mask ->buckets (first entry of each chain, -1 is empty) ->entries ->pool (owner of the packets)
+struct answerCache {
+	unsigned long capacity;
+	unsigned long hand;
+	uint32_t mask;
+	int32_t *buckets;
+	struct cacheEntry *entries;
+	struct bufferPool *pool;
+};
+
+// tokens of the worker sockets registered with the event backend (server sockets follow the first one, then the TCP
+// listening socket, upstream TCP connections and client TCP connections)
+#define TOKEN_CLIENT 0
+#define TOKEN_SERVER 1
+#define TOKEN_LISTEN (TOKEN_SERVER + MAX_SERVER_SOCKETS)
+#define TOKEN_UPSTREAM (TOKEN_LISTEN + 1)
+#define TOKEN_TCP_CLIENT (TOKEN_UPSTREAM + MAX_UPSTREAMS)
+// maximal number of sockets registered with one event backend (all tokens)
+#define MAX_EVENTS (TOKEN_TCP_CLIENT + TCP_MAX_CLIENTS)
+// number and size of io_uring provided buffers of each worker (header, address and packet)
+#define URING_BUFFERS 256
+#define URING_BUFFER_SIZE (sizeof(struct io_uring_recvmsg_out) + sizeof(struct sockaddr_in6) + BUFFER_SIZE)
+
+// kinds of event backends
+enum backendType {
+	BACKEND_EPOLL,
+	BACKEND_POLL,
+	BACKEND_URING
+};
+
+// ready socket reported by the event backend, io_uring backend delivers the received packet itself
+// ->token (registered with the socket) ->writable ->buffer (received packet or NULL) ->length ->address ->bufferId
+struct event {
+	uint32_t token;
+	bool writable;
+	char *buffer;
+	unsigned length;
+	struct sockaddr_in6 *address;
+	uint16_t bufferId;
+};
+
+// event backend used by the worker loop ->type ->state ->add() ->watch() ->remove() ->wait() ->release() ->destroy()
+// add() registers the socket (packets says the backend may receive datagrams itself), watch() turns reporting of
+// writability on or off, remove() unregisters the socket before it is closed, wait() returns number of events or -1,
+// release() gives the buffer of the event back to the backend
+struct eventBackend {
+	enum backendType type;
+	void *state;
+	int (*add)(struct eventBackend *backend, int fd, uint32_t token, bool packets);
+	int (*watch)(struct eventBackend *backend, int fd, uint32_t token, bool writable);
+	void (*remove)(struct eventBackend *backend, int fd, uint32_t token);
+	int (*wait)(struct eventBackend *backend, struct event *events, int maxEvents, int timeout);
+	void (*release)(struct eventBackend *backend, struct event *event);
+	void (*destroy)(struct eventBackend *backend);
+};
+
+// health of the upstream server as seen by one worker, rtt and failure rate are exponentially weighted moving averages
+// ->srtt (microseconds, 0 until the first answer) ->failureRate ->unansweredSince (first query sent after the last
+// answer) ->downUntil (no queries are sent until this time)
+struct upstreamState {
+	uint64_t srtt;
+	unsigned failureRate;
+	uint64_t unansweredSince;
+	uint64_t downUntil;
+};
+
+// TCP connection, messages are framed by two byte length ->fd (-1 when closed) ->serial (changes with every connection
+// of the slot) ->connecting ->writing (the backend reports writability) ->lastActive (ms) ->address (of the peer)
+// ->input ->inputLength ->output (framed messages not sent yet) ->outputLength ->outputAllocated
+struct tcpConnection {
+	int fd;
+	uint32_t serial;
+	bool connecting;
+	bool writing;
+	uint64_t lastActive;
+	struct sockaddr_in6 address;
+	unsigned char *input;
+	unsigned inputLength;
+	unsigned char *output;
+	unsigned outputLength;
+	unsigned outputAllocated;
+};
+
+// query sent over the upstream TCP connection ->id (on this connection) ->key (of the pending query) ->serial (of the send)
+struct tcpQuery {
+	uint16_t id;
+	uint32_t key;
+	uint32_t serial;
+};
+
+// persistent TCP connection to the upstream server, queries are pipelined and answers matched by id in any order
+// ->connection ->count ->queries
+struct upstreamConnection {
+	struct tcpConnection connection;
+	unsigned count;
+	struct tcpQuery queries[TCP_MAX_PIPELINE];
+};
+
+// events counted by the workers, names and help of the metrics are in statNames
+enum statCounter {
+	STAT_QUERIES,
+	STAT_BLACKLISTED,
+	STAT_FORMAT_ERRORS,
+	STAT_NOT_IMPLEMENTED,
+	STAT_CACHED,
+	STAT_COALESCED,
+	STAT_FORWARDED,
+	STAT_ANSWERS,
+	STAT_UNMATCHED,
+	STAT_TRUNCATED,
+	STAT_TIMEOUTS,
+	STAT_SERVFAILS,
+	STAT_PENDING_FULL,
+	STAT_TOO_LONG,
+	STAT_TCP_REJECTED,
+	STAT_RATE_LIMITED,
+	STAT_LOG_DROPPED,
+	STAT_COUNTERS
+};
+
+// buckets of the server round trip time histogram, bucket i counts times below 2^(i + 7) microseconds
+// (128 us to 4 s), one more bucket counts the longer times
+#define STATS_RTT_BUCKETS 16
+#define STATS_RTT_MIN_BITS 7
+
+// statistics of the worker on its own cache lines, only the worker writes them (relaxed stores, no locked
+// instructions) and the metrics thread sums all workers when they are read ->counters ->rtt (histogram of the
+// server round trip times) ->rttSum (microseconds) ->pending (pending queries) ->tcpClients (connected TCP clients)
+// ->poolBuffers (buffers of the pool classes) ->poolInUse ->poolHighWater
+struct workerStats {
+	uint64_t counters[STAT_COUNTERS];
+	uint64_t rtt[STATS_RTT_BUCKETS + 1];
+	uint64_t rttSum;
+	uint64_t pending;
+	uint64_t tcpClients;
+	uint64_t poolBuffers[POOL_CLASSES];
+	uint64_t poolInUse[POOL_CLASSES];
+	uint64_t poolHighWater[POOL_CLASSES];
+} __attribute__((aligned(64)));
+
+// number of entries of the query log ring of each worker (power of two) and how long the log thread sleeps when
+// all rings are empty (microseconds)
+#define LOG_RING_SIZE 4096
+#define LOG_IDLE_SLEEP 10000
+// entries written out by one writev() and the longest text of one entry
+#define LOG_BATCH 64
+#define LOG_LINE_SIZE (MAX_NAME_LENGTH + 128)
+
+// entry of the query log, fixed size so the ring is a plain array ->time (realtime in ms) ->type (string literal)
+// ->inIp ->outIp (IPv4 as v4-mapped) ->inPort ->outPort ->answer (direction) ->name (dot notation)
+struct logRecord {
+	uint64_t time;
+	const char *type;
+	struct in6_addr inIp;
+	struct in6_addr outIp;
+	uint16_t inPort;
+	uint16_t outPort;
+	bool answer;
+	char name[MAX_NAME_LENGTH + 1];
+};
+
+// query log ring with one writer (the worker) and one reader (the log thread), the indexes only grow and each
+// is on its own cache line ->head (next entry of the worker) ->tail (next entry of the log thread) ->records
+struct logRing {
+	uint64_t head __attribute__((aligned(64)));
+	uint64_t tail __attribute__((aligned(64)));
+	struct logRecord records[LOG_RING_SIZE] __attribute__((aligned(64)));
+};
+
+// rate limiting of the UDP clients (-R): sets of the bucket tables shared by the workers (2^RATE_SET_BITS), each set
+// is one cache line with its lock and RATE_WAYS buckets, highest rate (queries per second of one bucket)
+#define RATE_SET_BITS 14
+#define RATE_WAYS 3
+#define RATE_MAX 1000000
+
+// token bucket of one client (IPv4 address or IPv6 /64) or network (IPv4 /24 or IPv6 /48), a bucket holds one second
+// of queries, tokens are in thousandths of a query ->key (prefix, IPv4 keys are the low half of the v4-mapped address)
+// ->time (ms of the last use, 0 is an empty bucket) ->tokens
+struct rateBucket {
+	uint64_t key;
+	uint32_t time;
+	uint32_t tokens;
+};
+
+// buckets with the same hash, the workers change them only under the spin lock of the set ->lock ->buckets
+struct rateSet {
+	uint32_t lock;
+	uint32_t unused[3];
+	struct rateBucket buckets[RATE_WAYS];
+} __attribute__((aligned(64)));
+
+// fixed size table of the buckets, the least recently used bucket of the set is replaced by a new key
+// ->sets
+struct rateTable {
+	struct rateSet sets[1 << RATE_SET_BITS];
+};
+
+// buckets of the clients and of the networks, one limiter is shared by all workers, so the limit does not depend
+// on the worker which got the packet (SO_REUSEPORT spreads the source ports of one client) ->clients ->networks
+struct rateLimiter {
+	struct rateTable clients;
+	struct rateTable networks;
+} __attribute__((aligned(64)));
+
+// worker thread with its own sockets, pending queries, cache and buffers, only the blacklist is shared,
+// generation (blacklist generation used by the worker, 0 when it does not touch the blacklist) has its own cache line
+// ->generation ->index ->started ->thread ->clientSocket ->serverSockets ->pending ->cache ->batch ->clientQueue
+// ->serverQueues ->backend ->upstreams ->timers ->serial (of the last timer) ->inflight ->listenSocket ->tcpClients
+// ->tcpClientCount ->idleCheck (time of the next check of idle TCP clients) ->upstreamConnections ->stats
+// ->log (query log ring, NULL when the log is off) ->pool (packet buffers)
+struct worker {
+	unsigned long generation __attribute__((aligned(64)));
+	int index __attribute__((aligned(64)));
+	bool started;
+	pthread_t thread;
+	int clientSocket;
+	int serverSockets[MAX_SERVER_SOCKETS];
+	struct pendingTable *pending;
+	struct answerCache *cache;
+	struct packetBatch *batch;
+	struct sendQueue *clientQueue;
+	struct sendQueue *serverQueues;
+	struct eventBackend *backend;
+	struct upstreamState upstreams[MAX_UPSTREAMS];
+	struct timerWheel *timers;
+	uint32_t serial;
+	struct inflightTable *inflight;
+	int listenSocket;
+	struct tcpConnection *tcpClients;
+	unsigned tcpClientCount;
+	uint64_t idleCheck;
+	struct upstreamConnection *upstreamConnections;
+	struct workerStats stats;
+	struct logRing *log;
+	struct bufferPool *pool;
 };
 
 //global struct pointers
 struct blacklist_s *blacklist;
-struct response *resp;
+struct worker *workers;
+// number of worker threads
+int workerCount = 1;
+// event backend of the workers
+enum backendType backendType = BACKEND_EPOLL;
+// number of cached answers (0 turns the cache off)
+unsigned long cacheSize = CACHE_DEFAULT_SIZE;
+// queries per second of one UDP client (IPv4 address or IPv6 /64) and of one network (IPv4 /24 or IPv6 /48) (-R,
+// 0 is no limit), clients over the limit are dropped or get TC (-T)
+unsigned clientRate = 0;
+unsigned networkRate = 0;
+bool rateTruncate = false;
+// token buckets of all workers (NULL without -R)
+struct rateLimiter *rateBuckets = NULL;
+// answer for the blacklisted names
+struct blockTemplate blockAnswer;
+
+// size of the text of the metrics
+#define METRICS_BUFFER_SIZE 16384
+// names and help of the counters in the metrics (in the order of enum statCounter)
+const char *statNames[STAT_COUNTERS][2] = {
+	{"dns_queries_total", "Queries received from clients."},
+	{"dns_blacklisted_total", "Queries for filtered domains."},
+	{"dns_format_errors_total", "Queries answered by format error or bad EDNS version."},
+	{"dns_not_implemented_total", "Queries answered by not implemented error."},
+	{"dns_cached_total", "Queries answered from the cache."},
+	{"dns_coalesced_total", "Queries waiting for the same question asked by another client."},
+	{"dns_forwarded_total", "Queries forwarded to the servers."},
+	{"dns_answers_total", "Answers from the servers delivered to the clients."},
+	{"dns_unmatched_total", "Answers from the servers which do not match any pending query."},
+	{"dns_truncated_total", "Truncated answers asked again over TCP."},
+	{"dns_timeouts_total", "Queries not answered by the server in time."},
+	{"dns_servfails_total", "Queries answered by SERVFAIL after the last try."},
+	{"dns_pending_full_total", "Queries dropped because the table of pending queries was full."},
+	{"dns_too_long_total", "Packets dropped because they are longer than the buffer."},
+	{"dns_tcp_rejected_total", "TCP clients closed at once because there were too many connections."},
+	{"dns_rate_limited_total", "Queries of UDP clients over the rate limit (dropped or answered by TC)."},
+	{"dns_log_dropped_total", "Query log entries dropped because the log thread was behind."}
+};
+// query log (-q, or stdout in verbose mode) written by the log thread, it is off when there is no descriptor
+// and no syslog
+int queryLogFile = -1;
+bool queryLogSyslog = false;
+pthread_t logger;
+bool loggerStarted = false;
+
+// address of the metrics endpoint (-m), the thread serving it and its socket
+bool metricsEnabled = false;
+struct sockaddr_in metricsAddress;
+pthread_t metricsServer;
+bool metricsStarted = false;
+int metricsSocket = -1;
+
+// names of the filter files (for reloading on SIGHUP)
+char *filterFileNames[MAX_FILTER_FILES];
+int filterFileCount = 0;
+// thread reloading the filter on SIGHUP
+pthread_t reloader;
+bool reloaderStarted = false;
+// generation of the published blacklist, old blacklist can be freed when all workers are offline or use newer generation
+unsigned long blacklistGeneration = 1;
+
+
+/**
+ * @fn printVerbose()
+ * @brief Only print if verbose mode is turned on
+ * @param string string to print
+*/
+void printVerbose(char * string) {
+	if (verbose) {
+		fprintf(stdout, "%s", string);
+	}
+}
+
+/**
+ * @fn freeBlacklist()
+ * @brief Free the built blacklist arena or unmap the compiled filter
+ * @param list Blacklist
+*/
+void freeBlacklist(struct blacklist_s *list) {
+	if (list->mapped) munmap(list->mapped, list->mappedSize);
+	free(list);
+}
+
+/**
+ * @fn freeBufferPool()
+ * @brief Free all chunks of the buffer pool
+ * @param pool Pool
+ */
+void freeBufferPool(struct bufferPool *pool) {
+	for (int i = 0; i < POOL_CLASSES; i++) {
+		for (unsigned j = 0; j < pool->classes[i].chunkCount; j++) free(pool->classes[i].chunks[j]);
+		free(pool->classes[i].chunks);
+	}
+	free(pool);
+}
+
+/**
+ * @fn freeAnswerCache()
+ * @brief Free the cache of answers (the cached packets are in the pool of the worker)
+ * @param answers Cache of answers
+*/
+void freeAnswerCache(struct answerCache *answers) {
+	free(answers->entries);
+	free(answers->buckets);
+	free(answers);
+}
+
+/**
+ * @fn queryLogEnabled()
+ * @brief Check whether the entries about packets are logged (-q or verbose mode)
+ * @return bool true when the query log is on
+ */
+bool queryLogEnabled() {
+	return queryLogFile != -1 || queryLogSyslog;
+}
+
+/**
+ * @fn formatAddress()
+ * @brief Write the address in text form, v4-mapped address as plain IPv4
+ * @param address Address
+ * @param text Destination, INET6_ADDRSTRLEN bytes
+ */
+void formatAddress(const struct in6_addr *address, char *text) {
+	if (IN6_IS_ADDR_V4MAPPED(address)) {
+		inet_ntop(AF_INET, &address->s6_addr[12], text, INET6_ADDRSTRLEN);
+	} else {
+		inet_ntop(AF_INET6, address, text, INET6_ADDRSTRLEN);
+	}
+}
+
+/**
+ * @fn formatLogRecord()
+ * @brief Write the entry of the query log as one line (UTC time, both addresses in the direction of the packet,
+ * type and name)
+ * @param record Entry
+ * @param line Destination, LOG_LINE_SIZE bytes
+ * @return size_t length of the line
+ */
+size_t formatLogRecord(const struct logRecord *record, char *line) {
+	time_t seconds = record->time / 1000;
+	struct tm time;
+	gmtime_r(&seconds, &time);
+	char in[INET6_ADDRSTRLEN], out[INET6_ADDRSTRLEN];
+	formatAddress(&record->inIp, in);
+	formatAddress(&record->outIp, out);
+	int length = snprintf(line, LOG_LINE_SIZE, "%04d-%02d-%02dT%02d:%02d:%02d.%03uZ\t%s#%u\t%s\t%s#%u\t%s:\t%s\n",
+		time.tm_year + 1900, time.tm_mon + 1, time.tm_mday, time.tm_hour, time.tm_min, time.tm_sec,
+		(unsigned)(record->time % 1000), record->answer ? out : in, record->answer ? record->outPort : record->inPort,
+		record->answer ? "<--" : "-->", record->answer ? in : out, record->answer ? record->inPort : record->outPort,
+		record->type, record->name);
+	return length < LOG_LINE_SIZE ? (size_t)length : LOG_LINE_SIZE - 1;
+}
+
+/**
+ * @fn writeLogLines()
+ * @brief Write the lines to the query log file by writev() (partial writes continue) or to syslog
+ * @param iov Lines
+ * @param count Number of lines
+ */
+void writeLogLines(struct iovec *iov, int count) {
+	if (queryLogSyslog) {
+		for (int i = 0; i < count; i++) syslog(LOG_INFO, "%.*s", (int)iov[i].iov_len - 1, (char *)iov[i].iov_base);
+		return;
+	}
+	while (count > 0) {
+		ssize_t result = writev(queryLogFile, iov, count);
+		if (result < 0) {
+			if (errno == EINTR) continue;
+			fprintf(stderr, "Could not write the query log. Writev: %s\n", strerror(errno));
+			return;
+		}
+		// skip the written lines and the written part of the next one
+		while (count > 0 && (size_t)result >= iov->iov_len) {
+			result -= iov->iov_len;
+			iov++;
+			count--;
+		}
+		if (count > 0) {
+			iov->iov_base = (char *)iov->iov_base + result;
+			iov->iov_len -= result;
+		}
+	}
+}
+
+/**
+ * @fn writeQueryLog()
+ * @brief Write out the entries waiting in the query log rings of all workers, LOG_BATCH entries by one writev()
+ * @return unsigned number of written entries
+ */
+unsigned writeQueryLog() {
+	char lines[LOG_BATCH][LOG_LINE_SIZE];
+	struct iovec iov[LOG_BATCH];
+	unsigned written = 0;
+	for (int i = 0; workers != NULL && i < workerCount; i++) {
+		struct logRing *ring = workers[i].log;
+		if (!ring) continue;
+		uint64_t tail = ring->tail;
+		uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+		while (tail != head) {
+			int count = 0;
+			for (; count < LOG_BATCH && tail != head; count++, tail++) {
+				iov[count].iov_base = lines[count];
+				iov[count].iov_len = formatLogRecord(&ring->records[tail & (LOG_RING_SIZE - 1)], lines[count]);
+			}
+			// formatted entries can be reused by the worker
+			__atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+			writeLogLines(iov, count);
+			written += count;
+		}
+	}
+	return written;
+}
+
+/**
+ * @fn logThread()
+ * @brief Write out the query log of the workers, sleep when there is nothing to write
+ * @param arg Not used
+ * @return void* Never returns
+ */
+void *logThread(void *arg) {
+	(void)arg;
+	while (1) {
+		if (!writeQueryLog()) usleep(LOG_IDLE_SLEEP);
+	}
+	return NULL;
+}
+
+/**
+ * @fn clear()
+ * @brief Stop the workers, free memory, close sockets and exit (on termination signal or fatal error)
+ * @param status Exit status (EXIT_SUCCESS only after the termination signal)
+*/
+void clear(int status) {
+	//stop all workers (except the one which called clear() after fatal error)
+	for (int i = 0; workers != NULL && i < workerCount; i++) {
+		if (workers[i].started && !pthread_equal(workers[i].thread, pthread_self())) {
+			pthread_cancel(workers[i].thread);
+			pthread_join(workers[i].thread, NULL);
+		}
+	}
+	if (reloaderStarted && !pthread_equal(reloader, pthread_self())) {
+		pthread_cancel(reloader);
+		pthread_join(reloader, NULL);
+	}
+	if (metricsStarted) {
+		pthread_cancel(metricsServer);
+		pthread_join(metricsServer, NULL);
+	}
+	if (metricsSocket != -1) close(metricsSocket);
+	//the rest of the query log
+	if (loggerStarted && !pthread_equal(logger, pthread_self())) {
+		pthread_cancel(logger);
+		pthread_join(logger, NULL);
+	}
+	if (queryLogEnabled()) writeQueryLog();
+	if (queryLogFile > STDERR_FILENO) close(queryLogFile);
+	if (queryLogSyslog) closelog();
+	printVerbose("\nClearing sockets...\n");
+	//close all sockets
+	for (int i = 0; workers != NULL && i < workerCount; i++) {
+		if (workers[i].clientSocket != -1) close(workers[i].clientSocket);
+		for (int j = 0; j < serverSocketCount; j++) {
+			if (workers[i].serverSockets[j] != -1) close(workers[i].serverSockets[j]);
+		}
+		if (workers[i].listenSocket != -1) close(workers[i].listenSocket);
+		for (int j = 0; workers[i].tcpClients != NULL && j < TCP_MAX_CLIENTS; j++) {
+			if (workers[i].tcpClients[j].fd != -1) close(workers[i].tcpClients[j].fd);
+			free(workers[i].tcpClients[j].input);
+			free(workers[i].tcpClients[j].output);
+		}
+		for (int j = 0; workers[i].upstreamConnections != NULL && j < upstreamCount; j++) {
+			struct tcpConnection *connection = &workers[i].upstreamConnections[j].connection;
+			if (connection->fd != -1) close(connection->fd);
+			free(connection->input);
+			free(connection->output);
+		}
+		free(workers[i].tcpClients);
+		free(workers[i].upstreamConnections);
+	}
+	// free blacklist
+	printVerbose("Clearing blacklist...\n");
+	if (blacklist != NULL) freeBlacklist(blacklist);
+	for (int i = 0; workers != NULL && i < workerCount; i++) {
+		//free pending queries (their packets and waiters are in the pool)
+		if (workers[i].pending != NULL) {
+			free(workers[i].pending->entries);
+			free(workers[i].pending);
+		}
+		//free cached answers
+		if (workers[i].cache != NULL) freeAnswerCache(workers[i].cache);
+		//free packet buffers
+		free(workers[i].batch);
+		free(workers[i].clientQueue);
+		free(workers[i].serverQueues);
+		if (workers[i].backend != NULL) workers[i].backend->destroy(workers[i].backend);
+		if (workers[i].timers != NULL) {
+			free(workers[i].timers->timers);
+			free(workers[i].timers);
+		}
+		if (workers[i].inflight != NULL) {
+			free(workers[i].inflight->entries);
+			free(workers[i].inflight);
+		}
+		free(workers[i].log);
+		if (workers[i].pool != NULL) freeBufferPool(workers[i].pool);
+	}
+	free(workers);
+	free(rateBuckets);
+	exit(status);
+}
+
+/**
+ * @fn foldCase()
+ * @brief ASCII lowercase without branches (other bytes are not changed)
+ * @param c Character
+ * @return unsigned char lowercase character
+*/
+static inline unsigned char foldCase(unsigned char c) {
+	return c | ((unsigned char)(c - 'A') < 26) << 5;
+}
+
+/**
+ * @fn hashLabel()
+ * @brief FNV-1a hash of the label continuing the hash of the previous labels
+ * @param label Start of the label
+ * @param length Length of the label
+ * @param parent Hash of the previous labels
+ * @return uint32_t hash
+*/
+uint32_t hashLabel(const char *label, size_t length, uint32_t parent) {
+	uint32_t hash = (2166136261u ^ parent) * 16777619u;
+	for (size_t i = 0; i < length; i++) {
+		hash ^= (unsigned char)label[i];
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+/**
+ * @fn foldBytesScalar()
+ * @brief Lowercase the bytes one by one (fallback of foldBytes)
+ * @param source Bytes to fold
+ * @param destination Destination of the same length, may be the source
+ * @param length Number of bytes
+*/
+void foldBytesScalar(const unsigned char *source, unsigned char *destination, size_t length) {
+	for (size_t i = 0; i < length; i++) destination[i] = foldCase(source[i]);
+}
+
+// table of the CRC32C (Castagnoli) polynomial for the byte by byte fallback
+uint32_t crc32cTable[256];
+
+/**
+ * @fn crc32cScalar()
+ * @brief CRC32C of the bytes by the table (fallback of crc32c, without the final inversion like the instructions)
+ * @param crc Previous value
+ * @param data Bytes
+ * @param length Number of bytes
+ * @return uint32_t new value
+*/
+uint32_t crc32cScalar(uint32_t crc, const unsigned char *data, size_t length) {
+	for (size_t i = 0; i < length; i++) crc = crc32cTable[(crc ^ data[i]) & 0xff] ^ crc >> 8;
+	return crc;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+/**
+ * @fn foldBytesSse2()
+ * @brief Lowercase 16 bytes at once, 'A'..'Z' is shifted to the lowest signed values and found by one comparison
+ * @param source Bytes to fold
+ * @param destination Destination of the same length, may be the source
+ * @param length Number of bytes
+*/
+__attribute__((target("sse2")))
+void foldBytesSse2(const unsigned char *source, unsigned char *destination, size_t length) {
+	const __m128i shift = _mm_set1_epi8((char)(0x80 - 'A'));
+	const __m128i limit = _mm_set1_epi8((char)(0x80 + 26));
+	const __m128i bit = _mm_set1_epi8(0x20);
+	size_t i = 0;
+	for (; i + 16 <= length; i += 16) {
+		__m128i bytes = _mm_loadu_si128((const __m128i *)&source[i]);
+		__m128i upper = _mm_cmplt_epi8(_mm_add_epi8(bytes, shift), limit);
+		_mm_storeu_si128((__m128i *)&destination[i], _mm_or_si128(bytes, _mm_and_si128(upper, bit)));
+	}
+	foldBytesScalar(&source[i], &destination[i], length - i);
+}
+
+/**
+ * @fn foldBytesAvx2()
+ * @brief Lowercase 32 bytes at once (same as foldBytesSse2)
+ * @param source Bytes to fold
+ * @param destination Destination of the same length, may be the source
+ * @param length Number of bytes
+*/
+__attribute__((target("avx2")))
+void foldBytesAvx2(const unsigned char *source, unsigned char *destination, size_t length) {
+	const __m256i shift = _mm256_set1_epi8((char)(0x80 - 'A'));
+	const __m256i limit = _mm256_set1_epi8((char)(0x80 + 26));
+	const __m256i bit = _mm256_set1_epi8(0x20);
+	size_t i = 0;
+	for (; i + 32 <= length; i += 32) {
+		__m256i bytes = _mm256_loadu_si256((const __m256i *)&source[i]);
+		__m256i upper = _mm256_cmpgt_epi8(limit, _mm256_add_epi8(bytes, shift));
+		_mm256_storeu_si256((__m256i *)&destination[i], _mm256_or_si256(bytes, _mm256_and_si256(upper, bit)));
+	}
+	foldBytesSse2(&source[i], &destination[i], length - i);
+}
+
+/**
+ * @fn crc32cSse42()
+ * @brief CRC32C of the bytes by the SSE4.2 instruction (8 bytes per instruction on 64 bit)
+ * @param crc Previous value
+ * @param data Bytes
+ * @param length Number of bytes
+ * @return uint32_t new value
+*/
+__attribute__((target("sse4.2")))
+uint32_t crc32cSse42(uint32_t crc, const unsigned char *data, size_t length) {
+	size_t i = 0;
+#ifdef __x86_64__
+	for (; i + 8 <= length; i += 8) {
+		uint64_t word;
+		memcpy(&word, &data[i], 8);
+		crc = _mm_crc32_u64(crc, word);
+	}
+#endif
+	for (; i < length; i++) crc = _mm_crc32_u8(crc, data[i]);
+	return crc;
+}
+#elif defined(__aarch64__)
+/**
+ * @fn foldBytesNeon()
+ * @brief Lowercase 16 bytes at once, 'A'..'Z' is shifted to 0..25 and found by one unsigned comparison
+ * @param source Bytes to fold
+ * @param destination Destination of the same length, may be the source
+ * @param length Number of bytes
+*/
+void foldBytesNeon(const unsigned char *source, unsigned char *destination, size_t length) {
+	size_t i = 0;
+	for (; i + 16 <= length; i += 16) {
+		uint8x16_t bytes = vld1q_u8(&source[i]);
+		uint8x16_t upper = vcltq_u8(vsubq_u8(bytes, vdupq_n_u8('A')), vdupq_n_u8(26));
+		vst1q_u8(&destination[i], vorrq_u8(bytes, vandq_u8(upper, vdupq_n_u8(0x20))));
+	}
+	foldBytesScalar(&source[i], &destination[i], length - i);
+}
+
+/**
+ * @fn crc32cArm()
+ * @brief CRC32C of the bytes by the ARMv8 CRC instructions
+ * @param crc Previous value
+ * @param data Bytes
+ * @param length Number of bytes
+ * @return uint32_t new value
+*/
+__attribute__((target("+crc")))
+uint32_t crc32cArm(uint32_t crc, const unsigned char *data, size_t length) {
+	size_t i = 0;
+	for (; i + 8 <= length; i += 8) {
+		uint64_t word;
+		memcpy(&word, &data[i], 8);
+		crc = __crc32cd(crc, word);
+	}
+	for (; i < length; i++) crc = __crc32cb(crc, data[i]);
+	return crc;
+}
+#endif
+
+// lowercase and CRC32C functions for this CPU (chosen by selectNameFunctions(), all give the same results)
+void (*foldBytes)(const unsigned char *source, unsigned char *destination, size_t length) = foldBytesScalar;
+uint32_t (*crc32c)(uint32_t crc, const unsigned char *data, size_t length) = crc32cScalar;
+
+/**
+ * @fn selectNameFunctions()
+ * @brief Choose the vector versions of foldBytes and crc32c supported by the CPU (before any name is processed)
+*/
+void selectNameFunctions() {
+	for (uint32_t i = 0; i < 256; i++) {
+		uint32_t crc = i;
+		for (int bit = 0; bit < 8; bit++) crc = crc >> 1 ^ (0x82f63b78u & -(crc & 1));
+		crc32cTable[i] = crc;
+	}
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		foldBytes = foldBytesAvx2;
+	} else if (__builtin_cpu_supports("sse2")) {
+		foldBytes = foldBytesSse2;
+	}
+	if (__builtin_cpu_supports("sse4.2")) crc32c = crc32cSse42;
+#elif defined(__aarch64__)
+	foldBytes = foldBytesNeon;
+	if (getauxval(AT_HWCAP) & HWCAP_CRC32) crc32c = crc32cArm;
+#endif
+}
+
+/**
+ * @fn hashSuffix()
+ * @brief Suffix hash of the name made of the label and the parent suffix (CRC32C of the label in wire format)
+ * @param parent Hash of the parent suffix (0 is the root)
+ * @param label Lowercase label
+ * @param length Length of the label
+ * @return uint32_t hash
+*/
+uint32_t hashSuffix(uint32_t parent, const char *label, size_t length) {
+	unsigned char lengthByte = length;
+	return crc32c(crc32c(parent, &lengthByte, 1), (const unsigned char *)label, length);
+}
+
+/**
+ * @fn findEdge()
+ * @brief Find the slot of the edges table for the child of parent with the given label
+ * @param list Blacklist
+ * @param parent Index of the parent node
+ * @param hash Suffix hash of the child (see hashSuffix())
+ * @param label Start of the lowercase label
+ * @param length Length of the label
+ * @return uint32_t* slot with index of the child, or empty slot (0) where the child belongs
+*/
+uint32_t *findEdge(const struct blacklist_s *list, uint32_t parent, uint32_t hash, const char *label, size_t length) {
+	uint32_t slot = hash & list->tableMask;
+	while (list->edges[slot] != 0) {
+		const struct filterNode *node = &list->nodes[list->edges[slot]];
+		if (node->hash == hash && node->parent == parent && node->length == length
+			&& memcmp(&list->pool[node->label], label, length) == 0) {
+			break;
+		}
+		slot = (slot + 1) & list->tableMask;
+	}
+	return &list->edges[slot];
+}
+
+/**
+ * @fn insertName()
+ * @brief Insert the rule of the name to the blacklist trie (from the last label to the first one)
+ * @param list Blacklist with enough preallocated nodes and edges
+ * @param name Domain name (dot notation), must not point to the pool
+ * @param end Length of the name
+ * @param rules Rules of the name (RULE_*)
+ * @return int 0 on success, 1 when the name is not valid
+*/
+int insertName(struct blacklist_s *list, const char *name, size_t end, uint8_t rules) {
+	// ignore trailing dot of fully qualified names
+	if (end > 0 && name[end - 1] == '.') end--;
+	if (end == 0 || end > MAX_NAME_LENGTH) return EXIT_FAILURE;
+	for (size_t i = 0, labelStart = 0; i <= end; i++) {
+		if (i == end || name[i] == '.') {
+			if (i == labelStart || i - labelStart > MAX_LABEL_LENGTH) return EXIT_FAILURE;
+			labelStart = i + 1;
+		}
+	}
+	// rule of a parent domain which makes the new rule useless
+	uint8_t covering = rules & (RULE_ALLOW_NAME | RULE_ALLOW_SUBDOMAINS) ? RULE_ALLOW_SUBDOMAINS : RULE_BLOCK_SUBDOMAINS;
+	uint32_t parent = 0;
+	while (end > 0) {
+		size_t start = end;
+		while (start > 0 && name[start - 1] != '.') start--;
+		uint32_t hash = hashSuffix(list->nodes[parent].hash, &name[start], end - start);
+		uint32_t *edge = findEdge(list, parent, hash, &name[start], end - start);
+		if (*edge == 0) {
+			// create the node and copy its label to the pool
+			struct filterNode *node = &list->nodes[list->header->nodeCount];
+			node->label = list->header->poolSize;
+			node->parent = parent;
+			node->hash = hash;
+			node->length = end - start;
+			node->rules = 0;
+			memcpy(&list->pool[list->header->poolSize], &name[start], end - start);
+			list->header->poolSize += end - start;
+			*edge = list->header->nodeCount++;
+		}
+		parent = *edge;
+		// parent domain has the same rule for all its subdomains, nothing more to store
+		if (start > 0 && (list->nodes[parent].rules & covering)) return EXIT_SUCCESS;
+		end = start ? start - 1 : 0;
+	}
+	if ((list->nodes[parent].rules | rules) != list->nodes[parent].rules) {
+		list->header->size++;
+		if (covering == RULE_ALLOW_SUBDOMAINS) list->header->allowSize++;
+	}
+	list->nodes[parent].rules |= rules;
+	return EXIT_SUCCESS;
+}
+
+/**
+ * @fn rebuildEdges()
+ * @brief Fill the (zeroed) edges table from suffix hashes stored in nodes
+ * @param list Blacklist
+*/
+void rebuildEdges(struct blacklist_s *list) {
+	for (uint32_t i = 1; i < list->header->nodeCount; i++) {
+		const struct filterNode *node = &list->nodes[i];
+		uint32_t slot = node->hash & list->tableMask;
+		while (list->edges[slot] != 0) slot = (slot + 1) & list->tableMask;
+		list->edges[slot] = i;
+	}
+}
+
+/**
+ * @fn bloomBlock()
+ * @brief Block of the Bloom prefilter for the suffix hash (multiply and shift instead of modulo)
+ * @param list Blacklist
+ * @param hash Suffix hash
+ * @return uint32_t* first word of the block
+*/
+static inline uint32_t *bloomBlock(const struct blacklist_s *list, uint32_t hash) {
+	return &list->bloom[((uint64_t)hash * list->bloomBlocks >> 32) * BLOOM_BLOCK_WORDS];
+}
+
+/**
+ * @fn bloomMask()
+ * @brief Bit of one word of the block, every word uses other odd multiplier of the remixed hash (its top 5 bits)
+ * @param hash Suffix hash
+ * @param word Index of the word in the block
+ * @return uint32_t word with one bit set
+*/
+static inline uint32_t bloomMask(uint32_t hash, int word) {
+	static const uint32_t salts[BLOOM_BLOCK_WORDS] = {
+		0x47b6137bu, 0x44974d91u, 0x8824ad5bu, 0xa2b7289du, 0x705495c7u, 0x2df1424bu, 0x9efc4947u, 0x5c6bfb31u
+	};
+	// block is chosen by the top bits of the hash, bits use the hash mixed again
+	hash ^= hash >> 16;
+	hash *= 0x85ebca6bu;
+	hash ^= hash >> 13;
+	return UINT32_C(1) << ((hash * salts[word]) >> 27);
+}
+
+/**
+ * @fn bloomMayContain()
+ * @brief Check the suffix hash in the Bloom prefilter (one cache line, no branch per bit)
+ * @param list Blacklist
+ * @param hash Suffix hash
+ * @return bool false when the suffix is surely not blocked
+*/
+static inline bool bloomMayContain(const struct blacklist_s *list, uint32_t hash) {
+	const uint32_t *block = bloomBlock(list, hash);
+	uint32_t missing = 0;
+	for (int i = 0; i < BLOOM_BLOCK_WORDS; i++) {
+		uint32_t mask = bloomMask(hash, i);
+		missing |= (block[i] & mask) ^ mask;
+	}
+	return missing == 0;
+}
+
+/**
+ * @fn rebuildBloom()
+ * @brief Add all nodes with rules to the (zeroed) Bloom prefilter
+ * @param list Blacklist
+*/
+void rebuildBloom(struct blacklist_s *list) {
+	for (uint32_t i = 1; i < list->header->nodeCount; i++) {
+		const struct filterNode *node = &list->nodes[i];
+		if (!node->rules) continue;
+		uint32_t *block = bloomBlock(list, node->hash);
+		for (int j = 0; j < BLOOM_BLOCK_WORDS; j++) block[j] |= bloomMask(node->hash, j);
+	}
+}
+
+/**
+ * @fn setFilterPointers()
+ * @brief Set pointers of the blacklist according to offsets in the header
+ * @param list Blacklist
+ * @param header Header of the blacklist data
+*/
+void setFilterPointers(struct blacklist_s *list, struct filterHeader *header) {
+	list->header = header;
+	list->nodes = (struct filterNode *)((char *)header + header->nodesOffset);
+	list->edges = (uint32_t *)((char *)header + header->edgesOffset);
+	list->bloom = (uint32_t *)((char *)header + header->bloomOffset);
+	list->pool = (char *)header + header->poolOffset;
+	list->tableMask = header->tableMask;
+	list->bloomBlocks = header->bloomBlocks;
+}
+
+/**
+ * @fn freeFilterBuilder()
+ * @brief Free the growing arrays of the builder and the builder
+ * @param builder Builder
+*/
+void freeFilterBuilder(struct filterBuilder *builder) {
+	free(builder->list.nodes);
+	free(builder->list.edges);
+	free(builder->list.pool);
+	free(builder);
+}
+
+/**
+ * @fn newFilterBuilder()
+ * @brief Make the empty blacklist which grows while the filter files are read
+ * @return struct filterBuilder* new builder or NULL when there is not enough memory
+*/
+struct filterBuilder *newFilterBuilder() {
+	struct filterBuilder *builder = calloc(1, sizeof(struct filterBuilder));
+	if (!builder) return NULL;
+	struct blacklist_s *list = &builder->list;
+	list->header = &builder->header;
+	// the root node is zeroed
+	list->header->nodeCount = 1;
+	list->tableMask = 2 * FILTER_INITIAL_NODES - 1;
+	builder->nodeCapacity = FILTER_INITIAL_NODES;
+	builder->poolCapacity = FILTER_INITIAL_NODES * 8;
+	list->nodes = calloc(builder->nodeCapacity, sizeof(struct filterNode));
+	list->edges = calloc((size_t)list->tableMask + 1, sizeof(uint32_t));
+	list->pool = malloc(builder->poolCapacity);
+	if (!list->nodes || !list->edges || !list->pool) {
+		freeFilterBuilder(builder);
+		return NULL;
+	}
+	return builder;
+}
+
+/**
+ * @fn reserveFilter()
+ * @brief Make room for one more name (all its labels can be new nodes), the edges table stays at most half full
+ * @param builder Builder
+ * @return int 0 on success, 1 when there is not enough memory
+*/
+int reserveFilter(struct filterBuilder *builder) {
+	struct blacklist_s *list = &builder->list;
+	size_t nodes = (size_t)list->header->nodeCount + MAX_LABELS;
+	if (nodes > UINT32_MAX / 2) {
+		fprintf(stderr, "Filter is too big.\n");
+		return EXIT_FAILURE;
+	}
+	if (nodes > builder->nodeCapacity) {
+		struct filterNode *tmp = realloc(list->nodes, 2 * builder->nodeCapacity * sizeof(struct filterNode));
+		if (!tmp) goto noMemory;
+		list->nodes = tmp;
+		builder->nodeCapacity *= 2;
+	}
+	if (list->header->poolSize + MAX_NAME_LENGTH > builder->poolCapacity) {
+		char *tmp = realloc(list->pool, 2 * builder->poolCapacity);
+		if (!tmp) goto noMemory;
+		list->pool = tmp;
+		builder->poolCapacity *= 2;
+	}
+	if (2 * nodes > (size_t)list->tableMask + 1) {
+		size_t tableSize = 2 * ((size_t)list->tableMask + 1);
+		uint32_t *edges = calloc(tableSize, sizeof(uint32_t));
+		if (!edges) goto noMemory;
+		free(list->edges);
+		list->edges = edges;
+		list->tableMask = tableSize - 1;
+		rebuildEdges(list);
+	}
+	return EXIT_SUCCESS;
+noMemory:
+	fprintf(stderr, "Could not allocate filter names. Not enough memory.\n");
+	return EXIT_FAILURE;
+}
+
+/**
+ * @fn addRule()
+ * @brief Add the rule of the name to the built blacklist (names which are not valid are skipped)
+ * @param builder Builder
+ * @param name Name (dot notation, any case)
+ * @param length Length of the name
+ * @param rules Rules of the name (RULE_*)
+ * @return int 0 on success, 1 when there is not enough memory
+*/
+int addRule(struct filterBuilder *builder, const char *name, size_t length, uint8_t rules) {
+	if (length == 0 || length > MAX_NAME_LENGTH + 1) return EXIT_SUCCESS;
+	if (reserveFilter(builder)) return EXIT_FAILURE;
+	// names are stored lowercase, queries are compared ignoring case
+	char folded[MAX_NAME_LENGTH + 2];
+	foldBytes((const unsigned char *)name, (unsigned char *)folded, length);
+	insertName(&builder->list, folded, length, rules);
+	return EXIT_SUCCESS;
+}
+
+/**
+ * @fn isHostsAddress()
+ * @brief Check if the word is the IPv4 or IPv6 address starting the line of the hosts file
+ * @param word Start of the word
+ * @param length Length of the word
+ * @return bool true for the address
+*/
+bool isHostsAddress(const char *word, size_t length) {
+	char text[INET6_ADDRSTRLEN];
+	unsigned char address[sizeof(struct in6_addr)];
+	if (length >= sizeof(text)) return false;
+	memcpy(text, word, length);
+	text[length] = '\0';
+	return inet_pton(AF_INET, text, address) == 1 || inet_pton(AF_INET6, text, address) == 1;
+}
+
+/**
+ * @fn isLocalHost()
+ * @brief Check if the name of the hosts file is one of the names of this computer, which are never blocked
+ * @param name Start of the name
+ * @param length Length of the name
+ * @return bool true for the local name
+*/
+bool isLocalHost(const char *name, size_t length) {
+	static const char *localNames[] = {"localhost", "localhost.localdomain", "local", "broadcasthost", "ip6-localhost",
+		"ip6-loopback", "ip6-localnet", "ip6-mcastprefix", "ip6-allnodes", "ip6-allrouters", "ip6-allhosts", "0.0.0.0"};
+	for (size_t i = 0; i < sizeof(localNames) / sizeof(localNames[0]); i++) {
+		if (strlen(localNames[i]) == length && strncasecmp(localNames[i], name, length) == 0) return true;
+	}
+	return false;
+}
+
+/**
+ * @fn parseFilterLine()
+ * @brief Add the rules of one line of the filter file, the line is a rule of this server (name, *.name, =name and
+ * @@ before them, see RULE_*), a line of the hosts file (<ip> name [name ...] blocks the names with subdomains),
+ * or an adblock rule (||name^ is the name with subdomains, |name^ only the name, @@ allows, rules with options,
+ * paths or wildcards are skipped), # and ! start comments
+ * @param builder Builder
+ * @param line Start of the line
+ * @param length Length of the line without the new line
+ * @return int 0 on success, 1 when there is not enough memory
+*/
+int parseFilterLine(struct filterBuilder *builder, const char *line, size_t length) {
+	while (length > 0 && (line[0] == ' ' || line[0] == '\t')) {
+		line++;
+		length--;
+	}
+	// [Adblock Plus 2.0] header is skipped as a comment too
+	if (length == 0 || line[0] == '#' || line[0] == '!' || line[0] == '[') return EXIT_SUCCESS;
+	// the rule ends with first white space or control character
+	size_t word = 0;
+	while (word < length && (unsigned char)line[word] > ' ') word++;
+	if (word < length && isHostsAddress(line, word)) {
+		for (size_t position = word; position < length;) {
+			while (position < length && (unsigned char)line[position] <= ' ') position++;
+			if (position == length || line[position] == '#') break;
+			size_t start = position;
+			while (position < length && (unsigned char)line[position] > ' ') position++;
+			if (isLocalHost(&line[start], position - start)) continue;
+			if (addRule(builder, &line[start], position - start, RULE_BLOCK_NAME | RULE_BLOCK_SUBDOMAINS)) {
+				return EXIT_FAILURE;
+			}
+		}
+		return EXIT_SUCCESS;
+	}
+	// type of the rule is given by its prefix (@@ allows, = is only the name, *. only the subdomains)
+	uint8_t rules = RULE_BLOCK_NAME | RULE_BLOCK_SUBDOMAINS;
+	bool allow = word > 2 && line[0] == '@' && line[1] == '@';
+	if (allow) {
+		line += 2;
+		word -= 2;
+	}
+	if (word > 1 && line[0] == '|') {
+		bool subdomains = line[1] == '|';
+		if (!subdomains) rules = RULE_BLOCK_NAME;
+		line += subdomains ? 2 : 1;
+		word -= subdomains ? 2 : 1;
+		size_t end = 0;
+		while (end < word && (isalnum((unsigned char)line[end]) || line[end] == '-' || line[end] == '_' || line[end] == '.')) {
+			end++;
+		}
+		// only ^ (and | of the end of the address) can follow the name of the rule for the whole domain
+		if (end < word && line[end] != '^') return EXIT_SUCCESS;
+		if (end + 1 < word && !(end + 2 == word && line[end + 1] == '|')) return EXIT_SUCCESS;
+		word = end;
+	} else if (word > 1 && line[0] == '=') {
+		rules = RULE_BLOCK_NAME;
+		line++;
+		word--;
+	} else if (word > 2 && line[0] == '*' && line[1] == '.') {
+		rules = RULE_BLOCK_SUBDOMAINS;
+		line += 2;
+		word -= 2;
+	}
+	// allow bits are the block bits moved by two
+	if (allow) rules <<= 2;
+	return addRule(builder, line, word, rules);
+}
+
+/**
+ * @fn readFilterText()
+ * @brief Read the text filter file by big chunks and add the rules of its lines, the file is never held whole,
+ * so it can be a pipe or a file of several GB (only lines up to FILTER_LINE_SIZE are parsed)
+ * @param builder Builder
+ * @param fd Descriptor of the opened file
+ * @param name Name of the file (for errors)
+ * @return int 0 on success, 1 on error
+*/
+int readFilterText(struct filterBuilder *builder, int fd, const char *name) {
+	char *buffer = malloc(FILTER_LINE_SIZE + FILTER_CHUNK_SIZE);
+	if (!buffer) {
+		fprintf(stderr, "Could not allocate filter names. Not enough memory.\n");
+		return EXIT_FAILURE;
+	}
+	// start of the line which continues in the next chunk is moved to the start of the buffer
+	size_t kept = 0;
+	bool skipping = false;
+	int result = EXIT_SUCCESS;
+	while (result == EXIT_SUCCESS) {
+		ssize_t length = read(fd, buffer + kept, FILTER_CHUNK_SIZE);
+		if (length < 0 && errno == EINTR) continue;
+		if (length < 0) {
+			fprintf(stderr, "Error reading filter file %s: %s\n", name, strerror(errno));
+			result = EXIT_FAILURE;
+			break;
+		}
+		if (length == 0) {
+			// last line without the new line
+			if (kept > 0 && !skipping) result = parseFilterLine(builder, buffer, kept);
+			break;
+		}
+		char *lineStart = buffer, *bufferEnd = buffer + kept + length, *lineEnd;
+		while (result == EXIT_SUCCESS && (lineEnd = memchr(lineStart, '\n', bufferEnd - lineStart)) != NULL) {
+			if (!skipping) result = parseFilterLine(builder, lineStart, lineEnd - lineStart);
+			skipping = false;
+			lineStart = lineEnd + 1;
+		}
+		kept = bufferEnd - lineStart;
+		if (skipping || kept > FILTER_LINE_SIZE) {
+			// too long line is skipped up to its end
+			skipping = true;
+			kept = 0;
+		} else {
+			memmove(buffer, lineStart, kept);
+		}
+	}
+	free(buffer);
+	return result;
+}
+
+/**
+ * @fn mergeFilter()
+ * @brief Add the rules of the compiled filter to the built blacklist (names are made again from the labels)
+ * @param builder Builder
+ * @param list Compiled filter
+ * @return int 0 on success, 1 when there is not enough memory
+*/
+int mergeFilter(struct filterBuilder *builder, const struct blacklist_s *list) {
+	char name[MAX_NAME_LENGTH + 1];
+	for (uint32_t i = 1; i < list->header->nodeCount; i++) {
+		uint8_t rules = list->nodes[i].rules;
+		if (!rules) continue;
+		// labels from the node to the root, broken parents of the file end the name
+		size_t length = 0;
+		uint32_t node = i;
+		for (int depth = 0; node != 0 && node < list->header->nodeCount && depth < MAX_LABELS; depth++) {
+			const struct filterNode *label = &list->nodes[node];
+			if (length + label->length + 1 > MAX_NAME_LENGTH) break;
+			if (length) name[length++] = '.';
+			memcpy(&name[length], &list->pool[label->label], label->length);
+			length += label->length;
+			node = label->parent;
+		}
+		if (node != 0) continue;
+		// block and allow rules are counted separately
+		uint8_t kinds[2] = {rules & (RULE_BLOCK_NAME | RULE_BLOCK_SUBDOMAINS), rules & (RULE_ALLOW_NAME | RULE_ALLOW_SUBDOMAINS)};
+		for (int kind = 0; kind < 2; kind++) {
+			if (kinds[kind] && addRule(builder, name, length, kinds[kind])) return EXIT_FAILURE;
+		}
+	}
+	return EXIT_SUCCESS;
+}
+
+/**
+ * @fn finishFilter()
+ * @brief Move the built blacklist to one arena [struct blacklist_s][header][nodes][edges][bloom][label pool], make
+ * its edges for the final size and the prefilter, the builder is freed
+ * @param builder Builder
+ * @return struct blacklist_s* new blacklist or NULL on error
+*/
+struct blacklist_s *finishFilter(struct filterBuilder *builder) {
+	struct blacklist_s *built = &builder->list;
+	// edges are made again, the old table is freed first to lower the peak of memory
+	free(built->edges);
+	built->edges = NULL;
+	size_t tableSize = 2;
+	while (tableSize < 2 * (size_t)built->header->nodeCount) tableSize *= 2;
+	size_t bloomBlocks = (built->header->size * BLOOM_BITS_PER_NAME + BLOOM_BLOCK_WORDS * 32 - 1) / (BLOOM_BLOCK_WORDS * 32);
+	if (bloomBlocks == 0) bloomBlocks = 1;
+	size_t headerOffset = sizeof(struct blacklist_s);
+	size_t nodesOffset = sizeof(struct filterHeader);
+	size_t edgesOffset = nodesOffset + built->header->nodeCount * sizeof(struct filterNode);
+	// blocks start at a cache line boundary of the file
+	size_t bloomOffset = (edgesOffset + tableSize * sizeof(uint32_t) + 63) & ~(size_t)63;
+	size_t poolOffset = bloomOffset + bloomBlocks * BLOOM_BLOCK_WORDS * sizeof(uint32_t);
+	char *arena = calloc(1, headerOffset + poolOffset + built->header->poolSize);
+	if (!arena) {
+		fprintf(stderr, "Could not allocate filter names. Not enough memory.\n");
+		freeFilterBuilder(builder);
+		return NULL;
+	}
+	struct blacklist_s *list = (struct blacklist_s *)arena;
+	struct filterHeader *header = (struct filterHeader *)(arena + headerOffset);
+	*header = *built->header;
+	header->magic = FILTER_MAGIC;
+	header->version = FILTER_VERSION;
+	header->tableMask = tableSize - 1;
+	header->nodesOffset = nodesOffset;
+	header->edgesOffset = edgesOffset;
+	header->bloomOffset = bloomOffset;
+	header->bloomBlocks = bloomBlocks;
+	header->poolOffset = poolOffset;
+	header->totalSize = poolOffset + header->poolSize;
+	setFilterPointers(list, header);
+	memcpy(list->nodes, built->nodes, header->nodeCount * sizeof(struct filterNode));
+	memcpy(list->pool, built->pool, header->poolSize);
+	freeFilterBuilder(builder);
+	rebuildEdges(list);
+	rebuildBloom(list);
+	return list;
+}
+
+/**
+ * @fn rangeFits()
+ * @brief Check that count items of the size starting at the offset end at the limit at most (without overflow)
+ * @param offset Start
+ * @param count Number of items
+ * @param size Size of one item
+ * @param limit End of the space
+ * @return bool true when the items fit
+*/
+bool rangeFits(uint64_t offset, uint64_t count, uint64_t size, uint64_t limit) {
+	return offset <= limit && count <= (limit - offset) / size;
+}
+
+/**
+ * @fn checkFilterData()
+ * @brief Check every node and edge of the mapped filter once, so lookups can trust the file: labels are inside
+ * the pool, parents are older nodes (no cycles), edges point to nodes and the edges table has empty slots
+ * (probing ends)
+ * @param list Blacklist with the pointers set
+ * @return int 0 when the data is valid, 1 otherwise
+*/
+int checkFilterData(const struct blacklist_s *list) {
+	const struct filterHeader *header = list->header;
+	const struct filterNode *root = &list->nodes[0];
+	if (root->parent != 0 || root->length != 0 || root->rules != 0) return EXIT_FAILURE;
+	for (uint32_t i = 1; i < header->nodeCount; i++) {
+		const struct filterNode *node = &list->nodes[i];
+		if (node->parent >= i || node->length == 0 || node->length > MAX_LABEL_LENGTH
+			|| !rangeFits(node->label, node->length, 1, header->poolSize)) {
+			return EXIT_FAILURE;
+		}
+	}
+	// every node except the root has one edge
+	uint64_t used = 0;
+	for (uint64_t slot = 0; slot <= header->tableMask; slot++) {
+		if (list->edges[slot] == 0) continue;
+		if (list->edges[slot] >= header->nodeCount) return EXIT_FAILURE;
+		used++;
+	}
+	return used < header->nodeCount ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/**
+ * @fn mapFilter()
+ * @brief Map the compiled filter file read only (no parsing, pages are shared between processes)
+ * @param fd Descriptor of the opened file
+ * @param size Size of the file
+ * @param name Name of the file (for errors)
+ * @return struct blacklist_s* new blacklist or NULL on error
+*/
+struct blacklist_s *mapFilter(int fd, size_t size, const char *name) {
+	void *mapped = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+	if (mapped == MAP_FAILED) {
+		fprintf(stderr, "Could not map compiled filter file %s: %s\n", name, strerror(errno));
+		return NULL;
+	}
+	struct filterHeader *header = mapped;
+	// check that all parts of the data are inside the file (in order and aligned), then their contents
+	uint64_t tableSize = (uint64_t)header->tableMask + 1;
+	if (size < sizeof(struct filterHeader) || header->version != FILTER_VERSION || header->totalSize > size
+		|| header->nodeCount == 0 || (tableSize & header->tableMask) != 0 || tableSize < 2 * (uint64_t)header->nodeCount
+		|| header->nodesOffset < sizeof(struct filterHeader) || header->nodesOffset % sizeof(uint32_t) != 0
+		|| !rangeFits(header->nodesOffset, header->nodeCount, sizeof(struct filterNode), header->edgesOffset)
+		|| header->edgesOffset % sizeof(uint32_t) != 0
+		|| !rangeFits(header->edgesOffset, tableSize, sizeof(uint32_t), header->bloomOffset)
+		|| header->bloomBlocks == 0 || header->bloomBlocks > UINT32_MAX || header->bloomOffset % sizeof(uint32_t) != 0
+		|| !rangeFits(header->bloomOffset, header->bloomBlocks, BLOOM_BLOCK_WORDS * sizeof(uint32_t), header->poolOffset)
+		|| !rangeFits(header->poolOffset, header->poolSize, 1, header->totalSize)) {
+		fprintf(stderr, "Compiled filter file is corrupted or has unsupported version: %s\n", name);
+		munmap(mapped, size);
+		return NULL;
+	}
+	struct blacklist_s *list = calloc(1, sizeof(struct blacklist_s));
+	if (!list) {
+		fprintf(stderr, "Could not allocate filter names. Not enough memory.\n");
+		munmap(mapped, size);
+		return NULL;
+	}
+	list->mapped = mapped;
+	list->mappedSize = size;
+	setFilterPointers(list, header);
+	if (checkFilterData(list)) {
+		fprintf(stderr, "Compiled filter file is corrupted or has unsupported version: %s\n", name);
+		freeBlacklist(list);
+		return NULL;
+	}
+	return list;
+}
+
+/**
+ * @fn loadFilter()
+ * @brief Load the filter files (text or compiled), one compiled file is mapped, more files are merged to one
+ * built blacklist so that duplicate names are stored once and only the rules take memory
+ * @param names Names of the files
+ * @param count Number of the files
+ * @return struct blacklist_s* new blacklist or NULL on error
+*/
+struct blacklist_s *loadFilter(char **names, int count) {
+	struct filterBuilder *builder = newFilterBuilder();
+	if (!builder) {
+		fprintf(stderr, "Could not allocate filter names. Not enough memory.\n");
+		return NULL;
+	}
+	for (int i = 0; i < count; i++) {
+		int fd = open(names[i], O_RDONLY);
+		struct stat fileStat;
+		if (fd == -1 || fstat(fd, &fileStat) == -1) {
+			fprintf(stderr, "Error opening filter file: %s\n", names[i]);
+			if (fd != -1) close(fd);
+			freeFilterBuilder(builder);
+			return NULL;
+		}
+		// compiled filter file starts with the magic number, pipes are always text
+		uint32_t magic = 0;
+		int result;
+		if (S_ISREG(fileStat.st_mode) && (size_t)fileStat.st_size >= sizeof(struct filterHeader)
+			&& pread(fd, &magic, sizeof(magic), 0) == sizeof(magic) && magic == FILTER_MAGIC) {
+			struct blacklist_s *compiled = mapFilter(fd, fileStat.st_size, names[i]);
+			close(fd);
+			if (compiled && count == 1) {
+				freeFilterBuilder(builder);
+				return compiled;
+			}
+			result = compiled ? mergeFilter(builder, compiled) : EXIT_FAILURE;
+			if (compiled) freeBlacklist(compiled);
+		} else {
+			result = readFilterText(builder, fd, names[i]);
+			close(fd);
+		}
+		if (result) {
+			freeFilterBuilder(builder);
+			return NULL;
+		}
+	}
+	return finishFilter(builder);
+}
+
+/**
+ * @fn getDnsFilter()
+ * @brief Load the filter files and store them as the blacklist (before the reader runs)
+ * @param names Names of the files
+ * @param count Number of the files
+ * @return int 0 on success, 1 on error
+*/
+int getDnsFilter(char **names, int count) {
+	struct blacklist_s *list = loadFilter(names, count);
+	if (!list) return EXIT_FAILURE;
+	if (blacklist != NULL) freeBlacklist(blacklist);
+	blacklist = list;
+	return EXIT_SUCCESS;
+}
+
+/**
+ * @fn readerOnline()
+ * @brief Announce that the worker is going to use the blacklist
+ * @param worker Worker
+*/
+void readerOnline(struct worker *worker) {
+	__atomic_store_n(&worker->generation, __atomic_load_n(&blacklistGeneration, __ATOMIC_SEQ_CST), __ATOMIC_SEQ_CST);
+}
+
+/**
+ * @fn readerOffline()
+ * @brief Announce that the worker does not hold any reference to the blacklist
+ * @param worker Worker
+*/
+void readerOffline(struct worker *worker) {
+	__atomic_store_n(&worker->generation, 0, __ATOMIC_RELEASE);
+}
+
+/**
+ * @fn reloadThread()
+ * @brief Wait for SIGHUP, rebuild the blacklist and publish it by a pointer swap (workers never wait)
+ * @param arg Not used
+ * @return void* Never returns
+*/
+void *reloadThread(void *arg) {
+	(void)arg;
+	sigset_t signals;
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGHUP);
+	while (1) {
+		int signalNumber;
+		if (sigwait(&signals, &signalNumber) != 0) continue;
+		fprintf(stderr, "SIGHUP received, reloading %d filter files\n", filterFileCount);
+		// pipes were read at the start and can not be read again
+		bool regular = true;
+		for (int i = 0; i < filterFileCount; i++) {
+			struct stat fileStat;
+			if (stat(filterFileNames[i], &fileStat) == 0 && !S_ISREG(fileStat.st_mode)) regular = false;
+		}
+		if (!regular) {
+			fprintf(stderr, "Filter file is not a regular file, old filter stays in use.\n");
+			continue;
+		}
+		struct blacklist_s *list = loadFilter(filterFileNames, filterFileCount);
+		if (!list) {
+			fprintf(stderr, "Reloading failed, old filter stays in use.\n");
+			continue;
+		}
+		struct blacklist_s *old = __atomic_exchange_n(&blacklist, list, __ATOMIC_SEQ_CST);
+		unsigned long generation = __atomic_add_fetch(&blacklistGeneration, 1, __ATOMIC_SEQ_CST);
+		// wait until every worker passes a quiescent state, then nobody can reference the old blacklist
+		for (int i = 0; i < workerCount; i++) {
+			unsigned long reader;
+			while ((reader = __atomic_load_n(&workers[i].generation, __ATOMIC_SEQ_CST)) != 0 && reader < generation) {
+				usleep(1000);
+			}
+		}
+		freeBlacklist(old);
+		fprintf(stderr, "Filter reloaded, %lu filter names loaded.\n", (unsigned long)list->header->size);
+	}
+	return NULL;
+}
+
+/**
+ * @fn compileFilter()
+ * @brief Build the blacklist from the filter files and write it as compiled filter file
+ * @param inputs Names of the filter files
+ * @param count Number of the filter files
+ * @param output Name of the compiled filter file
+ * @return int 0 on success, 1 on error
+*/
+int compileFilter(char **inputs, int count, char *output) {
+	if (getDnsFilter(inputs, count)) return EXIT_FAILURE;
+	// write to temporary file and rename it, running servers may have the old file mapped
+	char tmpName[strlen(output) + 5];
+	sprintf(tmpName, "%s.tmp", output);
+	int fd = open(tmpName, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd == -1) {
+		fprintf(stderr, "Error opening output file %s: %s\n", tmpName, strerror(errno));
+		return EXIT_FAILURE;
+	}
+	const char *data = (const char *)blacklist->header;
+	size_t done = 0;
+	while (done < blacklist->header->totalSize) {
+		ssize_t length = write(fd, data + done, blacklist->header->totalSize - done);
+		if (length < 0) {
+			fprintf(stderr, "Error writing output file %s: %s\n", tmpName, strerror(errno));
+			close(fd);
+			unlink(tmpName);
+			return EXIT_FAILURE;
+		}
+		done += length;
+	}
+	close(fd);
+	if (rename(tmpName, output) == -1) {
+		fprintf(stderr, "Error renaming output file %s: %s\n", tmpName, strerror(errno));
+		unlink(tmpName);
+		return EXIT_FAILURE;
+	}
+	printf("Compiled %lu filter names (%u nodes, %lu bytes) to %s\n", (unsigned long)blacklist->header->size,
+		blacklist->header->nodeCount, (unsigned long)blacklist->header->totalSize, output);
+	return EXIT_SUCCESS;
+}
+
+/**
+ * @fn skipName()
+ * @brief Skip the (possibly compressed) name in the DNS packet
+ * @param packet DNS packet
+ * @param length Length of the packet
+ * @param offset Offset of the name
+ * @return int offset behind the name or -1 when the name is not valid
+ */
+int skipName(const unsigned char *packet, int length, int offset) {
+	while (offset < length) {
+		if (packet[offset] == 0) return offset + 1;
+		// compression pointer ends the name
+		if ((packet[offset] & 0xc0) == 0xc0) return offset + 2 <= length ? offset + 2 : -1;
+		if (packet[offset] & 0xc0) return -1;
+		offset += packet[offset] + 1;
+	}
+	return -1;
+}
+
+/**
+ * @fn parseDnsPacket()
+ * @brief Parse the header, the question and the offsets of all sections in one pass, the packet is not copied,
+ * names longer than 255 bytes, wrong labels, forward compression pointers, records behind the packet
+ * and more than one OPT record are rejected
+ * @param packet DNS packet
+ * @param length Length of the packet
+ * @param view Destination of the view
+ * @return int 0 on success, 1 when the packet is malformed
+ */
+int parseDnsPacket(const char *packet, unsigned length, struct dnsView *view) {
+	const unsigned char *data = (const unsigned char *)packet;
+	view->packet = data;
+	view->length = length;
+	if (length < 12 || length > UINT16_MAX || (data[4] << 8 | data[5]) != 1) return EXIT_FAILURE;
+	// question name, pointers have to go back so they can not loop
+	unsigned offset = 12, end = 0, limit = 12, nameLength = 1;
+	view->labelCount = 0;
+	while (1) {
+		if (offset >= length) return EXIT_FAILURE;
+		unsigned label = data[offset];
+		if (label == 0) break;
+		if ((label & 0xc0) == 0xc0) {
+			if (offset + 2 > length) return EXIT_FAILURE;
+			unsigned target = (label & 0x3f) << 8 | data[offset + 1];
+			if (target >= limit) return EXIT_FAILURE;
+			if (!end) end = offset + 2;
+			limit = target;
+			offset = target;
+			continue;
+		}
+		if (label & 0xc0 || view->labelCount == MAX_LABELS) return EXIT_FAILURE;
+		nameLength += label + 1;
+		if (nameLength > MAX_NAME_LENGTH || offset + 1 + label > length) return EXIT_FAILURE;
+		view->labels[view->labelCount++] = offset;
+		offset += label + 1;
+	}
+	if (!end) end = offset + 1;
+	if (end + 4 > length) return EXIT_FAILURE;
+	view->nameLength = nameLength;
+	view->type = data[end] << 8 | data[end + 1];
+	view->class = data[end + 2] << 8 | data[end + 3];
+	view->questionEnd = end + 4;
+	// sections of resource records
+	offset = view->questionEnd;
+	view->opt = 0;
+	for (int section = 0; section < 3; section++) {
+		view->sections[section] = offset;
+		unsigned count = data[6 + 2 * section] << 8 | data[7 + 2 * section];
+		for (unsigned i = 0; i < count; i++) {
+			int next = skipName(data, length, offset);
+			if (next < 0 || (unsigned)next + 10 > length) return EXIT_FAILURE;
+			// only one OPT record with the root name is allowed
+			if (section == 2 && (data[next] << 8 | data[next + 1]) == ns_t_opt) {
+				if (view->opt || (unsigned)next != offset + 1) return EXIT_FAILURE;
+				view->opt = offset;
+			}
+			offset = next + 10 + (data[next + 8] << 8 | data[next + 9]);
+			if (offset > length) return EXIT_FAILURE;
+		}
+	}
+	view->recordsEnd = offset;
+	return EXIT_SUCCESS;
+}
+
+/**
+ * @fn formatName()
+ * @brief Write the question name in the dot notation (for messages)
+ * @param view Parsed packet
+ * @param text Destination, at least MAX_NAME_LENGTH + 1 bytes
+ */
+void formatName(const struct dnsView *view, char *text) {
+	unsigned position = 0;
+	for (unsigned i = 0; i < view->labelCount; i++) {
+		const unsigned char *label = &view->packet[view->labels[i]];
+		if (i) text[position++] = '.';
+		memcpy(&text[position], label + 1, label[0]);
+		position += label[0];
+	}
+	text[position] = '\0';
+}
+
+/**
+ * @fn makeNameKey()
+ * @brief Fold the question name to lowercase and hash all its suffixes (one pass over the name from the root)
+ * @param view Parsed packet
+ * @param key Destination key
+ */
+void makeNameKey(const struct dnsView *view, struct nameKey *key) {
+	key->length = view->nameLength;
+	key->labelCount = view->labelCount;
+	if (12 + view->nameLength + 4 == view->questionEnd) {
+		// the name is not compressed, fold it directly from the packet
+		foldBytes(&view->packet[12], key->bytes, view->nameLength);
+		for (unsigned i = 0; i < view->labelCount; i++) key->labels[i] = view->labels[i] - 12;
+	} else {
+		unsigned position = 0;
+		for (unsigned i = 0; i < view->labelCount; i++) {
+			const unsigned char *label = &view->packet[view->labels[i]];
+			memcpy(&key->bytes[position], label, label[0] + 1);
+			key->labels[i] = position;
+			position += label[0] + 1;
+		}
+		key->bytes[position] = 0;
+		foldBytes(key->bytes, key->bytes, position);
+	}
+	// length bytes are below 'A', folding does not change them
+	uint32_t hash = 0;
+	key->suffixHashes[view->labelCount] = hash;
+	for (unsigned i = view->labelCount; i > 0; i--) {
+		const unsigned char *label = &key->bytes[key->labels[i - 1]];
+		hash = crc32c(hash, label, label[0] + 1);
+		key->suffixHashes[i - 1] = hash;
+	}
+}
+
+/**
+ * @fn mayBeBlacklisted()
+ * @brief Check the suffixes of the name in the Bloom prefilter
+ * @param list Blacklist
+ * @param key Folded question name with its suffix hashes
+ * @return bool false when neither the name nor any of its parent domains is blacklisted
+*/
+bool mayBeBlacklisted(const struct blacklist_s *list, const struct nameKey *key) {
+	bool maybe = false;
+	for (unsigned i = 0; i < key->labelCount; i++) maybe |= bloomMayContain(list, key->suffixHashes[i]);
+	return maybe;
+}
+
+/**
+ * @fn findBlacklisted()
+ * @brief Walk the trie from the top level domain, rules of the parent domains for their subdomains and rules of the
+ * name itself are resolved in the same walk, it stops at the first block rule when the filter has no allow rules
+ * @param list Blacklist
+ * @param key Folded question name with its suffix hashes
+ * @return int 1 if it is blacklisted, 0 if it in not blacklisted
+*/
+int findBlacklisted(const struct blacklist_s *list, const struct nameKey *key) {
+	// slots of all suffixes are known in advance, load them in parallel
+	for (unsigned i = 0; i < key->labelCount; i++) __builtin_prefetch(&list->edges[key->suffixHashes[i] & list->tableMask]);
+	uint32_t node = 0;
+	int blocked = 0;
+	for (unsigned i = key->labelCount; i > 0; i--) {
+		const unsigned char *label = &key->bytes[key->labels[i - 1]];
+		node = *findEdge(list, node, key->suffixHashes[i - 1], (const char *)label + 1, label[0]);
+		if (node == 0) break;
+		uint8_t rules = list->nodes[node].rules & (i == 1 ? RULE_BLOCK_NAME | RULE_ALLOW_NAME
+			: RULE_BLOCK_SUBDOMAINS | RULE_ALLOW_SUBDOMAINS);
+		if (rules & (RULE_ALLOW_NAME | RULE_ALLOW_SUBDOMAINS)) return 0;
+		if (rules) {
+			// found a match, only an allow rule of a subdomain can change it
+			if (list->header->allowSize == 0) return 1;
+			blocked = 1;
+		}
+	}
+	return blocked;
+}
+
+/**
+ * @fn isBlacklisted()
+ * @brief Check if the question name or any of its parent domains is blacklisted.
+ * @param key Folded question name with its suffix hashes
+ * @return int 1 if it is blacklisted, 0 if it in not blacklisted
+*/
+int isBlacklisted(const struct nameKey *key) {
+	const struct blacklist_s *list = __atomic_load_n(&blacklist, __ATOMIC_ACQUIRE);
+	// most names are not blocked, the prefilter answers them without touching the trie
+	if (!mayBeBlacklisted(list, key)) return 0;
+	return findBlacklisted(list, key);
+}
+
+/**
+ * @fn countStat()
+ * @brief Count the event in the statistics of the worker (only the worker writes them, so no locked instruction
+ * is needed)
+ * @param worker Worker
+ * @param counter Counted event
+ */
+static inline void countStat(struct worker *worker, enum statCounter counter) {
+	uint64_t *value = &worker->stats.counters[counter];
+	__atomic_store_n(value, __atomic_load_n(value, __ATOMIC_RELAXED) + 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * @fn countRtt()
+ * @brief Add the round trip time of the answer to the histogram of the worker
+ * @param worker Worker
+ * @param rtt Round trip time in microseconds
+ */
+static inline void countRtt(struct worker *worker, uint64_t rtt) {
+	unsigned bucket = rtt >> STATS_RTT_MIN_BITS ? 64 - __builtin_clzll(rtt) - STATS_RTT_MIN_BITS : 0;
+	if (bucket > STATS_RTT_BUCKETS) bucket = STATS_RTT_BUCKETS;
+	uint64_t *value = &worker->stats.rtt[bucket];
+	__atomic_store_n(value, __atomic_load_n(value, __ATOMIC_RELAXED) + 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&worker->stats.rttSum, __atomic_load_n(&worker->stats.rttSum, __ATOMIC_RELAXED) + rtt, __ATOMIC_RELAXED);
+}
+
+/**
+ * @fn logEntry()
+ * @brief Put the entry about the packet to the query log ring of the worker, the log thread writes it out later,
+ * the entry is dropped (and counted) when the ring is full so the worker never waits
+ * @param worker Worker
+ * @param in Address of the source
+ * @param type Form of the entry (string literal, only the pointer is stored)
+ * @param view Parsed DNS packet with the name (NULL when it is not known)
+ * @param out Address of the destination
+ * @param answer Bool whether to log query (0) or answer (1)
+ */
+void logEntry(struct worker *worker, const struct sockaddr_in6 *in, const char *type, const struct dnsView *view,
+	const struct sockaddr_in6 *out, bool answer) {
+	struct logRing *ring = worker->log;
+	if (!ring) return;
+	uint64_t head = ring->head;
+	if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == LOG_RING_SIZE) {
+		countStat(worker, STAT_LOG_DROPPED);
+		return;
+	}
+	struct logRecord *record = &ring->records[head & (LOG_RING_SIZE - 1)];
+	struct timespec time;
+	clock_gettime(CLOCK_REALTIME_COARSE, &time);
+	record->time = (uint64_t)time.tv_sec * 1000 + time.tv_nsec / 1000000;
+	record->type = type;
+	record->inIp = in->sin6_addr;
+	record->inPort = ntohs(in->sin6_port);
+	record->outIp = out->sin6_addr;
+	record->outPort = ntohs(out->sin6_port);
+	record->answer = answer;
+	if (view) {
+		formatName(view, record->name);
+	} else {
+		strcpy(record->name, "unknown name");
+	}
+	__atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * @fn growPoolClass()
+ * @brief Allocate next chunk of buffers of the size class and link them to its free list
+ * @param class Size class
+ * @param size Size of the buffers
+ * @return int 0 on success, 1 when there is not enough memory
+ */
+int growPoolClass(struct poolClass *class, unsigned size) {
+	if (class->chunkCount == class->chunkAllocated) {
+		unsigned allocated = class->chunkAllocated ? class->chunkAllocated * 2 : 8;
+		char **chunks = realloc(class->chunks, allocated * sizeof(char *));
+		if (!chunks) return EXIT_FAILURE;
+		class->chunks = chunks;
+		class->chunkAllocated = allocated;
+	}
+	char *chunk = aligned_alloc(64, (size_t)size * POOL_CHUNK_BUFFERS);
+	if (!chunk) return EXIT_FAILURE;
+	class->chunks[class->chunkCount++] = chunk;
+	for (int i = POOL_CHUNK_BUFFERS - 1; i >= 0; i--) {
+		void **buffer = (void **)(chunk + (size_t)i * size);
+		*buffer = class->free;
+		class->free = buffer;
+	}
+	class->buffers += POOL_CHUNK_BUFFERS;
+	return EXIT_SUCCESS;
+}
+
+/**
+ * @fn newBufferPool()
+ * @brief Allocate the pool with one chunk of buffers of every size class
+ * @return struct bufferPool* new pool or NULL when there is not enough memory
+ */
+struct bufferPool *newBufferPool() {
+	struct bufferPool *pool = calloc(1, sizeof(struct bufferPool));
+	if (!pool) return NULL;
+	for (int i = 0; i < POOL_CLASSES; i++) {
+		if (growPoolClass(&pool->classes[i], poolSizes[i])) {
+			freeBufferPool(pool);
+			return NULL;
+		}
+	}
+	return pool;
+}
+
+/**
+ * @fn poolClassIndex()
+ * @brief Find the smallest size class for the length
+ * @param length Length of the data
+ * @return int index of the class, POOL_CLASSES when the data is too long
+ */
+static inline int poolClassIndex(unsigned length) {
+	int index = 0;
+	while (index < POOL_CLASSES && poolSizes[index] < length) index++;
+	return index;
+}
+
+/**
+ * @fn poolGet()
+ * @brief Take the buffer for the data from the pool, new chunk is allocated only when the class has no free buffer
+ * @param pool Pool
+ * @param length Length of the data
+ * @return void* buffer (aligned to the cache line) or NULL when the data is too long or there is not enough memory
+ */
+void *poolGet(struct bufferPool *pool, unsigned length) {
+	int index = poolClassIndex(length);
+	if (index == POOL_CLASSES) return NULL;
+	struct poolClass *class = &pool->classes[index];
+	if (!class->free && growPoolClass(class, poolSizes[index])) return NULL;
+	void **buffer = class->free;
+	class->free = *buffer;
+	if (++class->inUse > class->highWater) class->highWater = class->inUse;
+	return buffer;
+}
+
+/**
+ * @fn poolPut()
+ * @brief Return the buffer to the pool
+ * @param pool Pool
+ * @param buffer Buffer from poolGet() or NULL
+ * @param length Length the buffer was taken for
+ */
+void poolPut(struct bufferPool *pool, void *buffer, unsigned length) {
+	if (!buffer) return;
+	struct poolClass *class = &pool->classes[poolClassIndex(length)];
+	*(void **)buffer = class->free;
+	class->free = buffer;
+	class->inUse--;
+}
+
+/**
+ * @fn newPendingTable()
+ * @brief Allocate empty table of pending queries
+ * @param pool Pool for the packets and waiters of the queries
+ * @return struct pendingTable* new table or NULL when there is not enough memory
+ */
+struct pendingTable *newPendingTable(struct bufferPool *pool) {
+	struct pendingTable *table = malloc(sizeof(struct pendingTable));
+	if (!table) return NULL;
+	table->entries = calloc(PENDING_INITIAL_SIZE, sizeof(struct pendingQuery));
+	if (!table->entries) {
+		free(table);
+		return NULL;
+	}
+	table->allocated = PENDING_INITIAL_SIZE;
+	table->count = 0;
+	table->randomLeft = 0;
+	table->pool = pool;
+	return table;
+}
+
+/**
+ * @fn randomId()
+ * @brief Get unpredictable 16 bit number (ids and source ports must not be guessable by an attacker)
+ * @param table Table of pending queries (owns the pool of random numbers)
+ * @return uint16_t random number
+ */
+uint16_t randomId(struct pendingTable *table) {
+	if (table->randomLeft == 0) {
+		//refill the pool, one syscall for many ids
+		if (getrandom(table->randomPool, sizeof(table->randomPool), 0) != sizeof(table->randomPool)) {
+			for (unsigned i = 0; i < 128; i++) table->randomPool[i] = rand();
+		}
+		table->randomLeft = 128;
+	}
+	return table->randomPool[--table->randomLeft];
+}
+
+/**
+ * @fn hashQuestion()
+ * @brief Hash of the question (case sensitive, so the answer has to copy the exact name, pending and coalesced queries)
+ * @param view Parsed packet
+ * @return uint32_t hash
+ */
+uint32_t hashQuestion(const struct dnsView *view) {
+	uint32_t hash = (uint32_t)view->type << 16 | view->class;
+	for (unsigned i = 0; i < view->labelCount; i++) {
+		const unsigned char *label = &view->packet[view->labels[i]];
+		hash = hashLabel((const char *)label + 1, label[0], hash);
+	}
+	return hash;
+}
+
+/**
+ * @fn hashCacheKey()
+ * @brief Hash of the question ignoring ASCII case of the name (cache key, 0x20 randomized names share the answer)
+ * @param view Parsed packet
+ * @param key Folded question name
+ * @return uint32_t hash
+ */
+uint32_t hashCacheKey(const struct dnsView *view, const struct nameKey *key) {
+	unsigned char typeClass[4] = {view->type >> 8, view->type, view->class >> 8, view->class};
+	return crc32c(key->suffixHashes[0], typeClass, 4);
+}
+
+/**
+ * @fn findPendingSlot()
+ * @brief Find the slot of the pending query with the given key
+ * @param table Table of pending queries
+ * @param key Server socket index << 16 | id sent to the server
+ * @return struct pendingQuery* slot with the query or empty slot where it belongs
+ */
+struct pendingQuery *findPendingSlot(struct pendingTable *table, uint32_t key) {
+	unsigned long mask = table->allocated - 1;
+	unsigned long slot = (key ^ key >> 16) & mask;
+	while (table->entries[slot].used && table->entries[slot].key != key) {
+		slot = (slot + 1) & mask;
+	}
+	return &table->entries[slot];
+}
+
+/**
+ * @fn growPendingTable()
+ * @brief Double the size of the pending table and move all queries to the new entries
+ * @param table Table of pending queries
+ * @return int 0 on success, 1 when there is not enough memory
+ */
+int growPendingTable(struct pendingTable *table) {
+	struct pendingQuery *old = table->entries;
+	unsigned long oldSize = table->allocated;
+	table->entries = calloc(oldSize * 2, sizeof(struct pendingQuery));
+	if (!table->entries) {
+		table->entries = old;
+		return EXIT_FAILURE;
+	}
+	table->allocated = oldSize * 2;
+	for (unsigned long i = 0; i < oldSize; i++) {
+		if (old[i].used) *findPendingSlot(table, old[i].key) = old[i];
+	}
+	free(old);
+	return EXIT_SUCCESS;
+}
+
+/**
+ * @fn addPendingQuery()
+ * @brief Store the forwarded query under random server socket and random unused id
+ * @param table Table of pending queries
+ * @param clientId Id of the query from the client
+ * @param clientAddress Address of the client
+ * @param questionHash Hash of the question (to check the answer)
+ * @return struct pendingQuery* stored query with the assigned key or NULL when the table is full or no free id was drawn
+ */
+struct pendingQuery *addPendingQuery(struct pendingTable *table, uint16_t clientId, struct sockaddr_in6 *clientAddress, uint32_t questionHash) {
+	if (table->count >= PENDING_MAX_QUERIES) return NULL;
+	// keep the table at most half full
+	if (2 * (table->count + 1) > table->allocated) {
+		if (growPendingTable(table)) {
+			fprintf(stderr, "Could not grow table of pending queries. Not enough memory.\n");
+			if (table->count + 1 == table->allocated) return NULL;
+		}
+	}
+	struct pendingQuery *query = NULL;
+	uint32_t key = 0;
+	for (int i = 0; i < PENDING_ID_TRIES; i++) {
+		key = (uint32_t)(randomId(table) % serverSocketCount) << 16 | randomId(table);
+		query = findPendingSlot(table, key);
+		if (!query->used) break;
+	}
+	// all tries hit pending ids (pending queries expire, so they are not replaced)
+	if (query->used) return NULL;
+	table->count++;
+	query->tries = 1;
+	query->tcp = false;
+	query->connection = -1;
+	query->edns = false;
+	query->payload = EDNS_MIN_PAYLOAD;
+	query->used = true;
+	query->key = key;
+	query->clientId = clientId;
+	query->questionHash = questionHash;
+	query->clientAddress = *clientAddress;
+	return query;
+}
+
+/**
+ * @fn removePendingQuery()
+ * @brief Remove the answered query and move following queries of its cluster back (no tombstones)
+ * @param table Table of pending queries
+ * @param query Query to remove
+ */
+void removePendingQuery(struct pendingTable *table, struct pendingQuery *query) {
+	unsigned long mask = table->allocated - 1;
+	unsigned long hole = query - table->entries;
+	unsigned long slot = hole;
+	poolPut(table->pool, table->entries[hole].packet, table->entries[hole].packetLength);
+	poolPut(table->pool, table->entries[hole].waiters, table->entries[hole].waiterAllocated * sizeof(struct waiter));
+	table->entries[hole].packet = NULL;
+	table->entries[hole].waiters = NULL;
+	table->entries[hole].waiterCount = 0;
+	table->entries[hole].waiterAllocated = 0;
+	table->entries[hole].used = false;
+	table->count--;
+	while (1) {
+		slot = (slot + 1) & mask;
+		if (!table->entries[slot].used) return;
+		unsigned long home = (table->entries[slot].key ^ table->entries[slot].key >> 16) & mask;
+		// move the entry to the hole if its home slot is not between the hole and the entry
+		if (((slot - home) & mask) >= ((slot - hole) & mask)) {
+			table->entries[hole] = table->entries[slot];
+			table->entries[slot].used = false;
+			table->entries[slot].packet = NULL;
+			table->entries[slot].waiters = NULL;
+			table->entries[slot].waiterCount = 0;
+			table->entries[slot].waiterAllocated = 0;
+			hole = slot;
+		}
+	}
+}
+
+/**
+ * @fn newInflightTable()
+ * @brief Allocate empty index of the pending questions
+ * @return struct inflightTable* new table or NULL when there is not enough memory
+ */
+struct inflightTable *newInflightTable() {
+	struct inflightTable *table = malloc(sizeof(struct inflightTable));
+	if (!table) return NULL;
+	table->entries = calloc(PENDING_INITIAL_SIZE, sizeof(struct inflightQuery));
+	if (!table->entries) {
+		free(table);
+		return NULL;
+	}
+	table->allocated = PENDING_INITIAL_SIZE;
+	table->count = 0;
+	return table;
+}
+
+/**
+ * @fn addInflightQuery()
+ * @brief Index the pending query by its question
+ * @param table Index of the pending questions
+ * @param questionHash Hash of the question
+ * @param key Key of the pending query
+ * @return int 0 on success, 1 when there is not enough memory
+ */
+int addInflightQuery(struct inflightTable *table, uint32_t questionHash, uint32_t key) {
+	// keep the table at most half full
+	if (2 * (table->count + 1) > table->allocated) {
+		struct inflightQuery *old = table->entries;
+		unsigned long oldSize = table->allocated;
+		table->entries = calloc(oldSize * 2, sizeof(struct inflightQuery));
+		if (!table->entries) {
+			table->entries = old;
+			return EXIT_FAILURE;
+		}
+		table->allocated = oldSize * 2;
+		table->count = 0;
+		for (unsigned long i = 0; i < oldSize; i++) {
+			if (old[i].used) addInflightQuery(table, old[i].questionHash, old[i].key);
+		}
+		free(old);
+	}
+	unsigned long mask = table->allocated - 1;
+	unsigned long slot = questionHash & mask;
+	while (table->entries[slot].used) slot = (slot + 1) & mask;
+	table->entries[slot].used = true;
+	table->entries[slot].questionHash = questionHash;
+	table->entries[slot].key = key;
+	table->count++;
+	return EXIT_SUCCESS;
+}
+
+/**
+ * @fn removeInflightQuery()
+ * @brief Remove the pending query from the index and move following entries of its cluster back (no tombstones)
+ * @param table Index of the pending questions
+ * @param questionHash Hash of the question
+ * @param key Key of the pending query
+ */
+void removeInflightQuery(struct inflightTable *table, uint32_t questionHash, uint32_t key) {
+	unsigned long mask = table->allocated - 1;
+	unsigned long hole = questionHash & mask;
+	while (table->entries[hole].used && table->entries[hole].key != key) hole = (hole + 1) & mask;
+	// the query was not indexed (no memory or waiting clients were full)
+	if (!table->entries[hole].used) return;
+	table->entries[hole].used = false;
+	table->count--;
+	unsigned long slot = hole;
+	while (1) {
+		slot = (slot + 1) & mask;
+		if (!table->entries[slot].used) return;
+		unsigned long home = table->entries[slot].questionHash & mask;
+		if (((slot - home) & mask) >= ((slot - hole) & mask)) {
+			table->entries[hole] = table->entries[slot];
+			table->entries[slot].used = false;
+			hole = slot;
+		}
+	}
+}
+
+/**
+ * @fn findInflightQuery()
+ * @brief Find the pending query with the same question (compared byte by byte, the hash can collide)
+ * @param table Index of the pending questions
+ * @param pending Table of pending queries
+ * @param questionHash Hash of the question
+ * @param question Question section of the packet
+ * @param questionLength Length of the question section
+ * @return struct pendingQuery* pending query or NULL when the question is not pending
+ */
+struct pendingQuery *findInflightQuery(struct inflightTable *table, struct pendingTable *pending, uint32_t questionHash,
+	const char *question, unsigned questionLength) {
+	unsigned long mask = table->allocated - 1;
+	for (unsigned long slot = questionHash & mask; table->entries[slot].used; slot = (slot + 1) & mask) {
+		if (table->entries[slot].questionHash != questionHash) continue;
+		struct pendingQuery *query = findPendingSlot(pending, table->entries[slot].key);
+		if (query->used && query->packet && query->waiterCount < COALESCE_MAX_WAITERS && query->packetLength >= 12 + questionLength
+			&& memcmp(query->packet + 12, question, questionLength) == 0) return query;
+	}
+	return NULL;
+}
+
+/**
+ * @fn addWaiter()
+ * @brief Attach the client to the pending query with the same question, the waiters are in the next size class
+ * of the pool when they do not fit
+ * @param pool Pool of the worker
+ * @param query Pending query
+ * @param id Id of the client query
+ * @param rd Recursion desired bit of the client query
+ * @param edns Client query had OPT record
+ * @param payload UDP payload size of the client
+ * @param address Address of the client
+ * @return int 0 on success, 1 when the query has too many waiting clients (or there is not enough memory)
+ */
+int addWaiter(struct bufferPool *pool, struct pendingQuery *query, uint16_t id, bool rd, bool edns, uint16_t payload,
+	struct sockaddr_in6 *address) {
+	if (query->waiterCount == query->waiterAllocated) {
+		if (query->waiterAllocated == COALESCE_MAX_WAITERS) return EXIT_FAILURE;
+		int index = query->waiterAllocated ? poolClassIndex(query->waiterAllocated * sizeof(struct waiter)) + 1 : 0;
+		if (index == POOL_CLASSES) return EXIT_FAILURE;
+		unsigned allocated = poolSizes[index] / sizeof(struct waiter);
+		if (allocated > COALESCE_MAX_WAITERS) allocated = COALESCE_MAX_WAITERS;
+		struct waiter *waiters = poolGet(pool, allocated * sizeof(struct waiter));
+		if (!waiters) return EXIT_FAILURE;
+		if (query->waiterCount) memcpy(waiters, query->waiters, query->waiterCount * sizeof(struct waiter));
+		poolPut(pool, query->waiters, query->waiterAllocated * sizeof(struct waiter));
+		query->waiters = waiters;
+		query->waiterAllocated = allocated;
+	}
+	struct waiter *waiter = &query->waiters[query->waiterCount++];
+	waiter->id = id;
+	waiter->rd = rd;
+	waiter->edns = edns;
+	waiter->payload = payload;
+	waiter->address = *address;
+	return EXIT_SUCCESS;
+}
+
+/**
+ * @fn newTimerWheel()
+ * @brief Allocate empty timer wheel
+ * @param now Current time in milliseconds
+ * @return struct timerWheel* new wheel or NULL when there is not enough memory
+ */
+struct timerWheel *newTimerWheel(uint64_t now) {
+	struct timerWheel *wheel = malloc(sizeof(struct timerWheel));
+	if (!wheel) return NULL;
+	wheel->tick = now / TIMER_TICK;
+	wheel->count = 0;
+	wheel->allocated = 0;
+	wheel->freeTimers = TIMER_NONE;
+	wheel->timers = NULL;
+	for (int level = 0; level < WHEEL_LEVELS; level++) {
+		for (int slot = 0; slot < WHEEL_SLOTS; slot++) wheel->slots[level][slot] = TIMER_NONE;
+	}
+	return wheel;
+}
+
+/**
+ * @fn linkTimer()
+ * @brief Put the timer to the slot of its deadline (the level is given by the distance from the current tick)
+ * @param wheel Timer wheel
+ * @param index Index of the timer
+ */
+void linkTimer(struct timerWheel *wheel, uint32_t index) {
+	uint64_t tick = wheel->timers[index].deadline / TIMER_TICK;
+	if (tick <= wheel->tick) tick = wheel->tick + 1;
+	uint64_t distance = tick - wheel->tick;
+	int level = 0;
+	while (level < WHEEL_LEVELS - 1 && distance >= (uint64_t)1 << (WHEEL_BITS * (level + 1))) level++;
+	// too far away, it is moved again when its slot is reached
+	uint64_t last = wheel->tick + ((uint64_t)1 << (WHEEL_BITS * WHEEL_LEVELS)) - 1;
+	if (tick > last) tick = last;
+	uint32_t *slot = &wheel->slots[level][(tick >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1)];
+	wheel->timers[index].next = *slot;
+	*slot = index;
+}
+
+/**
+ * @fn addTimer()
+ * @brief Add the deadline of the pending query
+ * @param wheel Timer wheel
+ * @param key Key of the pending query
+ * @param serial Serial of the send of the query
+ * @param deadline Deadline in milliseconds
+ * @return int 0 on success, 1 when there is not enough memory
+ */
+int addTimer(struct timerWheel *wheel, uint32_t key, uint32_t serial, uint64_t deadline) {
+	if (wheel->freeTimers == TIMER_NONE) {
+		unsigned allocated = wheel->allocated ? wheel->allocated * 2 : 256;
+		struct timer *timers = realloc(wheel->timers, allocated * sizeof(struct timer));
+		if (!timers) return EXIT_FAILURE;
+		for (unsigned i = wheel->allocated; i < allocated; i++) timers[i].next = i + 1 < allocated ? i + 1 : TIMER_NONE;
+		wheel->freeTimers = wheel->allocated;
+		wheel->timers = timers;
+		wheel->allocated = allocated;
+	}
+	uint32_t index = wheel->freeTimers;
+	wheel->freeTimers = wheel->timers[index].next;
+	wheel->timers[index].key = key;
+	wheel->timers[index].serial = serial;
+	wheel->timers[index].deadline = deadline;
+	linkTimer(wheel, index);
+	wheel->count++;
+	return EXIT_SUCCESS;
+}
+
+/**
+ * @fn advanceWheel()
+ * @brief Process ticks up to the current time, timers of the reached slots of higher levels move to lower levels
+ * @param wheel Timer wheel
+ * @param now Current time in milliseconds
+ * @param expired Called for each expired timer (the timer is freed behind it, so it can add new timers)
+ * @param context Argument of the callback
+ */
+void advanceWheel(struct timerWheel *wheel, uint64_t now, void (*expired)(void *context, uint32_t key, uint32_t serial),
+	void *context) {
+	uint64_t target = now / TIMER_TICK;
+	// nothing to do while the wheel is empty
+	if (wheel->count == 0 && target > wheel->tick) wheel->tick = target;
+	while (wheel->tick < target) {
+		uint64_t tick = wheel->tick + 1;
+		// whole slot of the higher level is reached, spread its timers (before the tick, so they can land in it)
+		for (int level = 1; level < WHEEL_LEVELS; level++) {
+			if (tick & (((uint64_t)1 << (WHEEL_BITS * level)) - 1)) break;
+			uint32_t *slot = &wheel->slots[level][(tick >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1)];
+			uint32_t index = *slot;
+			*slot = TIMER_NONE;
+			while (index != TIMER_NONE) {
+				uint32_t next = wheel->timers[index].next;
+				linkTimer(wheel, index);
+				index = next;
+			}
+		}
+		wheel->tick = tick;
+		uint32_t *slot = &wheel->slots[0][tick & (WHEEL_SLOTS - 1)];
+		uint32_t index = *slot;
+		*slot = TIMER_NONE;
+		while (index != TIMER_NONE) {
+			struct timer timer = wheel->timers[index];
+			// timer waiting in the last slot, its deadline is still ahead
+			if (timer.deadline / TIMER_TICK > tick) {
+				linkTimer(wheel, index);
+				index = timer.next;
+				continue;
+			}
+			wheel->timers[index].next = wheel->freeTimers;
+			wheel->freeTimers = index;
+			wheel->count--;
+			expired(context, timer.key, timer.serial);
+			index = timer.next;
+		}
+	}
+}
+
+/**
+ * @fn nextTimerTimeout()
+ * @brief Time to wait for the events before the next deadline can expire
+ * @param wheel Timer wheel
+ * @param now Current time in milliseconds
+ * @return int timeout in milliseconds, -1 when there are no timers
+ */
+int nextTimerTimeout(struct timerWheel *wheel, uint64_t now) {
+	if (wheel->count == 0) return -1;
+	// first used slot of level 0, otherwise the next move of the higher level
+	uint64_t tick = wheel->tick + 1;
+	while (tick & (WHEEL_SLOTS - 1) && wheel->slots[0][tick & (WHEEL_SLOTS - 1)] == TIMER_NONE) tick++;
+	uint64_t time = tick * TIMER_TICK;
+	return time > now ? (int)(time - now) : 0;
+}
+
+/**
+ * @fn getTime()
+ * @brief Monotonic time in milliseconds
+ * @return uint64_t time
+ */
+uint64_t getTime() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/**
+ * @fn getMicroTime()
+ * @brief Monotonic time in microseconds (round trip times of the servers)
+ * @return uint64_t time
+ */
+uint64_t getMicroTime() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+/**
+ * @fn upstreamTimeout()
+ * @brief Time after which the silent upstream is considered down
+ * @param state Health of the upstream
+ * @return uint64_t timeout in microseconds
+ */
+uint64_t upstreamTimeout(struct upstreamState *state) {
+	uint64_t timeout = state->srtt * UPSTREAM_TIMEOUT_RTTS;
+	if (timeout < UPSTREAM_MIN_TIMEOUT) return UPSTREAM_MIN_TIMEOUT;
+	return timeout > UPSTREAM_MAX_TIMEOUT ? UPSTREAM_MAX_TIMEOUT : timeout;
+}
+
+/**
+ * @fn upstreamTimedOut()
+ * @brief Count the query which was not answered in time
+ * @param state Health of the upstream
+ */
+void upstreamTimedOut(struct upstreamState *state) {
+	state->failureRate += (UPSTREAM_RATE_ONE - state->failureRate) / 8;
+}
+
+/**
+ * @fn upstreamFailed()
+ * @brief Count the failure of the upstream and stop sending queries to it for a while
+ * @param state Health of the upstream
+ * @param now Current time in microseconds
+ */
+void upstreamFailed(struct upstreamState *state, uint64_t now) {
+	upstreamTimedOut(state);
+	state->unansweredSince = 0;
+	state->downUntil = now + UPSTREAM_RETRY_TIME;
+}
+
+/**
+ * @fn upstreamAnswered()
+ * @brief Update the smoothed rtt of the upstream which answered (it is healthy again)
+ * @param state Health of the upstream
+ * @param rtt Round trip time of the answered query in microseconds
+ */
+void upstreamAnswered(struct upstreamState *state, uint64_t rtt) {
+	// gain 1/8 like TCP, the first sample is used as it is
+	if (state->srtt == 0) state->srtt = rtt > 0 ? rtt : 1;
+	else state->srtt = (state->srtt * 7 + rtt) / 8;
+	state->failureRate -= state->failureRate / 8;
+	state->unansweredSince = 0;
+	state->downUntil = 0;
+}
+
+/**
+ * @fn upstreamScore()
+ * @brief Expected cost of the query sent to the upstream (lower is better)
+ * @param state Health of the upstream
+ * @return uint64_t smoothed rtt weighted by the failure rate
+ */
+uint64_t upstreamScore(struct upstreamState *state) {
+	return state->srtt * (UPSTREAM_RATE_ONE + UPSTREAM_RATE_PENALTY * state->failureRate) / UPSTREAM_RATE_ONE;
+}
+
+/**
+ * @fn selectUpstream()
+ * @brief Pick the upstream for the query, better of two random healthy upstreams (power of two choices)
+ * @param worker Worker (its view of the upstreams and random numbers)
+ * @param now Current time in microseconds
+ * @param avoid Index of the upstream which should not get the query if there is another healthy one (-1 for none)
+ * @return int index of the upstream
+ */
+int selectUpstream(struct worker *worker, uint64_t now, int avoid) {
+	int healthy[MAX_UPSTREAMS];
+	int healthyCount = 0, soonest = 0;
+	for (int i = 0; i < upstreamCount; i++) {
+		struct upstreamState *state = &worker->upstreams[i];
+		// silent for too long, fail over to the others
+		if (state->unansweredSince && now - state->unansweredSince > upstreamTimeout(state)) upstreamFailed(state, now);
+		if (state->downUntil <= now && i != avoid) healthy[healthyCount++] = i;
+		if (state->downUntil < worker->upstreams[soonest].downUntil) soonest = i;
+	}
+	// all upstreams are down, try the one which should come back first
+	if (healthyCount == 0) return avoid >= 0 && worker->upstreams[avoid].downUntil <= now ? avoid : soonest;
+	if (healthyCount == 1) return healthy[0];
+	int first = randomId(worker->pending) % healthyCount;
+	int second = randomId(worker->pending) % (healthyCount - 1);
+	if (second >= first) second++;
+	first = healthy[first];
+	second = healthy[second];
+	return upstreamScore(&worker->upstreams[first]) <= upstreamScore(&worker->upstreams[second]) ? first : second;
+}
+
+/**
+ * @fn newAnswerCache()
+ * @brief Allocate empty cache of answers
+ * @param capacity Maximal number of cached answers
+ * @param pool Pool for the cached answers
+ * @return struct answerCache* new cache or NULL when there is not enough memory
+ */
+struct answerCache *newAnswerCache(unsigned long capacity, struct bufferPool *pool) {
+	struct answerCache *newCache = calloc(1, sizeof(struct answerCache));
+	if (!newCache) return NULL;
+	unsigned long buckets = 1;
+	while (buckets < capacity) buckets *= 2;
+	newCache->capacity = capacity;
+	newCache->mask = buckets - 1;
+	newCache->pool = pool;
+	newCache->entries = calloc(capacity, sizeof(struct cacheEntry));
+	newCache->buckets = malloc(buckets * sizeof(int32_t));
+	if (!newCache->entries || !newCache->buckets) {
+		free(newCache->entries);
+		free(newCache->buckets);
+		free(newCache);
+		return NULL;
+	}
+	for (unsigned long i = 0; i < buckets; i++) newCache->buckets[i] = -1;
+	return newCache;
+}
+
+/**
+ * @fn findCacheEntry()
+ * @brief Find the cached answer for the question (expired answers are not returned)
+ * @param answers Cache of answers
+ * @param view Parsed packet with the question
+ * @param key Folded question name
+ * @param hash Hash of the question (see hashCacheKey())
+ * @param now Current time
+ * @return struct cacheEntry* cached answer or NULL
+ */
+struct cacheEntry *findCacheEntry(struct answerCache *answers, const struct dnsView *view, const struct nameKey *key,
+	uint32_t hash, uint64_t now) {
+	for (int32_t i = answers->buckets[hash & answers->mask]; i != -1; i = answers->entries[i].next) {
+		struct cacheEntry *entry = &answers->entries[i];
+		if (entry->hash == hash && entry->type == view->type && entry->class == view->class
+			&& entry->questionEnd == view->questionEnd && entry->nameLength == key->length
+			&& memcmp(entry->name, key->bytes, key->length) == 0) {
+			return entry->expires > now ? entry : NULL;
+		}
+	}
+	return NULL;
+}
+
+/**
+ * @fn removeCacheEntry()
+ * @brief Unlink the entry from its bucket and mark it as free
+ * @param answers Cache of answers
+ * @param entry Entry to remove
+ */
+void removeCacheEntry(struct answerCache *answers, struct cacheEntry *entry) {
+	int32_t index = entry - answers->entries;
+	int32_t *link = &answers->buckets[entry->hash & answers->mask];
+	while (*link != index) link = &answers->entries[*link].next;
+	*link = entry->next;
+	entry->used = false;
+}
+
+/**
+ * @fn evictCacheEntry()
+ * @brief Find free entry, the CLOCK hand skips (and clears) recently used entries
+ * @param answers Cache of answers
+ * @param now Current time
+ * @return struct cacheEntry* free entry
+ */
+struct cacheEntry *evictCacheEntry(struct answerCache *answers, uint64_t now) {
+	while (1) {
+		struct cacheEntry *entry = &answers->entries[answers->hand];
+		answers->hand = (answers->hand + 1) % answers->capacity;
+		if (!entry->used) return entry;
+		if (entry->referenced && entry->expires > now) {
+			entry->referenced = false;
+			continue;
+		}
+		removeCacheEntry(answers, entry);
+		return entry;
+	}
+}
+
+/**
+ * @fn cacheAnswer()
+ * @brief Store the answer from the server, TTLs of all records are remembered to be decremented later,
+ * negative answers (NXDOMAIN or no data) are stored for the time given by SOA record (RFC 2308)
+ * @param answers Cache of answers
+ * @param view Parsed answer from the server (records are already checked to be inside the packet)
+ * @param key Folded question name
+ * @param hash Hash of the question
+ */
+void cacheAnswer(struct answerCache *answers, const struct dnsView *view, const struct nameKey *key, uint32_t hash) {
+	const unsigned char *data = view->packet;
+	const char *packet = (const char *)view->packet;
+	int length = view->length;
+	HEADER header;
+	if (length > BUFFER_SIZE) return;
+	memcpy(&header, packet, 12);
+	// only complete answers, positive or negative
+	if ((header.rcode != ns_r_noerror && header.rcode != ns_r_nxdomain) || header.tc || ntohs(header.qdcount) != 1) return;
+	bool negative = header.rcode == ns_r_nxdomain || header.ancount == 0;
+	int records = ntohs(header.ancount) + ntohs(header.nscount) + ntohs(header.arcount);
+	int authorityEnd = ntohs(header.ancount) + ntohs(header.nscount);
+	if (records > CACHE_MAX_RECORDS) return;
+	int offset = view->questionEnd;
+	uint16_t ttlOffsets[CACHE_MAX_RECORDS];
+	int ttlCount = 0;
+	uint32_t minTtl = CACHE_MAX_TTL;
+	int soaTtlOffset = -1;
+	uint32_t negativeTtl = 0;
+	for (int i = 0; i < records; i++) {
+		offset = skipName(data, length, offset);
+		uint16_t recordType = data[offset] << 8 | data[offset + 1];
+		uint32_t ttl = (uint32_t)data[offset + 4] << 24 | data[offset + 5] << 16 | data[offset + 6] << 8 | data[offset + 7];
+		int dataLength = data[offset + 8] << 8 | data[offset + 9];
+		// OPT pseudo record has flags instead of TTL
+		if (recordType != ns_t_opt) {
+			ttlOffsets[ttlCount++] = offset + 4;
+			if (ttl < minTtl) minTtl = ttl;
+		}
+		// negative answer lives for minimum of SOA TTL and SOA MINIMUM (the last field of the SOA data)
+		if (negative && recordType == ns_t_soa && i >= ntohs(header.ancount) && i < authorityEnd && soaTtlOffset == -1
+			&& dataLength >= 22 && offset + 10 + dataLength <= length) {
+			const unsigned char *minimum = &data[offset + 10 + dataLength - 4];
+			negativeTtl = (uint32_t)minimum[0] << 24 | minimum[1] << 16 | minimum[2] << 8 | minimum[3];
+			if (ttl < negativeTtl) negativeTtl = ttl;
+			if (negativeTtl > CACHE_MAX_NEGATIVE_TTL) negativeTtl = CACHE_MAX_NEGATIVE_TTL;
+			soaTtlOffset = offset + 4;
+		}
+		offset += 10 + dataLength;
+	}
+	// negative answer without SOA record can not be cached
+	if (negative) {
+		if (soaTtlOffset == -1) return;
+		minTtl = negativeTtl;
+	}
+	if (minTtl == 0) return;
+	uint64_t now = getTime();
+	struct cacheEntry *entry = findCacheEntry(answers, view, key, hash, UINT64_C(0));
+	if (entry) {
+		removeCacheEntry(answers, entry);
+	} else {
+		entry = evictCacheEntry(answers, now);
+	}
+	// the buffer stays when the answer has the same size class
+	if (!entry->packet || poolClassIndex(entry->length) != poolClassIndex(length)) {
+		char *packet = poolGet(answers->pool, length);
+		if (!packet) return;
+		poolPut(answers->pool, entry->packet, entry->length);
+		entry->packet = packet;
+	}
+	memcpy(entry->packet, packet, length);
+	if (negative) {
+		// SOA TTL of the cached negative answer is the time of the negative caching
+		unsigned char *ttlPtr = (unsigned char *)&entry->packet[soaTtlOffset];
+		ttlPtr[0] = minTtl >> 24; ttlPtr[1] = minTtl >> 16; ttlPtr[2] = minTtl >> 8; ttlPtr[3] = minTtl;
+	}
+	memcpy(entry->ttlOffsets, ttlOffsets, ttlCount * sizeof(uint16_t));
+	memcpy(entry->name, key->bytes, key->length);
+	entry->nameLength = key->length;
+	entry->questionEnd = view->questionEnd;
+	entry->opt = view->opt;
+	entry->used = true;
+	entry->referenced = false;
+	entry->hash = hash;
+	entry->type = view->type;
+	entry->class = view->class;
+	entry->length = length;
+	entry->ttlCount = ttlCount;
+	entry->stored = now;
+	entry->expires = now + (uint64_t)minTtl * 1000;
+	int32_t *bucket = &answers->buckets[entry->hash & answers->mask];
+	entry->next = *bucket;
+	*bucket = entry - answers->entries;
+}
+
+/**
+ * @fn answerFromCache()
+ * @brief Write the cached answer to the buffer with the id and flags of the query and decremented TTLs, the question
+ * of the query is kept (the client gets the case of the name it asked for)
+ * @param entry Cached answer (its question has the same length as the question of the query)
+ * @param buffer Buffer with the query (overwritten by the answer)
+ * @param now Current time
+ * @return int length of the answer
+ */
+int answerFromCache(struct cacheEntry *entry, char *buffer, uint64_t now) {
+	HEADER query, answer;
+	memcpy(&query, buffer, 12);
+	memcpy(&answer, entry->packet, 12);
+	memcpy(buffer + entry->questionEnd, entry->packet + entry->questionEnd, entry->length - entry->questionEnd);
+	answer.id = query.id;
+	answer.rd = query.rd;
+	memcpy(buffer, &answer, 12);
+	uint32_t elapsed = (now - entry->stored) / 1000;
+	unsigned char *data = (unsigned char *)buffer;
+	for (int i = 0; i < entry->ttlCount; i++) {
+		unsigned char *ttlPtr = &data[entry->ttlOffsets[i]];
+		uint32_t ttl = (uint32_t)ttlPtr[0] << 24 | ttlPtr[1] << 16 | ttlPtr[2] << 8 | ttlPtr[3];
+		ttl = ttl > elapsed ? ttl - elapsed : 0;
+		ttlPtr[0] = ttl >> 24; ttlPtr[1] = ttl >> 16; ttlPtr[2] = ttl >> 8; ttlPtr[3] = ttl;
+	}
+	entry->referenced = true;
+	return entry->length;
+}
+
+/**
+ * @fn makeBlockAnswer()
+ * @brief Build the answer for the blacklisted names, REFUSED has no records, NXDOMAIN has SOA record (the client caches
+ * the negative answer for the TTL) and the sinkhole has A record with its address
+ * @param action Block action
+ * @param address Address of the sinkhole
+ * @param ttl TTL of the records
+ */
+void makeBlockAnswer(enum blockAction action, struct in_addr address, uint32_t ttl) {
+	memset(&blockAnswer, 0, sizeof(blockAnswer));
+	if (action == BLOCK_REFUSED) {
+		blockAnswer.rcode = ns_r_refused;
+		return;
+	}
+	// pointer to the question name, type, class, TTL and data length
+	uint16_t type = action == BLOCK_ADDRESS ? ns_t_a : ns_t_soa;
+	uint16_t dataLength = action == BLOCK_ADDRESS ? 4 : 22;
+	unsigned char *record = blockAnswer.records;
+	unsigned char fixed[12] = {0xc0, 12, type >> 8, type, 0, ns_c_in, ttl >> 24, ttl >> 16, ttl >> 8, ttl, 0, dataLength};
+	memcpy(record, fixed, 12);
+	if (action == BLOCK_ADDRESS) {
+		blockAnswer.rcode = ns_r_noerror;
+		blockAnswer.answers = 1;
+		memcpy(record + 12, &address, 4);
+	} else {
+		// root server and mailbox, zero serial and timers, the minimum is the TTL
+		blockAnswer.rcode = ns_r_nxdomain;
+		blockAnswer.authorities = 1;
+		memset(record + 12, 0, 18);
+		unsigned char minimum[4] = {ttl >> 24, ttl >> 16, ttl >> 8, ttl};
+		memcpy(record + 30, minimum, 4);
+	}
+	blockAnswer.length = 12 + dataLength;
+}
+
+/**
+ * @fn printHelp()
+ * @brief Prints help on stdout and exit the program
+ */
+void printHelp() {
+	printf( "Usage: dns [options]\n"
+			"       dns --compile-filter <file> [<file> ...] <compiled file>\n"
+			"		(build the filter once and save it for instant loading by -f)\n"
+			"	-s <ip>[:port], <ipv6>, [<ipv6>]:port or <name>[:port]\n"
+			"		(dns server, can be repeated, queries go to the fastest answering one)\n"
+			"	-f <file>\n"
+			"		(file with domains to filter or compiled filter file, can be repeated, lines are rules name (with\n"
+			"		subdomains), *.name (only subdomains), =name (only the name), @@ before them allows the names,\n"
+			"		hosts file lines <ip> name [name ...] and adblock rules ||name^, |name^ and @@||name^ are accepted)\n"
+			"	[-p <port>]\n"
+			"  		(local bind port, default 53)\n"
+			"	[-c <count>]\n"
+			"		(number of cached answers, 0 turns the cache off, default 10000)\n"
+			"	[-t <threads>]\n"
+			"		(number of worker threads sharing the port, default 1)\n"
+			"	[-r <count>]\n"
+			"		(number of server sockets with random source ports, default 1)\n"
+			"	[-e epoll|poll|uring]\n"
+			"		(event backend of the workers, default epoll)\n"
+			"	[-b <size>]\n"
+			"		(UDP payload size advertised by EDNS, %d to %d, default %d)\n"
+			"	[-a refused|nxdomain|<ip>]\n"
+			"		(answer for filtered domains, <ip> is the address of the sinkhole A record, default refused)\n"
+			"	[-l <seconds>]\n"
+			"		(TTL of the NXDOMAIN or sinkhole answer, default %d)\n"
+			"	[-q <file>|syslog]\n"
+			"		(query log, entries about packets are written by a background thread)\n"
+			"	[-R <queries per second>[,<queries per second of network>]]\n"
+			"		(rate limit of one UDP client (IPv4 address, IPv6 /64) and of its network (IPv4 /24, IPv6 /48),\n"
+			"		0 is no limit, default off)\n"
+			"	[-T]\n"
+			"		(UDP clients over the rate limit get truncated answer and ask over TCP, default they get nothing)\n"
+			"	[-m [<ip>:]<port>]\n"
+			"		(HTTP endpoint with metrics in Prometheus format, default address 127.0.0.1)\n"
+			"	[-h]\n"
+			"		(print help and exit)\n"
+			"	[-v]\n"
+			"		(verbose mode, print status messages on stdout)\n", EDNS_MIN_PAYLOAD, EDNS_MAX_PAYLOAD, EDNS_DEFAULT_PAYLOAD,
+			BLOCK_DEFAULT_TTL);
+	exit(EXIT_FAILURE);
+}
+
+/**
+ * @fn mapAddress()
+ * @brief Store the IPv4 address as v4-mapped IPv6 address (::ffff:a.b.c.d), dual-stack sockets use only these
+ * @param address Destination
+ * @param ipv4 IPv4 address (network byte order)
+ */
+void mapAddress(struct in6_addr *address, const void *ipv4) {
+	memset(address->s6_addr, 0, 10);
+	address->s6_addr[10] = 0xff;
+	address->s6_addr[11] = 0xff;
+	memcpy(&address->s6_addr[12], ipv4, 4);
+}
+
+/**
+ * @fn parseUpstream()
+ * @brief Get the address of the server from <ip>[:port], <ipv6>, [<ipv6>]:port or <name>[:port]
+ * @param text Server from the command line
+ * @param address Destination of the address (IPv4 as v4-mapped)
+ * @return int 0 on success, 1 on error
+ */
+int parseUpstream(const char *text, struct sockaddr_in6 *address) {
+	char host[256];
+	int port = 53;
+	const char *hostStart = text, *hostEnd = NULL, *colon = strrchr(text, ':');
+	if (text[0] == '[') {
+		hostStart = text + 1;
+		hostEnd = strchr(text, ']');
+		colon = hostEnd && hostEnd[1] == ':' ? hostEnd + 1 : NULL;
+		if (hostEnd && hostEnd[1] != '\0' && !colon) hostEnd = NULL;
+	} else {
+		// plain IPv6 address has more colons and no port
+		if (colon && strchr(text, ':') != colon) colon = NULL;
+		hostEnd = colon ? colon : text + strlen(text);
+	}
+	if (!hostEnd || hostEnd == hostStart || (size_t)(hostEnd - hostStart) >= sizeof(host)) {
+		fprintf(stderr, "[-s] Server name must be valid (or valid IPv4 or IPv6 address).\n");
+		return EXIT_FAILURE;
+	}
+	memcpy(host, hostStart, hostEnd - hostStart);
+	host[hostEnd - hostStart] = '\0';
+	if (colon) {
+		char *ptr = NULL;
+		port = strtol(colon + 1, &ptr, 10);
+		if (*ptr != '\0' || ptr == colon + 1 || port < 1 || port > 65535) {
+			fprintf(stderr, "[-s] Incorrect server port (it has to be integer value from 1 to 65535).\n");
+			return EXIT_FAILURE;
+		}
+	}
+	bzero(address, sizeof(struct sockaddr_in6));
+	address->sin6_family = AF_INET6;
+	address->sin6_port = htons(port);
+	//check ipv4 and ipv6 address (most likely to be)
+	struct in_addr ipv4;
+	if (inet_pton(AF_INET, host, &ipv4) == 1) {
+		mapAddress(&address->sin6_addr, &ipv4);
+		return EXIT_SUCCESS;
+	}
+	if (inet_pton(AF_INET6, host, &address->sin6_addr) == 1) return EXIT_SUCCESS;
+	//now check the name server, the first address of either family is used
+	struct addrinfo hints, *result = NULL;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_DGRAM;
+	if (getaddrinfo(host, NULL, &hints, &result) == 0) {
+		for (struct addrinfo *info = result; info; info = info->ai_next) {
+			if (info->ai_family == AF_INET) {
+				mapAddress(&address->sin6_addr, &((struct sockaddr_in *)info->ai_addr)->sin_addr);
+			} else if (info->ai_family == AF_INET6) {
+				address->sin6_addr = ((struct sockaddr_in6 *)info->ai_addr)->sin6_addr;
+			} else {
+				continue;
+			}
+			freeaddrinfo(result);
+			return EXIT_SUCCESS;
+		}
+		freeaddrinfo(result);
+	}
+	//didnt find any valid server
+	fprintf(stderr, "[-s] Server name must be valid (or valid IPv4 or IPv6 address).\n");
+	return EXIT_FAILURE;
+}
+
+/**
+ * @fn processArgs()
+ * @brief Processing command line arguments.
+ * @param argc Number of arguments.
+ * @param argv Array of arguments.
+ * @param portNumber String to write the port number.
+ * @return Integer 0 on successs, 1 on fail.
+ */
+int processArgs(int argc, char **argv, int *portNumber) {
+	enum blockAction action = BLOCK_REFUSED;
+	struct in_addr sinkhole = {0};
+	uint32_t blockTtl = BLOCK_DEFAULT_TTL;
+	int c;
+	//get the command line options
+	while ((c =  getopt(argc, argv, "hvs:p:f:r:c:t:e:b:a:l:m:q:R:T")) != -1) {
+		switch (c) {
+		case 'v':
+			// verbose mode
+			verbose = true;
+			printVerbose("[-v] Verbose mode turned on.\n");
+			break;
+		case 's':
+			// server name or ip, the option can be repeated
+			if (upstreamCount == MAX_UPSTREAMS) {
+				fprintf(stderr, "[-s] Too many servers (at most %d).\n", MAX_UPSTREAMS);
+				return EXIT_FAILURE;
+			}
+			if (parseUpstream(optarg, &upstreams[upstreamCount])) return EXIT_FAILURE;
+			if (verbose) {
+				char text[INET6_ADDRSTRLEN];
+				formatAddress(&upstreams[upstreamCount].sin6_addr, text);
+				bool ipv6 = strchr(text, ':') != NULL;
+				fprintf(stderr, "[-s] Server selection: %s%s%s:%d\n", ipv6 ? "[" : "", text, ipv6 ? "]" : "",
+					ntohs(upstreams[upstreamCount].sin6_port));
+			}
+			upstreamCount++;
+			break;
+		case 'f':
+			// filter file name, the option can be repeated and the files are merged
+			if (filterFileCount == MAX_FILTER_FILES) {
+				fprintf(stderr, "[-f] Too many filter files (at most %d).\n", MAX_FILTER_FILES);
+				return EXIT_FAILURE;
+			}
+			filterFileNames[filterFileCount++] = optarg;
+			if (verbose) fprintf(stderr, "[-f] Filter file name selection: %s\n", optarg);
+			break;
+		case 'p':;
+			// port selection
+			// check port number
+			char* ptr = NULL;
+			int port = strtol(optarg, &ptr, 10);
+			if (*ptr != '\0' || ptr == optarg || port > 65535 || port < 0) {
+				fprintf(stderr, "[-p] Incorrect port number (it has to be integer value from 0 to 65535).\n");
+				return EXIT_FAILURE;
+			}
+			*portNumber = port;
+			if (verbose) fprintf(stderr, "[-p] Port selection: %d\n", port);
+			break;
+		case 'r':;
+			// number of server sockets with random source ports
+			char* endPtr = NULL;
+			long count = strtol(optarg, &endPtr, 10);
+			if (*endPtr != '\0' || endPtr == optarg || count < 1 || count > MAX_SERVER_SOCKETS) {
+				fprintf(stderr, "[-r] Incorrect number of server sockets (it has to be integer value from 1 to %d).\n", MAX_SERVER_SOCKETS);
+				return EXIT_FAILURE;
+			}
+			serverSocketCount = count;
+			if (verbose) fprintf(stderr, "[-r] Server sockets: %d\n", serverSocketCount);
+			break;
+		case 'c':;
+			// size of the cache
+			char* sizePtr = NULL;
+			long size = strtol(optarg, &sizePtr, 10);
+			if (*sizePtr != '\0' || sizePtr == optarg || size < 0 || size > INT32_MAX) {
+				fprintf(stderr, "[-c] Incorrect cache size (it has to be non-negative integer value).\n");
+				return EXIT_FAILURE;
+			}
+			cacheSize = size;
+			if (verbose) fprintf(stderr, "[-c] Cache size: %lu\n", cacheSize);
+			break;
+		case 'b':;
+			// UDP payload size of EDNS
+			char* payloadPtr = NULL;
+			long payload = strtol(optarg, &payloadPtr, 10);
+			if (*payloadPtr != '\0' || payloadPtr == optarg || payload < EDNS_MIN_PAYLOAD || payload > EDNS_MAX_PAYLOAD) {
+				fprintf(stderr, "[-b] Incorrect UDP payload size (it has to be integer value from %d to %d).\n",
+					EDNS_MIN_PAYLOAD, EDNS_MAX_PAYLOAD);
+				return EXIT_FAILURE;
+			}
+			ednsPayload = payload;
+			if (verbose) fprintf(stderr, "[-b] UDP payload size: %u\n", ednsPayload);
+			break;
+		case 't':;
+			// number of worker threads
+			char* threadsPtr = NULL;
+			long threads = strtol(optarg, &threadsPtr, 10);
+			if (*threadsPtr != '\0' || threadsPtr == optarg || threads < 1 || threads > MAX_WORKERS) {
+				fprintf(stderr, "[-t] Incorrect number of threads (it has to be integer value from 1 to %d).\n", MAX_WORKERS);
+				return EXIT_FAILURE;
+			}
+			workerCount = threads;
+			if (verbose) fprintf(stderr, "[-t] Worker threads: %d\n", workerCount);
+			break;
+		case 'e':
+			// event backend
+			if (strcmp(optarg, "epoll") == 0) {
+				backendType = BACKEND_EPOLL;
+			} else if (strcmp(optarg, "poll") == 0) {
+				backendType = BACKEND_POLL;
+			} else if (strcmp(optarg, "uring") == 0) {
+				backendType = BACKEND_URING;
+			} else {
+				fprintf(stderr, "[-e] Unknown event backend (it has to be epoll, poll or uring).\n");
+				return EXIT_FAILURE;
+			}
+			if (verbose) fprintf(stderr, "[-e] Event backend: %s\n", optarg);
+			break;
+		case 'a':
+			// answer for the blacklisted names
+			if (strcmp(optarg, "refused") == 0) {
+				action = BLOCK_REFUSED;
+			} else if (strcmp(optarg, "nxdomain") == 0) {
+				action = BLOCK_NXDOMAIN;
+			} else if (inet_pton(AF_INET, optarg, &sinkhole) == 1) {
+				action = BLOCK_ADDRESS;
+			} else {
+				fprintf(stderr, "[-a] Unknown block action (it has to be refused, nxdomain or IPv4 address).\n");
+				return EXIT_FAILURE;
+			}
+			if (verbose) fprintf(stderr, "[-a] Block action: %s\n", optarg);
+			break;
+		case 'l':;
+			// TTL of the answer for the blacklisted names
+			char* ttlPtr = NULL;
+			long ttl = strtol(optarg, &ttlPtr, 10);
+			if (*ttlPtr != '\0' || ttlPtr == optarg || ttl < 0 || ttl > INT32_MAX) {
+				fprintf(stderr, "[-l] Incorrect TTL (it has to be non-negative integer value).\n");
+				return EXIT_FAILURE;
+			}
+			blockTtl = ttl;
+			if (verbose) fprintf(stderr, "[-l] Block TTL: %u\n", blockTtl);
+			break;
+		case 'R':;
+			// rate limit of one client and of one network
+			char *rateEnd = NULL, *networkEnd = NULL;
+			unsigned long rate = strtoul(optarg, &rateEnd, 10), netRate = 0;
+			if (*rateEnd == ',') netRate = strtoul(rateEnd + 1, &networkEnd, 10);
+			if (rateEnd == optarg || optarg[0] == '-' || (*rateEnd != '\0' && *rateEnd != ',')
+				|| (networkEnd && (networkEnd == rateEnd + 1 || *networkEnd != '\0' || rateEnd[1] == '-'))
+				|| rate > RATE_MAX || netRate > RATE_MAX || (rate == 0 && netRate == 0)) {
+				fprintf(stderr, "[-R] Incorrect rate limit (it has to be <queries per second>[,<queries per second of network>], "
+					"at most %d).\n", RATE_MAX);
+				return EXIT_FAILURE;
+			}
+			clientRate = rate;
+			networkRate = netRate;
+			if (verbose) fprintf(stderr, "[-R] Rate limit: %u per client, %u per network\n", clientRate, networkRate);
+			break;
+		case 'T':
+			// clients over the rate limit get TC instead of nothing
+			rateTruncate = true;
+			if (verbose) fprintf(stderr, "[-T] Clients over the rate limit get truncated answers.\n");
+			break;
+		case 'q':
+			// query log file or syslog
+			if (queryLogFile != -1) close(queryLogFile);
+			queryLogFile = -1;
+			queryLogSyslog = strcmp(optarg, "syslog") == 0;
+			if (queryLogSyslog) {
+				openlog("dns", LOG_PID, LOG_DAEMON);
+			} else if ((queryLogFile = open(optarg, O_WRONLY | O_CREAT | O_APPEND, 0644)) == -1) {
+				fprintf(stderr, "[-q] Could not open query log file %s: %s\n", optarg, strerror(errno));
+				return EXIT_FAILURE;
+			}
+			if (verbose) fprintf(stderr, "[-q] Query log: %s\n", optarg);
+			break;
+		case 'm':;
+			// metrics endpoint, only on the local machine without the address
+			const char *colon = strrchr(optarg, ':');
+			const char *portText = colon ? colon + 1 : optarg;
+			char address[INET_ADDRSTRLEN] = "127.0.0.1";
+			size_t addressLength = colon ? (size_t)(colon - optarg) : 0;
+			bool addressValid = !colon || (addressLength > 0 && addressLength < sizeof(address));
+			if (colon && addressValid) {
+				memcpy(address, optarg, addressLength);
+				address[addressLength] = '\0';
+			}
+			char* metricsPtr = NULL;
+			long metricsPort = strtol(portText, &metricsPtr, 10);
+			memset(&metricsAddress, 0, sizeof(metricsAddress));
+			metricsAddress.sin_family = AF_INET;
+			metricsAddress.sin_port = htons(metricsPort);
+			if (*metricsPtr != '\0' || metricsPtr == portText || metricsPort < 1 || metricsPort > 65535 || !addressValid
+				|| inet_pton(AF_INET, address, &metricsAddress.sin_addr) != 1) {
+				fprintf(stderr, "[-m] Incorrect metrics endpoint (it has to be [<IPv4 address>:]<port>).\n");
+				return EXIT_FAILURE;
+			}
+			metricsEnabled = true;
+			if (verbose) fprintf(stderr, "[-m] Metrics endpoint: %s:%ld\n", address, metricsPort);
+			break;
+		case 'h':
+		default:
+			//print help
+			printHelp();
+		}
+	}
+	if (upstreamCount == 0) {
+		fprintf(stderr, "[-s] You have to input server name.\n");
+		return EXIT_FAILURE;
+	}
+	if (filterFileCount == 0) {
+		fprintf(stderr, "[-f] You have to input name of filter table.\n");
+		return EXIT_FAILURE;
+	}
+	if (getDnsFilter(filterFileNames, filterFileCount)) return EXIT_FAILURE;
+	if (verbose) fprintf(stderr, "[-f] %lu filter rules loaded.\n", (unsigned long)blacklist->header->size);
+	makeBlockAnswer(action, sinkhole, blockTtl);
+	//verbose mode without the query log writes the entries about packets on stdout
+	if (verbose && !queryLogEnabled()) queryLogFile = STDOUT_FILENO;
+	return EXIT_SUCCESS;
+}
+
+
+/**
+ * @fn setErrorAnswer()
+ * @brief Change the query in the buffer to the answer with given response code (question stays the same)
+ * @param buffer Buffer with the query
+ * @param dnsHeader Header of the query
+ * @param rcode Response code
+ */
+void setErrorAnswer(char *buffer, HEADER *dnsHeader, int rcode) {
+	dnsHeader->qr = 1; // response flag
+	dnsHeader->aa = 1; // authoritive answer
+	dnsHeader->ra = 1; // recursion available
+	dnsHeader->rcode = rcode; // response code
+	dnsHeader->ancount = 0; // number of answer queries
+	dnsHeader->nscount = 0; // number of authority entries
+	memcpy(buffer, dnsHeader, 12);
+}
+
+/**
+ * @fn writeOptRecord()
+ * @brief Write our OPT record (root name, type, UDP payload size, no extended rcode, version 0, no flags and options)
+ * @param record Destination, 11 bytes
+ */
+void writeOptRecord(unsigned char *record) {
+	memset(record, 0, 11);
+	record[2] = ns_t_opt;
+	record[3] = ednsPayload >> 8;
+	record[4] = ednsPayload;
+}
+
+/**
+ * @fn blockedAnswer()
+ * @brief Write the answer for the blacklisted name to the buffer with the query, the template is copied behind
+ * the question (nothing is allocated) and the client with OPT record gets our OPT record
+ * @param buffer Buffer with the query (at least 48 + 11 bytes behind the question)
+ * @param dnsHeader Header of the query
+ * @param view Parsed query
+ * @return unsigned length of the answer
+ */
+unsigned blockedAnswer(char *buffer, HEADER *dnsHeader, const struct dnsView *view) {
+	dnsHeader->qr = 1;
+	dnsHeader->aa = 1;
+	dnsHeader->ra = 1;
+	dnsHeader->rcode = blockAnswer.rcode;
+	dnsHeader->ancount = htons(blockAnswer.answers);
+	dnsHeader->nscount = htons(blockAnswer.authorities);
+	dnsHeader->arcount = htons(view->opt ? 1 : 0);
+	memcpy(buffer, dnsHeader, 12);
+	memcpy(buffer + view->questionEnd, blockAnswer.records, blockAnswer.length);
+	unsigned length = view->questionEnd + blockAnswer.length;
+	if (view->opt) {
+		writeOptRecord((unsigned char *)buffer + length);
+		length += 11;
+	}
+	return length;
+}
+
+/**
+ * @fn clientPayload()
+ * @brief Get the UDP payload size which the client accepts (from its OPT record, never less than 512 bytes)
+ * @param view Parsed query
+ * @return uint16_t payload size
+ */
+uint16_t clientPayload(const struct dnsView *view) {
+	if (!view->opt) return EDNS_MIN_PAYLOAD;
+	uint16_t payload = view->packet[view->opt + 3] << 8 | view->packet[view->opt + 4];
+	return payload < EDNS_MIN_PAYLOAD ? EDNS_MIN_PAYLOAD : payload;
+}
+
+/**
+ * @fn advertisePayload()
+ * @brief Put our UDP payload size to the OPT record of the query for the server, the record is added when the
+ * client did not send one (the answer is fitted to the client later)
+ * @param buffer Buffer with the query
+ * @param length Length of the query
+ * @param size Size of the buffer
+ * @param view Parsed query
+ * @return unsigned length of the query
+ */
+unsigned advertisePayload(char *buffer, unsigned length, unsigned size, const struct dnsView *view) {
+	unsigned char *data = (unsigned char *)buffer;
+	if (view->opt) {
+		data[view->opt + 3] = ednsPayload >> 8;
+		data[view->opt + 4] = ednsPayload;
+		return length;
+	}
+	if ((unsigned)view->recordsEnd + 11 > size) return length;
+	writeOptRecord(data + view->recordsEnd);
+	uint16_t additional = (data[10] << 8 | data[11]) + 1;
+	data[10] = additional >> 8;
+	data[11] = additional;
+	return view->recordsEnd + 11;
+}
+
+/**
+ * @fn fitAnswerParts()
+ * @brief Split the answer to the parts the client gets behind its header (nothing is copied), the OPT record is left
+ * out for the client which did not send one and the answer longer than the UDP payload size of the client is cut
+ * to the question (and the OPT record) with TC set, so the client asks again over TCP
+ * @param answer Answer
+ * @param length Length of the answer
+ * @param questionEnd Offset behind the question
+ * @param opt Offset of the OPT record (0 when there is none), it is left out only when it is the last record
+ * @param edns Client query had OPT record
+ * @param payload UDP payload size of the client
+ * @param header Header of the answer, changed to the header for the client
+ * @param parts Destination of the parts (at most two)
+ * @return int number of the parts
+ */
+int fitAnswerParts(const char *answer, unsigned length, unsigned questionEnd, unsigned opt, bool edns, uint16_t payload,
+	HEADER *header, struct iovec *parts) {
+	unsigned optLength = opt ? 11 + ((unsigned char)answer[opt + 9] << 8 | (unsigned char)answer[opt + 10]) : 0;
+	if (opt && !edns && opt + optLength == length) {
+		length = opt;
+		header->arcount = htons(ntohs(header->arcount) - 1);
+	}
+	parts[0].iov_base = (char *)answer + 12;
+	if (length <= payload) {
+		parts[0].iov_len = length - 12;
+		return 1;
+	}
+	header->tc = 1;
+	header->ancount = 0;
+	header->nscount = 0;
+	header->arcount = 0;
+	parts[0].iov_len = questionEnd - 12;
+	if (!opt || !edns) return 1;
+	header->arcount = htons(1);
+	parts[1].iov_base = (char *)answer + opt;
+	parts[1].iov_len = optLength;
+	return 2;
+}
+
+/**
+ * @fn fitAnswer()
+ * @brief Fit the answer in the buffer to the client (see fitAnswerParts())
+ * @param buffer Buffer with the answer
+ * @param length Length of the answer
+ * @param questionEnd Offset behind the question
+ * @param opt Offset of the OPT record (0 when there is none)
+ * @param edns Client query had OPT record
+ * @param payload UDP payload size of the client
+ * @return unsigned length of the answer for the client
+ */
+unsigned fitAnswer(char *buffer, unsigned length, unsigned questionEnd, unsigned opt, bool edns, uint16_t payload) {
+	HEADER header;
+	struct iovec parts[2];
+	memcpy(&header, buffer, 12);
+	int count = fitAnswerParts(buffer, length, questionEnd, opt, edns, payload, &header, parts);
+	memcpy(buffer, &header, 12);
+	// parts only move towards the start of the buffer
+	length = 12;
+	for (int i = 0; i < count; i++) {
+		memmove(buffer + length, parts[i].iov_base, parts[i].iov_len);
+		length += parts[i].iov_len;
+	}
+	return length;
+}
+
+/**
+ * @fn sendMessages()
+ * @brief Send the messages by sendmmsg(), message which can not be sent is skipped
+ * @param socket Socket descriptor
+ * @param messages Messages
+ * @param count Number of messages
+ */
+void sendMessages(int socket, struct mmsghdr *messages, unsigned count) {
+	unsigned sent = 0;
+	while (sent < count) {
+		int result = sendmmsg(socket, &messages[sent], count - sent, 0);
+		if (result < 0) {
+			if (errno == EINTR) continue;
+			fprintf(stderr, "Error sending packet. Sendmmsg: %s\n", strerror(errno));
+			result = 1;
+		}
+		sent += result;
+	}
+}
+
+/**
+ * @fn fanOutAnswer()
+ * @brief Send the answer to all clients waiting for the same question, each gets its own header (id and rd bit)
+ * and the rest of the packet is shared (fitted to the EDNS of the client)
+ * @param worker Worker
+ * @param answer Parsed answer
+ * @param query Pending query with the waiting clients
+ */
+void fanOutAnswer(struct worker *worker, const struct dnsView *answer, struct pendingQuery *query) {
+	struct mmsghdr messages[BATCH_SIZE];
+	struct iovec iov[BATCH_SIZE][3];
+	HEADER headers[BATCH_SIZE];
+	HEADER answerHeader;
+	const char *buffer = (const char *)answer->packet;
+	memcpy(&answerHeader, buffer, 12);
+	for (unsigned done = 0; done < query->waiterCount;) {
+		unsigned count = 0;
+		for (; count < BATCH_SIZE && done + count < query->waiterCount; count++) {
+			struct waiter *waiter = &query->waiters[done + count];
+			headers[count] = answerHeader;
+			headers[count].id = waiter->id;
+			headers[count].rd = waiter->rd;
+			iov[count][0].iov_base = &headers[count];
+			iov[count][0].iov_len = 12;
+			int parts = fitAnswerParts(buffer, answer->length, answer->questionEnd, answer->opt, waiter->edns,
+				waiter->payload, &headers[count], &iov[count][1]);
+			memset(&messages[count].msg_hdr, 0, sizeof(struct msghdr));
+			messages[count].msg_hdr.msg_iov = iov[count];
+			messages[count].msg_hdr.msg_iovlen = 1 + parts;
+			messages[count].msg_hdr.msg_name = &waiter->address;
+			messages[count].msg_hdr.msg_namelen = sizeof(struct sockaddr_in6);
+		}
+		sendMessages(worker->clientSocket, messages, count);
+		done += count;
+	}
+}
+
+/**
+ * @fn armPendingQuery()
+ * @brief Remember the server of the (re)sent query and set its deadline (TCP gets two timeouts for the handshake)
+ * @param worker Worker
+ * @param query Pending query
+ * @param index Index of the server
+ * @param now Current time in microseconds
+ */
+void armPendingQuery(struct worker *worker, struct pendingQuery *query, int index, uint64_t now) {
+	struct upstreamState *state = &worker->upstreams[index];
+	query->upstream = index;
+	query->sentTime = now;
+	query->serial = ++worker->serial;
+	if (!state->unansweredSince) state->unansweredSince = now;
+	uint64_t timeout = query->tcp ? 2 * upstreamTimeout(state) : upstreamTimeout(state);
+	if (addTimer(worker->timers, query->key, query->serial, (now + timeout) / 1000)) {
+		fprintf(stderr, "Could not add deadline of the query. Not enough memory.\n");
+	}
+}
+
+/**
+ * @fn sendPendingQuery()
+ * @brief Choose the server for the (re)sent query and set its deadline
+ * @param worker Worker
+ * @param query Pending query
+ * @param avoid Index of the server which should not get the query (-1 for none)
+ * @return int index of the server
+ */
+int sendPendingQuery(struct worker *worker, struct pendingQuery *query, int avoid) {
+	uint64_t now = getMicroTime();
+	int index = selectUpstream(worker, now, avoid);
+	armPendingQuery(worker, query, index, now);
+	return index;
+}
+
+/**
+ * @fn completePendingQuery()
+ * @brief Remove the answered (or failed) query from the pending table and from the index of questions
+ * @param worker Worker
+ * @param query Pending query
+ */
+void completePendingQuery(struct worker *worker, struct pendingQuery *query) {
+	removeInflightQuery(worker->inflight, query->questionHash, query->key);
+	removePendingQuery(worker->pending, query);
+}
+
+/**
+ * @fn tokenConnection()
+ * @brief Get the TCP connection registered with the token
+ * @param worker Worker
+ * @param token Token of the upstream or client connection
+ * @return struct tcpConnection* connection
+ */
+struct tcpConnection *tokenConnection(struct worker *worker, uint32_t token) {
+	if (token >= TOKEN_TCP_CLIENT) return &worker->tcpClients[token - TOKEN_TCP_CLIENT];
+	return &worker->upstreamConnections[token - TOKEN_UPSTREAM].connection;
+}
+
+/**
+ * @fn closeTcpConnection()
+ * @brief Close the TCP connection and free its buffers, queries sent over the upstream connection are left to
+ * their deadlines
+ * @param worker Worker
+ * @param token Token of the connection
+ */
+void closeTcpConnection(struct worker *worker, uint32_t token) {
+	struct tcpConnection *connection = tokenConnection(worker, token);
+	if (connection->fd == -1) return;
+	worker->backend->remove(worker->backend, connection->fd, token);
+	close(connection->fd);
+	connection->fd = -1;
+	connection->serial++;
+	connection->connecting = false;
+	connection->writing = false;
+	free(connection->input);
+	free(connection->output);
+	connection->input = NULL;
+	connection->output = NULL;
+	connection->inputLength = 0;
+	connection->outputLength = 0;
+	connection->outputAllocated = 0;
+	if (token >= TOKEN_TCP_CLIENT) {
+		worker->tcpClientCount--;
+	} else {
+		worker->upstreamConnections[token - TOKEN_UPSTREAM].count = 0;
+	}
+}
+
+/**
+ * @fn openTcpConnection()
+ * @brief Set up the slot for the connected (or connecting) socket and register it with the event backend
+ * @param worker Worker
+ * @param token Token of the connection
+ * @param fd Non blocking socket
+ * @param address Address of the peer
+ * @return int 0 on success, 1 on error (the socket is closed)
+ */
+int openTcpConnection(struct worker *worker, uint32_t token, int fd, struct sockaddr_in6 *address) {
+	struct tcpConnection *connection = tokenConnection(worker, token);
+	connection->input = malloc(TCP_BUFFER_SIZE);
+	if (!connection->input) {
+		fprintf(stderr, "Could not allocate TCP buffer. Not enough memory.\n");
+		close(fd);
+		return EXIT_FAILURE;
+	}
+	if (worker->backend->add(worker->backend, fd, token, false)) {
+		fprintf(stderr, "Could not register the TCP connection with the event backend.\n");
+		free(connection->input);
+		connection->input = NULL;
+		close(fd);
+		return EXIT_FAILURE;
+	}
+	connection->fd = fd;
+	connection->lastActive = getTime();
+	connection->address = *address;
+	if (token >= TOKEN_TCP_CLIENT) worker->tcpClientCount++;
+	return EXIT_SUCCESS;
+}
+
+/**
+ * @fn flushTcpConnection()
+ * @brief Write as much of the queued output as the socket takes, the rest waits for writability
+ * @param worker Worker
+ * @param token Token of the connection
+ * @return int 0 on success, 1 when the connection failed
+ */
+int flushTcpConnection(struct worker *worker, uint32_t token) {
+	struct tcpConnection *connection = tokenConnection(worker, token);
+	while (connection->outputLength && !connection->connecting) {
+		ssize_t sent = send(connection->fd, connection->output, connection->outputLength, MSG_NOSIGNAL);
+		if (sent < 0) {
+			if (errno == EINTR) continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+			return EXIT_FAILURE;
+		}
+		memmove(connection->output, connection->output + sent, connection->outputLength - sent);
+		connection->outputLength -= sent;
+	}
+	bool writing = connection->connecting || connection->outputLength > 0;
+	if (writing != connection->writing) {
+		if (worker->backend->watch(worker->backend, connection->fd, token, writing)) return EXIT_FAILURE;
+		connection->writing = writing;
+	}
+	return EXIT_SUCCESS;
+}
+
+/**
+ * @fn queueTcpMessage()
+ * @brief Append the message with its length to the output of the connection
+ * @param connection TCP connection
+ * @param message Message
+ * @param length Length of the message
+ * @return unsigned char* copy of the message in the output or NULL when the output is full
+ */
+unsigned char *queueTcpMessage(struct tcpConnection *connection, const char *message, unsigned length) {
+	size_t needed = (size_t)connection->outputLength + 2 + length;
+	if (needed > TCP_MAX_OUTPUT) return NULL;
+	if (needed > connection->outputAllocated) {
+		size_t allocated = connection->outputAllocated ? 2 * (size_t)connection->outputAllocated : 4096;
+		while (allocated < needed) allocated *= 2;
+		if (allocated > TCP_MAX_OUTPUT) allocated = TCP_MAX_OUTPUT;
+		unsigned char *output = realloc(connection->output, allocated);
+		if (!output) return NULL;
+		connection->output = output;
+		connection->outputAllocated = allocated;
+	}
+	unsigned char *frame = &connection->output[connection->outputLength];
+	frame[0] = length >> 8;
+	frame[1] = length;
+	memcpy(frame + 2, message, length);
+	connection->outputLength = needed;
+	return frame + 2;
+}
+
+/**
+ * @fn replyTcp()
+ * @brief Send the answer to the TCP client, the client which does not read its answers is disconnected
+ * @param worker Worker
+ * @param index Index of the client connection
+ * @param buffer Answer
+ * @param length Length of the answer
+ */
+void replyTcp(struct worker *worker, int index, const char *buffer, unsigned length) {
+	uint32_t token = TOKEN_TCP_CLIENT + index;
+	if (!queueTcpMessage(&worker->tcpClients[index], buffer, length) || flushTcpConnection(worker, token)) {
+		closeTcpConnection(worker, token);
+	}
+}
+
+/**
+ * @fn tcpClientConnected()
+ * @brief Check that the TCP client of the pending query is still connected (the slot may have a new connection)
+ * @param worker Worker
+ * @param query Pending query
+ * @return bool true when the answer can be sent
+ */
+bool tcpClientConnected(struct worker *worker, struct pendingQuery *query) {
+	struct tcpConnection *connection = &worker->tcpClients[query->connection];
+	return connection->fd != -1 && connection->serial == query->connectionSerial;
+}
+
+/**
+ * @fn openSocket()
+ * @brief Create dual-stack IPv6 socket, IPv4 peers use it as v4-mapped addresses, so every socket and every stored
+ * address of clients and servers is struct sockaddr_in6
+ * @param type Type of the socket (with flags)
+ * @param protocol Protocol
+ * @return int socket descriptor or -1 on error
+ */
+int openSocket(int type, int protocol) {
+	int fd = socket(AF_INET6, type, protocol);
+	int off = 0;
+	if (fd != -1 && setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof(off)) == -1) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/**
+ * @fn connectUpstream()
+ * @brief Start non blocking connect to the upstream server, queries are queued until it is connected
+ * @param worker Worker
+ * @param index Index of the server
+ * @return int 0 on success, 1 on error
+ */
+int connectUpstream(struct worker *worker, int index) {
+	int fd = openSocket(SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd == -1) {
+		fprintf(stderr, "Could not create a TCP socket: %s\n", strerror(errno));
+		return EXIT_FAILURE;
+	}
+	int one = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	if (connect(fd, (struct sockaddr *)&upstreams[index], sizeof(struct sockaddr_in6)) == -1 && errno != EINPROGRESS) {
+		fprintf(stderr, "Could not connect to the server over TCP: %s\n", strerror(errno));
+		close(fd);
+		return EXIT_FAILURE;
+	}
+	uint32_t token = TOKEN_UPSTREAM + index;
+	if (openTcpConnection(worker, token, fd, &upstreams[index])) return EXIT_FAILURE;
+	// writability reports the end of the handshake
+	worker->upstreamConnections[index].connection.connecting = true;
+	if (flushTcpConnection(worker, token)) {
+		closeTcpConnection(worker, token);
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
+
+/**
+ * @fn sendTcpQuery()
+ * @brief Send the pending query over the persistent TCP connection to the server (after truncated UDP answer),
+ * the query gets id unique on the connection, when it can not be sent it waits for its deadline
+ * @param worker Worker
+ * @param query Pending query with the copy of the packet
+ * @param index Index of the server
+ */
+void sendTcpQuery(struct worker *worker, struct pendingQuery *query, int index) {
+	query->tcp = true;
+	armPendingQuery(worker, query, index, getMicroTime());
+	struct upstreamConnection *upstream = &worker->upstreamConnections[index];
+	if (!query->packet || (upstream->connection.fd == -1 && connectUpstream(worker, index))) return;
+	if (upstream->count == TCP_MAX_PIPELINE) {
+		// the query waits for its deadline (its timeout is counted)
+		if (verbose) fprintf(stderr, "Too many queries on the TCP connection to the server.\n");
+		return;
+	}
+	uint16_t id;
+	bool used;
+	do {
+		id = randomId(worker->pending);
+		used = false;
+		for (unsigned i = 0; i < upstream->count; i++) used |= upstream->queries[i].id == id;
+	} while (used);
+	unsigned char *message = queueTcpMessage(&upstream->connection, query->packet, query->packetLength);
+	if (!message) {
+		fprintf(stderr, "Could not queue the query on the TCP connection to the server.\n");
+		return;
+	}
+	message[0] = id >> 8;
+	message[1] = id;
+	struct tcpQuery *sent = &upstream->queries[upstream->count++];
+	sent->id = id;
+	sent->key = query->key;
+	sent->serial = query->serial;
+	if (flushTcpConnection(worker, TOKEN_UPSTREAM + index)) closeTcpConnection(worker, TOKEN_UPSTREAM + index);
+}
+
+/**
+ * @fn lockRateSet()
+ * @brief Take the spin lock of the set of buckets (it is held only for a few loads and stores)
+ * @param set Set
+ */
+void lockRateSet(struct rateSet *set) {
+	while (__atomic_exchange_n(&set->lock, 1, __ATOMIC_ACQUIRE)) {
+		while (__atomic_load_n(&set->lock, __ATOMIC_RELAXED));
+	}
+}
+
+/**
+ * @fn unlockRateSet()
+ * @brief Release the spin lock of the set of buckets
+ * @param set Set
+ */
+void unlockRateSet(struct rateSet *set) {
+	__atomic_store_n(&set->lock, 0, __ATOMIC_RELEASE);
+}
+
+/**
+ * @fn findRateSet()
+ * @brief Get the set of buckets where the key belongs
+ * @param table Table of the buckets
+ * @param key Prefix of the client or of the network
+ * @return struct rateSet* set
+ */
+struct rateSet *findRateSet(struct rateTable *table, uint64_t key) {
+	return &table->sets[(key * 0x9e3779b97f4a7c15ull) >> (64 - RATE_SET_BITS)];
+}
+
+/**
+ * @fn refillBucket()
+ * @brief Find the token bucket of the key in its locked set and refill it by the time since its last use, a new key
+ * replaces the least recently used bucket of the set (the table never grows) and starts full
+ * @param set Locked set of the key
+ * @param key Prefix of the client or of the network
+ * @param now Time in milliseconds (not 0)
+ * @param rate Queries per second
+ * @return struct rateBucket* bucket of the key
+ */
+struct rateBucket *refillBucket(struct rateSet *set, uint64_t key, uint32_t now, uint32_t rate) {
+	struct rateBucket *bucket = NULL, *oldest = &set->buckets[0];
+	for (int i = 0; i < RATE_WAYS; i++) {
+		struct rateBucket *way = &set->buckets[i];
+		if (way->time != 0 && way->key == key) {
+			bucket = way;
+			break;
+		}
+		if (oldest->time != 0 && (way->time == 0 || now - way->time > now - oldest->time)) oldest = way;
+	}
+	uint32_t full = rate * 1000;
+	if (!bucket) {
+		bucket = oldest;
+		bucket->key = key;
+		bucket->tokens = full;
+	} else {
+		uint32_t elapsed = now - bucket->time;
+		bucket->tokens = elapsed >= 1000 || full - bucket->tokens <= elapsed * rate ? full : bucket->tokens + elapsed * rate;
+	}
+	bucket->time = now;
+	return bucket;
+}
+
+/**
+ * @fn clientAllowed()
+ * @brief Check the rate limits of the client and of its network, IPv4 client is one address in a /24 network,
+ * IPv6 client is one /64 (usually one host or one site) in a /48 network
+ * @param rates Buckets shared by the workers
+ * @param address Client address
+ * @return bool false when the client is over one of the limits
+ */
+bool clientAllowed(struct rateLimiter *rates, const struct sockaddr_in6 *address) {
+	uint64_t high, low;
+	memcpy(&high, &address->sin6_addr.s6_addr[0], 8);
+	memcpy(&low, &address->sin6_addr.s6_addr[8], 8);
+	high = be64toh(high);
+	low = be64toh(low);
+	bool ipv4 = IN6_IS_ADDR_V4MAPPED(&address->sin6_addr);
+	// 0 marks the empty bucket
+	uint32_t now = getTime();
+	if (now == 0) now = 1;
+	// both buckets are checked before any token is taken, so a query dropped by the network limit does not use the
+	// allowance of the client (the sets are always locked client first, the tables are different)
+	struct rateSet *clientSet = NULL, *networkSet = NULL;
+	struct rateBucket *client = NULL, *network = NULL;
+	if (clientRate) {
+		uint64_t key = ipv4 ? low : high;
+		clientSet = findRateSet(&rates->clients, key);
+		lockRateSet(clientSet);
+		client = refillBucket(clientSet, key, now, clientRate);
+	}
+	if (networkRate) {
+		uint64_t key = ipv4 ? low & ~0xffull : high & ~0xffffull;
+		networkSet = findRateSet(&rates->networks, key);
+		lockRateSet(networkSet);
+		network = refillBucket(networkSet, key, now, networkRate);
+	}
+	bool allowed = (!client || client->tokens >= 1000) && (!network || network->tokens >= 1000);
+	if (allowed) {
+		if (client) client->tokens -= 1000;
+		if (network) network->tokens -= 1000;
+	}
+	if (networkSet) unlockRateSet(networkSet);
+	if (clientSet) unlockRateSet(clientSet);
+	return allowed;
+}
+
+/**
+ * @fn processQuery()
+ * @brief Process the query from the client, the buffer is changed to the answer or to the query for the server
+ * @param worker Worker which received the query
+ * @param buffer Buffer with the query
+ * @param length Length of the packet (changed to the length of the answer)
+ * @param clientAddress Address of the client
+ * @param connection Index of the TCP client connection (-1 for UDP client)
+ * @param serverSocket Destination of the index of the server socket for the forwarded query
+ * @param upstream Destination of the index of the upstream server for the forwarded query
+ * @return enum packetAction what to do with the buffer
+ */
+enum packetAction processQuery(struct worker *worker, char *buffer, unsigned *length, struct sockaddr_in6 *clientAddress, int connection,
+	int *serverSocket, int *upstream) {
+	countStat(worker, STAT_QUERIES);
+	if (*length < 12) return ACTION_DROP;
+	//get the DNS header
+	HEADER dnsHeader;
+	memcpy(&dnsHeader, buffer, 12);
+	// UDP source can be forged, so the clients over the limit get nothing (not even errors) or the question with TC
+	// which is never bigger than the query, TCP clients are not limited
+	if (connection == -1 && rateBuckets && !clientAllowed(rateBuckets, clientAddress)) {
+		countStat(worker, STAT_RATE_LIMITED);
+		struct dnsView view;
+		if (!rateTruncate || dnsHeader.qr || parseDnsPacket(buffer, *length, &view)) return ACTION_DROP;
+		dnsHeader.qr = 1;
+		dnsHeader.tc = 1;
+		dnsHeader.ra = 1;
+		dnsHeader.ancount = 0;
+		dnsHeader.nscount = 0;
+		dnsHeader.arcount = 0;
+		memcpy(buffer, &dnsHeader, 12);
+		*length = view.questionEnd;
+		return ACTION_REPLY;
+	}
+	// check correct bits for query
+	bool badPacket = false;
+	if (dnsHeader.qr != 0 || dnsHeader.unused != 0 || dnsHeader.cd != 0 || dnsHeader.ancount > 0) { 
+		badPacket = true;
+	}
+	//parse the question (one question, name and all records inside the packet)
+	struct dnsView view;
+	if (!badPacket && parseDnsPacket(buffer, *length, &view)) badPacket = true;
+	//this is bad dns packet (format error)
+	if (badPacket || view.type == 0 || view.class == 0) {
+		logEntry(worker, clientAddress, "format error", NULL, clientAddress, false);
+		if (verbose) fprintf(stderr, "Wrong query received, sending RCODE=1 (format error).\n");
+		countStat(worker, STAT_FORMAT_ERRORS);
+		setErrorAnswer(buffer, &dnsHeader, ns_r_formerr);
+		return ACTION_REPLY;
+	}
+	// only EDNS version 0 is known, the client gets the question and BADVERS in our OPT record (the records of the
+	// query are not echoed, the OPT record of the query was behind the question, so the answer fits)
+	if (view.opt && view.packet[view.opt + 6] != 0) {
+		logEntry(worker, clientAddress, "bad EDNS version", &view, clientAddress, false);
+		countStat(worker, STAT_FORMAT_ERRORS);
+		dnsHeader.arcount = htons(1);
+		setErrorAnswer(buffer, &dnsHeader, ns_r_noerror);
+		writeOptRecord((unsigned char *)buffer + view.questionEnd);
+		buffer[view.questionEnd + 5] = EDNS_BADVERS >> 4;
+		*length = view.questionEnd + 11;
+		return ACTION_REPLY;
+	}
+	// this is not implemented
+	if (view.type != ns_t_a || view.class != ns_c_in) {
+		logEntry(worker, clientAddress, "not implemented", &view, clientAddress, false);
+		if (verbose) fprintf(stderr, "Function not implemented, sending RCODE=4 (not implemented error).\n");
+		countStat(worker, STAT_NOT_IMPLEMENTED);
+		setErrorAnswer(buffer, &dnsHeader, ns_r_notimpl);
+		return ACTION_REPLY;
+	}
+	//check blacklist
+	struct nameKey key;
+	makeNameKey(&view, &key);
+	if (isBlacklisted(&key)) {
+		logEntry(worker, clientAddress, "blacklisted", &view, clientAddress, false);
+		countStat(worker, STAT_BLACKLISTED);
+		*length = blockedAnswer(buffer, &dnsHeader, &view);
+		return ACTION_REPLY;
+	}
+	//the answer has to fit to the client (TCP has no limit)
+	bool edns = view.opt != 0;
+	uint16_t payload = connection == -1 ? clientPayload(&view) : UINT16_MAX;
+	//answer from the cache
+	uint32_t questionHash = hashQuestion(&view);
+	if (worker->cache) {
+		uint64_t now = getTime();
+		struct cacheEntry *entry = findCacheEntry(worker->cache, &view, &key, hashCacheKey(&view, &key), now);
+		if (entry) {
+			logEntry(worker, clientAddress, "cached", &view, clientAddress, true);
+			countStat(worker, STAT_CACHED);
+			*length = fitAnswer(buffer, answerFromCache(entry, buffer, now), entry->questionEnd, entry->opt, edns, payload);
+			return ACTION_REPLY;
+		}
+	}
+	//the same question is already asked, wait for its answer (TCP clients get their own query, it may need TCP upstream)
+	unsigned questionLength = view.questionEnd - 12;
+	struct pendingQuery *leader = connection == -1
+		? findInflightQuery(worker->inflight, worker->pending, questionHash, buffer + 12, questionLength) : NULL;
+	if (leader && !addWaiter(worker->pool, leader, dnsHeader.id, dnsHeader.rd, edns, payload, clientAddress)) {
+		logEntry(worker, clientAddress, "coalesced", &view, &upstreams[leader->upstream], false);
+		countStat(worker, STAT_COALESCED);
+		return ACTION_DROP;
+	}
+	//save client address and id, the server gets the id of the pending query
+	struct pendingQuery *query = addPendingQuery(worker->pending, dnsHeader.id, clientAddress, questionHash);
+	if (!query) {
+		// remote clients can cause it, so it is counted and printed only in verbose mode
+		countStat(worker, STAT_PENDING_FULL);
+		if (verbose) fprintf(stderr, "Too many pending queries, dropping the query.\n");
+		return ACTION_DROP;
+	}
+	if (connection != -1) {
+		query->connection = connection;
+		query->connectionSerial = worker->tcpClients[connection].serial;
+	}
+	query->edns = edns;
+	query->payload = payload;
+	dnsHeader.id = htons(query->key & 0xffff);
+	memcpy(buffer, &dnsHeader, 12);
+	*length = advertisePayload(buffer, *length, BUFFER_SIZE, &view);
+	//copy for retries, without it the query is only forgotten at its deadline
+	query->packet = poolGet(worker->pool, *length);
+	if (query->packet) memcpy(query->packet, buffer, *length);
+	query->packetLength = *length;
+	//next clients with this question wait for this query
+	if (query->packet && connection == -1 && addInflightQuery(worker->inflight, questionHash, query->key)) {
+		fprintf(stderr, "Could not index the pending question. Not enough memory.\n");
+	}
+	//the fastest healthy server gets the query
+	int index = sendPendingQuery(worker, query, -1);
+	logEntry(worker, clientAddress, "query", &view, &upstreams[index], false);
+	countStat(worker, STAT_FORWARDED);
+	*serverSocket = query->key >> 16;
+	*upstream = index;
+	return ACTION_FORWARD;
+}
+
+/**
+ * @fn processAnswer()
+ * @brief Process the answer from the server, find the pending query and restore the id of the client
+ * @param worker Worker which received the answer
+ * @param buffer Buffer with the answer (fitted to the client in place)
+ * @param length Length of the answer, changed to the length for the client
+ * @param address Source of the answer, changed to the address of the client
+ * @param socketIndex Index of the server socket which received the answer
+ * @param connection Destination of the index of the TCP client connection (-1 for UDP client)
+ * @return enum packetAction what to do with the buffer
+ */
+enum packetAction processAnswer(struct worker *worker, char *buffer, unsigned *length, struct sockaddr_in6 *address, int socketIndex,
+	int *connection) {
+	if (*length < 12) return ACTION_DROP;
+	HEADER dnsHeader;
+	memcpy(&dnsHeader, buffer, 12);
+	// parse the question (to check it, for the cache and for verbose)
+	struct dnsView view;
+	if (parseDnsPacket(buffer, *length, &view)) return ACTION_DROP;
+	//check which port and address to send it (according to ID)
+	struct pendingQuery *query = findPendingSlot(worker->pending, (uint32_t)socketIndex << 16 | ntohs(dnsHeader.id));
+	// if ID is not found -> throw it away
+	if (!query->used) {
+		countStat(worker, STAT_UNMATCHED);
+		return ACTION_DROP;
+	}
+	//check the ip and port of the server which got the query
+	struct sockaddr_in6 *upstream = &upstreams[query->upstream];
+	if (address->sin6_port != upstream->sin6_port || !IN6_ARE_ADDR_EQUAL(&address->sin6_addr, &upstream->sin6_addr)) {
+		if (verbose) fprintf(stderr, "Answer from unexpected source, dropping it.\n");
+		countStat(worker, STAT_UNMATCHED);
+		return ACTION_DROP;
+	}
+	uint32_t questionHash = hashQuestion(&view);
+	if (query->questionHash != questionHash) {
+		if (verbose) fprintf(stderr, "Answer does not match the question of the query, dropping it.\n");
+		countStat(worker, STAT_UNMATCHED);
+		return ACTION_DROP;
+	}
+	uint64_t rtt = getMicroTime() - query->sentTime;
+	upstreamAnswered(&worker->upstreams[query->upstream], rtt);
+	countRtt(worker, rtt);
+	//truncated answer for TCP client is asked again over TCP (UDP clients retry over TCP themselves)
+	if (dnsHeader.tc && query->connection != -1 && !query->tcp) {
+		logEntry(worker, address, "truncated", &view, &query->clientAddress, true);
+		countStat(worker, STAT_TRUNCATED);
+		sendTcpQuery(worker, query, query->upstream);
+		return ACTION_DROP;
+	}
+	struct sockaddr_in6 serverSource = *address;
+	*address = query->clientAddress;
+	*connection = query->connection;
+	bool connected = query->connection == -1 || tcpClientConnected(worker, query);
+	bool edns = query->edns;
+	uint16_t payload = query->payload;
+	//restore id of the client
+	dnsHeader.id = query->clientId;
+	memcpy(buffer, &dnsHeader, 12);
+	//clients get our UDP payload size
+	if (view.opt) {
+		buffer[view.opt + 3] = ednsPayload >> 8;
+		buffer[view.opt + 4] = ednsPayload;
+	}
+	//clients which asked the same question in the meantime
+	if (query->waiterCount) fanOutAnswer(worker, &view, query);
+	completePendingQuery(worker, query);
+	if (worker->cache) {
+		struct nameKey key;
+		makeNameKey(&view, &key);
+		cacheAnswer(worker->cache, &view, &key, hashCacheKey(&view, &key));
+	}
+	logEntry(worker, &serverSource, "answer", &view, address, true);
+	countStat(worker, STAT_ANSWERS);
+	//the cache has the whole answer, the client gets what it can take
+	*length = fitAnswer(buffer, *length, view.questionEnd, view.opt, edns, payload);
+	return connected ? ACTION_REPLY : ACTION_DROP;
+}
+
+/**
+ * @fn receiveBatch()
+ * @brief Receive waiting packets from the socket by one recvmmsg() call
+ * @param socket Socket descriptor
+ * @param packets Batch for the packets
+ * @return int number of received packets
+ */
+int receiveBatch(int socket, struct packetBatch *packets) {
+	for (int i = 0; i < BATCH_SIZE; i++) {
+		packets->iov[i].iov_base = packets->buffers[i];
+		packets->iov[i].iov_len = BUFFER_SIZE;
+		memset(&packets->messages[i].msg_hdr, 0, sizeof(struct msghdr));
+		packets->messages[i].msg_hdr.msg_iov = &packets->iov[i];
+		packets->messages[i].msg_hdr.msg_iovlen = 1;
+		packets->messages[i].msg_hdr.msg_name = &packets->addresses[i];
+		packets->messages[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in6);
+	}
+	int count = recvmmsg(socket, packets->messages, BATCH_SIZE, MSG_DONTWAIT, NULL);
+	if (count < 0) {
+		if (errno != EAGAIN && errno != EWOULDBLOCK) fprintf(stderr, "Not able to receive packet. Recvmmsg: %s\n", strerror(errno));
+		return 0;
+	}
+	packets->count = count;
+	return count;
+}
+
+/**
+ * @fn queuePacket()
+ * @brief Add the packet to the queue for sendmmsg() (the buffer is not copied)
+ * @param queue Send queue
+ * @param buffer Packet
+ * @param length Length of the packet
+ * @param address Destination address
+ */
+void queuePacket(struct sendQueue *queue, char *buffer, unsigned length, struct sockaddr_in6 *address) {
+	unsigned i = queue->count++;
+	queue->iov[i].iov_base = buffer;
+	queue->iov[i].iov_len = length;
+	memset(&queue->messages[i].msg_hdr, 0, sizeof(struct msghdr));
+	queue->messages[i].msg_hdr.msg_iov = &queue->iov[i];
+	queue->messages[i].msg_hdr.msg_iovlen = 1;
+	queue->messages[i].msg_hdr.msg_name = address;
+	queue->messages[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in6);
+}
+
+/**
+ * @fn flushQueue()
+ * @brief Send all queued packets by sendmmsg(), packet which can not be sent is skipped
+ * @param socket Socket descriptor
+ * @param queue Send queue
+ */
+void flushQueue(int socket, struct sendQueue *queue) {
+	sendMessages(socket, queue->messages, queue->count);
+	queue->count = 0;
+}
+
+// state of the poll backend ->count ->fds ->tokens
+struct pollState {
+	nfds_t count;
+	struct pollfd fds[MAX_EVENTS];
+	uint32_t tokens[MAX_EVENTS];
+};
+
+/**
+ * @fn pollAdd()
+ * @brief Register the socket with the poll backend
+ * @param backend Event backend
+ * @param fd Socket descriptor
+ * @param token Token reported with the events of the socket
+ * @param packets Not used (poll only reports readiness)
+ * @return int 0 on success, 1 on error
+ */
+int pollAdd(struct eventBackend *backend, int fd, uint32_t token, bool packets) {
+	(void)packets;
+	struct pollState *state = backend->state;
+	if (state->count == MAX_EVENTS) return EXIT_FAILURE;
+	state->fds[state->count].fd = fd;
+	state->fds[state->count].events = POLLIN;
+	state->tokens[state->count++] = token;
+	return EXIT_SUCCESS;
+}
+
+/**
+ * @fn pollWatch()
+ * @brief Turn reporting of writability of the socket on or off
+ * @param backend Event backend
+ * @param fd Socket descriptor
+ * @param token Token of the socket
+ * @param writable Whether to report writability
+ * @return int 0 on success, 1 when the socket is not registered
+ */
+int pollWatch(struct eventBackend *backend, int fd, uint32_t token, bool writable) {
+	(void)token;
+	struct pollState *state = backend->state;
+	for (nfds_t i = 0; i < state->count; i++) {
+		if (state->fds[i].fd == fd) {
+			state->fds[i].events = writable ? POLLIN | POLLOUT : POLLIN;
+			return EXIT_SUCCESS;
+		}
+	}
+	return EXIT_FAILURE;
+}
+
+/**
+ * @fn pollRemove()
+ * @brief Unregister the socket (the last socket takes its place)
+ * @param backend Event backend
+ * @param fd Socket descriptor
+ * @param token Token of the socket
+ */
+void pollRemove(struct eventBackend *backend, int fd, uint32_t token) {
+	(void)token;
+	struct pollState *state = backend->state;
+	for (nfds_t i = 0; i < state->count; i++) {
+		if (state->fds[i].fd == fd) {
+			state->count--;
+			state->fds[i] = state->fds[state->count];
+			state->tokens[i] = state->tokens[state->count];
+			return;
+		}
+	}
+}
+
+/**
+ * @fn pollWait()
+ * @brief Wait for readable sockets by poll() (level triggered)
+ * @param backend Event backend
+ * @param events Destination of the events
+ * @param maxEvents Maximal number of events
+ * @param timeout Timeout in milliseconds (-1 waits forever)
+ * @return int number of events or -1 on error
+ */
+int pollWait(struct eventBackend *backend, struct event *events, int maxEvents, int timeout) {
+	struct pollState *state = backend->state;
+	if (poll(state->fds, state->count, timeout) == -1) return errno == EINTR ? 0 : -1;
+	int count = 0;
+	for (nfds_t i = 0; i < state->count && count < maxEvents; i++) {
+		if (state->fds[i].revents & (POLLIN | POLLOUT | POLLERR | POLLHUP)) {
+			memset(&events[count], 0, sizeof(struct event));
+			events[count].writable = state->fds[i].revents & POLLOUT;
+			events[count++].token = state->tokens[i];
+		}
+	}
+	return count;
+}
+
+/**
+ * @fn epollAdd()
+ * @brief Register the socket with the epoll backend (edge triggered, the worker drains the socket)
+ * @param backend Event backend
+ * @param fd Socket descriptor
+ * @param token Token reported with the events of the socket
+ * @param packets Not used (epoll only reports readiness)
+ * @return int 0 on success, 1 on error
+ */
+int epollAdd(struct eventBackend *backend, int fd, uint32_t token, bool packets) {
+	(void)packets;
+	struct epoll_event event;
+	event.events = EPOLLIN | EPOLLET;
+	event.data.u64 = token;
+	return epoll_ctl(*(int *)backend->state, EPOLL_CTL_ADD, fd, &event) == -1 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/**
+ * @fn epollWatch()
+ * @brief Turn reporting of writability of the socket on or off (edge triggered too)
+ * @param backend Event backend
+ * @param fd Socket descriptor
+ * @param token Token of the socket
+ * @param writable Whether to report writability
+ * @return int 0 on success, 1 on error
+ */
+int epollWatch(struct eventBackend *backend, int fd, uint32_t token, bool writable) {
+	struct epoll_event event;
+	event.events = writable ? EPOLLIN | EPOLLOUT | EPOLLET : EPOLLIN | EPOLLET;
+	event.data.u64 = token;
+	return epoll_ctl(*(int *)backend->state, EPOLL_CTL_MOD, fd, &event) == -1 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/**
+ * @fn epollRemove()
+ * @brief Unregister the socket
+ * @param backend Event backend
+ * @param fd Socket descriptor
+ * @param token Token of the socket
+ */
+void epollRemove(struct eventBackend *backend, int fd, uint32_t token) {
+	(void)token;
+	epoll_ctl(*(int *)backend->state, EPOLL_CTL_DEL, fd, NULL);
+}
+
+/**
+ * @fn epollWait()
+ * @brief Wait for sockets which became readable by epoll_wait()
+ * @param backend Event backend
+ * @param events Destination of the events
+ * @param maxEvents Maximal number of events
+ * @param timeout Timeout in milliseconds (-1 waits forever)
+ * @return int number of events or -1 on error
+ */
+int epollWait(struct eventBackend *backend, struct event *events, int maxEvents, int timeout) {
+	struct epoll_event ready[MAX_EVENTS];
+	int count = epoll_wait(*(int *)backend->state, ready, maxEvents < MAX_EVENTS ? maxEvents : MAX_EVENTS, timeout);
+	if (count == -1) return errno == EINTR ? 0 : -1;
+	for (int i = 0; i < count; i++) {
+		memset(&events[i], 0, sizeof(struct event));
+		events[i].token = ready[i].data.u64;
+		events[i].writable = ready[i].events & EPOLLOUT;
+	}
+	return count;
+}
+
+/**
+ * @fn releaseNothing()
+ * @brief Release of the event for backends which do not own packet buffers
+ * @param backend Event backend
+ * @param event Event
+ */
+void releaseNothing(struct eventBackend *backend, struct event *event) {
+	(void)backend;
+	(void)event;
+}
+
+/**
+ * @fn destroyDescriptorBackend()
+ * @brief Free poll or epoll backend
+ * @param backend Event backend
+ */
+void destroyDescriptorBackend(struct eventBackend *backend) {
+	if (backend->type == BACKEND_EPOLL) close(*(int *)backend->state);
+	free(backend->state);
+	free(backend);
+}
+
+#ifdef IORING_RECV_MULTISHOT
+// user data of requests changing or removing the poll of the socket (their completions are ignored)
+#define URING_CONTROL UINT64_MAX
+
+// state of the io_uring backend, every datagram socket has one multishot recvmsg which takes buffers from
+// the registered ring of provided buffers, other sockets have multishot poll
+// ->fd ->sqHead ->sqTail ->sqMask ->sqArray ->cqHead ->cqTail ->cqMask ->sqes ->cqes ->sqTailLocal ->toSubmit
+// ->rings ->ringsSize ->sqesSize ->bufferRing ->bufferTail ->buffers ->message ->fds (socket of each token, -1 for
+// removed ones, so late completions are not submitted again) ->writable (poll of the token waits for writability too)
+struct uringState {
+	int fd;
+	unsigned *sqHead;
+	unsigned *sqTail;
+	unsigned *sqMask;
+	unsigned *sqArray;
+	unsigned *cqHead;
+	unsigned *cqTail;
+	unsigned *cqMask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	unsigned sqTailLocal;
+	unsigned toSubmit;
+	void *rings;
+	size_t ringsSize;
+	size_t sqesSize;
+	struct io_uring_buf_ring *bufferRing;
+	uint16_t bufferTail;
+	char *buffers;
+	struct msghdr message;
+	int fds[MAX_EVENTS];
+	bool writable[MAX_EVENTS];
+};
+
+/**
+ * @fn uringProvideBuffer()
+ * @brief Give the buffer to the kernel (put it to the provided buffer ring)
+ * @param state State of the io_uring backend
+ * @param bufferId Index of the buffer
+ */
+void uringProvideBuffer(struct uringState *state, uint16_t bufferId) {
+	struct io_uring_buf *buffer = &state->bufferRing->bufs[state->bufferTail & (URING_BUFFERS - 1)];
+	buffer->addr = (uint64_t)(uintptr_t)(state->buffers + bufferId * URING_BUFFER_SIZE);
+	buffer->len = URING_BUFFER_SIZE;
+	buffer->bid = bufferId;
+	state->bufferTail++;
+	__atomic_store_n(&state->bufferRing->tail, state->bufferTail, __ATOMIC_RELEASE);
+}
+
+/**
+ * @fn uringGetSqe()
+ * @brief Get the next free submission queue entry (zeroed), it is submitted by the next uringWait()
+ * @param state State of the io_uring backend
+ * @return struct io_uring_sqe* entry or NULL when the submission queue is full
+ */
+struct io_uring_sqe *uringGetSqe(struct uringState *state) {
+	unsigned head = __atomic_load_n(state->sqHead, __ATOMIC_ACQUIRE);
+	if (state->sqTailLocal - head > *state->sqMask) return NULL;
+	unsigned index = state->sqTailLocal & *state->sqMask;
+	struct io_uring_sqe *sqe = &state->sqes[index];
+	memset(sqe, 0, sizeof(struct io_uring_sqe));
+	state->sqArray[index] = index;
+	state->sqTailLocal++;
+	__atomic_store_n(state->sqTail, state->sqTailLocal, __ATOMIC_RELEASE);
+	state->toSubmit++;
+	return sqe;
+}
+
+/**
+ * @fn uringSubmit()
+ * @brief Queue multishot recvmsg (datagram socket) or multishot poll for the socket
+ * @param state State of the io_uring backend
+ * @param fd Socket descriptor
+ * @param token Token of the socket
+ * @param packets Whether to receive packets or only readiness
+ * @return int 0 on success, 1 when the submission queue is full
+ */
+int uringSubmit(struct uringState *state, int fd, uint32_t token, bool packets) {
+	struct io_uring_sqe *sqe = uringGetSqe(state);
+	if (!sqe) return EXIT_FAILURE;
+	sqe->fd = fd;
+	// token and socket together, the request has to be submitted again when the kernel ends it
+	sqe->user_data = (uint64_t)(uint32_t)fd << 32 | token << 1 | packets;
+	if (packets) {
+		sqe->opcode = IORING_OP_RECVMSG;
+		sqe->addr = (uint64_t)(uintptr_t)&state->message;
+		sqe->len = 1;
+		sqe->ioprio = IORING_RECV_MULTISHOT;
+		sqe->flags = IOSQE_BUFFER_SELECT;
+		sqe->buf_group = 0;
+	} else {
+		sqe->opcode = IORING_OP_POLL_ADD;
+		sqe->poll32_events = state->writable[token] ? POLLIN | POLLOUT : POLLIN;
+		sqe->len = IORING_POLL_ADD_MULTI;
+	}
+	return EXIT_SUCCESS;
+}
+
+/**
+ * @fn uringAdd()
+ * @brief Register the socket with the io_uring backend
+ * @param backend Event backend
+ * @param fd Socket descriptor
+ * @param token Token reported with the events of the socket
+ * @param packets Whether the backend receives the datagrams itself
+ * @return int 0 on success, 1 on error
+ */
+int uringAdd(struct eventBackend *backend, int fd, uint32_t token, bool packets) {
+	struct uringState *state = backend->state;
+	state->fds[token] = fd;
+	state->writable[token] = false;
+	return uringSubmit(state, fd, token, packets);
+}
+
+/**
+ * @fn uringWatch()
+ * @brief Change the events of the multishot poll of the socket in place
+ * @param backend Event backend
+ * @param fd Socket descriptor
+ * @param token Token of the socket
+ * @param writable Whether to report writability
+ * @return int 0 on success, 1 when the submission queue is full
+ */
+int uringWatch(struct eventBackend *backend, int fd, uint32_t token, bool writable) {
+	struct uringState *state = backend->state;
+	struct io_uring_sqe *sqe = uringGetSqe(state);
+	if (!sqe) return EXIT_FAILURE;
+	// poll which ended in the meantime is submitted again with the new events
+	state->writable[token] = writable;
+	sqe->opcode = IORING_OP_POLL_REMOVE;
+	sqe->addr = (uint64_t)(uint32_t)fd << 32 | token << 1;
+	sqe->len = IORING_POLL_UPDATE_EVENTS | IORING_POLL_ADD_MULTI;
+	sqe->poll32_events = writable ? POLLIN | POLLOUT : POLLIN;
+	sqe->user_data = URING_CONTROL;
+	return EXIT_SUCCESS;
+}
+
+/**
+ * @fn uringRemove()
+ * @brief Cancel the poll of the socket
+ * @param backend Event backend
+ * @param fd Socket descriptor
+ * @param token Token of the socket
+ */
+void uringRemove(struct eventBackend *backend, int fd, uint32_t token) {
+	struct uringState *state = backend->state;
+	state->fds[token] = -1;
+	struct io_uring_sqe *sqe = uringGetSqe(state);
+	if (!sqe) return;
+	sqe->opcode = IORING_OP_POLL_REMOVE;
+	sqe->addr = (uint64_t)(uint32_t)fd << 32 | token << 1;
+	sqe->user_data = URING_CONTROL;
+}
+
+/**
+ * @fn uringWait()
+ * @brief Submit queued requests and wait for completions, received packets are returned in the events
+ * @param backend Event backend
+ * @param events Destination of the events
+ * @param maxEvents Maximal number of events
+ * @param timeout Timeout in milliseconds (-1 waits forever)
+ * @return int number of events or -1 on error
+ */
+int uringWait(struct eventBackend *backend, struct event *events, int maxEvents, int timeout) {
+	struct uringState *state = backend->state;
+	unsigned head = *state->cqHead;
+	unsigned flags = 0, wait = 0;
+	struct __kernel_timespec timespec;
+	struct io_uring_getevents_arg arg;
+	memset(&arg, 0, sizeof(arg));
+	if (head == __atomic_load_n(state->cqTail, __ATOMIC_ACQUIRE) && timeout != 0) {
+		wait = 1;
+		flags = IORING_ENTER_GETEVENTS;
+		if (timeout > 0) {
+			timespec.tv_sec = timeout / 1000;
+			timespec.tv_nsec = (timeout % 1000) * 1000000L;
+			arg.sigmask_sz = _NSIG / 8;
+			arg.ts = (uint64_t)(uintptr_t)&timespec;
+			flags |= IORING_ENTER_EXT_ARG;
+		}
+	}
+	if (state->toSubmit || wait) {
+		long result = syscall(__NR_io_uring_enter, state->fd, state->toSubmit, wait, flags,
+			flags & IORING_ENTER_EXT_ARG ? (void *)&arg : NULL, flags & IORING_ENTER_EXT_ARG ? sizeof(arg) : _NSIG / 8);
+		if (result < 0 && errno != EINTR && errno != ETIME && errno != EBUSY) return -1;
+		if (result > 0) state->toSubmit -= result;
+	}
+	int count = 0;
+	unsigned tail = __atomic_load_n(state->cqTail, __ATOMIC_ACQUIRE);
+	while (head != tail && count < maxEvents) {
+		struct io_uring_cqe *cqe = &state->cqes[head & *state->cqMask];
+		head++;
+		if (cqe->user_data == URING_CONTROL) continue;
+		int fd = cqe->user_data >> 32;
+		uint32_t token = (uint32_t)cqe->user_data >> 1;
+		bool packets = cqe->user_data & 1;
+		// completion of the removed socket
+		if (state->fds[token] != fd) continue;
+		// multishot request ended (for example there were no free buffers), submit it again
+		if (!(cqe->flags & IORING_CQE_F_MORE)) uringSubmit(state, fd, token, packets);
+		if (cqe->res < 0) continue;
+		memset(&events[count], 0, sizeof(struct event));
+		events[count].token = token;
+		events[count].writable = !packets && (cqe->res & POLLOUT);
+		if (packets && (cqe->flags & IORING_CQE_F_BUFFER)) {
+			uint16_t bufferId = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+			char *buffer = state->buffers + bufferId * URING_BUFFER_SIZE;
+			struct io_uring_recvmsg_out *out = (struct io_uring_recvmsg_out *)buffer;
+			events[count].bufferId = bufferId;
+			events[count].address = (struct sockaddr_in6 *)(buffer + sizeof(struct io_uring_recvmsg_out));
+			events[count].buffer = buffer + sizeof(struct io_uring_recvmsg_out) + state->message.msg_namelen;
+			events[count].length = out->payloadlen < BUFFER_SIZE ? out->payloadlen : BUFFER_SIZE;
+			if (out->flags & MSG_TRUNC) {
+				// truncated packet is not processed
+				uringProvideBuffer(state, bufferId);
+				continue;
+			}
+		} else if (packets) {
+			continue;
+		}
+		count++;
+	}
+	__atomic_store_n(state->cqHead, head, __ATOMIC_RELEASE);
+	return count;
+}
+
+/**
+ * @fn uringRelease()
+ * @brief Give the buffer of the processed packet back to the kernel
+ * @param backend Event backend
+ * @param event Event with the packet
+ */
+void uringRelease(struct eventBackend *backend, struct event *event) {
+	if (event->buffer) uringProvideBuffer(backend->state, event->bufferId);
+}
 
+/**
+ * @fn uringDestroy()
+ * @brief Close the io_uring and free its rings and buffers
+ * @param backend Event backend
+ */
+void uringDestroy(struct eventBackend *backend) {
+	struct uringState *state = backend->state;
+	if (state->fd != -1) close(state->fd);
+	if (state->rings) munmap(state->rings, state->ringsSize);
+	if (state->sqes) munmap(state->sqes, state->sqesSize);
+	if (state->bufferRing) munmap(state->bufferRing, URING_BUFFERS * sizeof(struct io_uring_buf));
+	free(state->buffers);
+	free(state);
+	free(backend);
+}
 
 /**
- * @fn printVerbose()
- * @brief Only print if verbose mode is turned on
- * @param string string to print
-*/
-void printVerbose(char * string) {
-	if (verbose) {
-		fprintf(stdout, "%s", string);
+ * @fn uringInit()
+ * @brief Set up the io_uring (rings mapped into memory) and register the ring of provided buffers
+ * @param backend Event backend with allocated (zeroed) state
+ * @return int 0 on success, 1 on error
+ */
+int uringInit(struct eventBackend *backend) {
+	struct uringState *state = backend->state;
+	struct io_uring_params params;
+	memset(&params, 0, sizeof(params));
+	state->fd = syscall(__NR_io_uring_setup, URING_BUFFERS, &params);
+	if (state->fd < 0 || !(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_EXT_ARG)) {
+		fprintf(stderr, "Could not set up io_uring: %s\n", state->fd < 0 ? strerror(errno) : "kernel is too old");
+		return EXIT_FAILURE;
+	}
+	size_t sqSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	size_t cqSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	state->ringsSize = sqSize > cqSize ? sqSize : cqSize;
+	state->rings = mmap(NULL, state->ringsSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, state->fd, IORING_OFF_SQ_RING);
+	state->sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+	state->sqes = mmap(NULL, state->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, state->fd, IORING_OFF_SQES);
+	if (state->rings == MAP_FAILED || state->sqes == MAP_FAILED) {
+		if (state->rings == MAP_FAILED) state->rings = NULL;
+		if (state->sqes == MAP_FAILED) state->sqes = NULL;
+		fprintf(stderr, "Could not map io_uring rings: %s\n", strerror(errno));
+		return EXIT_FAILURE;
 	}
+	char *rings = state->rings;
+	state->sqHead = (unsigned *)(rings + params.sq_off.head);
+	state->sqTail = (unsigned *)(rings + params.sq_off.tail);
+	state->sqMask = (unsigned *)(rings + params.sq_off.ring_mask);
+	state->sqArray = (unsigned *)(rings + params.sq_off.array);
+	state->cqHead = (unsigned *)(rings + params.cq_off.head);
+	state->cqTail = (unsigned *)(rings + params.cq_off.tail);
+	state->cqMask = (unsigned *)(rings + params.cq_off.ring_mask);
+	state->cqes = (struct io_uring_cqe *)(rings + params.cq_off.cqes);
+	state->sqTailLocal = *state->sqTail;
+	// ring of provided buffers (group 0) shared by all multishot receives
+	state->bufferRing = mmap(NULL, URING_BUFFERS * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	state->buffers = malloc(URING_BUFFERS * URING_BUFFER_SIZE);
+	if (state->bufferRing == MAP_FAILED || !state->buffers) {
+		if (state->bufferRing == MAP_FAILED) state->bufferRing = NULL;
+		fprintf(stderr, "Could not allocate io_uring buffers. Not enough memory.\n");
+		return EXIT_FAILURE;
+	}
+	struct io_uring_buf_reg registration;
+	memset(&registration, 0, sizeof(registration));
+	registration.ring_addr = (uint64_t)(uintptr_t)state->bufferRing;
+	registration.ring_entries = URING_BUFFERS;
+	registration.bgid = 0;
+	if (syscall(__NR_io_uring_register, state->fd, IORING_REGISTER_PBUF_RING, &registration, 1) < 0) {
+		fprintf(stderr, "Could not register io_uring buffers: %s\n", strerror(errno));
+		return EXIT_FAILURE;
+	}
+	for (uint16_t i = 0; i < URING_BUFFERS; i++) uringProvideBuffer(state, i);
+	// template of the received message, only the lengths are used by multishot recvmsg
+	state->message.msg_namelen = sizeof(struct sockaddr_in6);
+	return EXIT_SUCCESS;
 }
+#endif
 
 /**
- * @fn clear()
- * @brief Handle for sigterm signal (for proper exiting server - free memory and close sockets)
-*/
-void clear() {
-	printVerbose("\nClearing sockets...\n");
-	//close all sockets
-	if (clientSocketDescritor != -1) close(clientSocketDescritor);
-	if (serverSocketDescritor != -1) close(serverSocketDescritor);
-	// free blacklist
-	printVerbose("Clearing blacklist...\n");
-	if (blacklist != NULL) {	
-		for (long unsigned i = 0; i < blacklist->size; i++) {
-			free(blacklist->r[i]);
+ * @fn newEventBackend()
+ * @brief Create the event backend of the given type
+ * @param type Type of the backend
+ * @return struct eventBackend* new backend or NULL on error
+ */
+struct eventBackend *newEventBackend(enum backendType type) {
+	struct eventBackend *backend = calloc(1, sizeof(struct eventBackend));
+	if (!backend) return NULL;
+	backend->type = type;
+	backend->release = releaseNothing;
+	backend->destroy = destroyDescriptorBackend;
+	switch (type) {
+	case BACKEND_POLL:
+		backend->add = pollAdd;
+		backend->watch = pollWatch;
+		backend->remove = pollRemove;
+		backend->wait = pollWait;
+		backend->state = calloc(1, sizeof(struct pollState));
+		break;
+	case BACKEND_EPOLL:
+		backend->add = epollAdd;
+		backend->watch = epollWatch;
+		backend->remove = epollRemove;
+		backend->wait = epollWait;
+		backend->state = malloc(sizeof(int));
+		if (backend->state) {
+			*(int *)backend->state = epoll_create1(EPOLL_CLOEXEC);
+			if (*(int *)backend->state == -1) {
+				fprintf(stderr, "Could not create epoll: %s\n", strerror(errno));
+				free(backend->state);
+				backend->state = NULL;
+			}
+		}
+		break;
+	case BACKEND_URING:
+#ifdef IORING_RECV_MULTISHOT
+		backend->add = uringAdd;
+		backend->watch = uringWatch;
+		backend->remove = uringRemove;
+		backend->wait = uringWait;
+		backend->release = uringRelease;
+		backend->destroy = uringDestroy;
+		backend->state = calloc(1, sizeof(struct uringState));
+		if (backend->state) {
+			((struct uringState *)backend->state)->fd = -1;
+			if (uringInit(backend)) {
+				uringDestroy(backend);
+				return NULL;
+			}
 		}
-		free(blacklist->r);
-		free(blacklist);
+		break;
+#else
+		fprintf(stderr, "The program was built without io_uring support.\n");
+		free(backend);
+		return NULL;
+#endif
 	}
-	//free response object
-	if (resp != NULL) {
-		if (resp->buffer != NULL) free(resp->buffer);
-		free(resp);
+	if (!backend->state) {
+		free(backend);
+		return NULL;
 	}
-	exit(EXIT_SUCCESS);
+	return backend;
 }
 
 /**
- * @fn getDnsFilter()
- * @brief Get all names from the filers file and store them to the dynamic array
- * @param name Name of the file
+ * @fn initWorker()
+ * @brief Open sockets of the worker (client socket shares the port with other workers) and allocate its tables
+ * @param worker Worker
+ * @param portNumber Local port for client queries
  * @return int 0 on success, 1 on error
-*/
-int getDnsFilter(char *name) {
-	const unsigned ALLOC_SIZE = 20;
-	const unsigned FILE_BUFFER_SIZE = 512;
-	//initialize blacklist structure
-	blacklist = (struct blacklist_s*)malloc(sizeof(struct blacklist_s));
-	blacklist->r = malloc(ALLOC_SIZE * sizeof(char *));
-	blacklist->allocated = ALLOC_SIZE;
-	blacklist->size = 0;
-	//initialize buffer
-	char filebuf[FILE_BUFFER_SIZE], *bufPtr;
-	for (unsigned int i = 0; i < FILE_BUFFER_SIZE; i++) {
-		filebuf[i] = '\0';
-	}
-  	FILE *blacklistFile = fopen(name,"r");
-	if (blacklistFile == NULL) {
-		fprintf(stderr, "Error opening filter file: %s", name);
-		return EXIT_FAILURE;
-	}
-	//start the loop
-	bufPtr = fgets(filebuf, FILE_BUFFER_SIZE, blacklistFile);
-	unsigned int k;
-	while (bufPtr) {
-		// check #
-		if (bufPtr[0] == '#') {
-			bufPtr = fgets(filebuf, FILE_BUFFER_SIZE, blacklistFile);
-			continue;
+ */
+int initWorker(struct worker *worker, int portNumber) {
+	//opening socket for client incoming questions and client answers
+	worker->clientSocket = openSocket(SOCK_DGRAM, IPPROTO_UDP);
+	if (worker->clientSocket == -1) {
+		fprintf(stderr, "Could not create a new client socket: %s\n", strerror(errno));
+		return EXIT_FAILURE;
+	}
+	// kernel spreads the clients between workers
+	int reuse = 1;
+	if (workerCount > 1 && setsockopt(worker->clientSocket, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse)) == -1) {
+		fprintf(stderr, "Could not share the client port between workers. %s\n", strerror(errno));
+		return EXIT_FAILURE;
+	}
+	struct sockaddr_in6 clientListenAddress;
+	bzero(&clientListenAddress, sizeof(struct sockaddr_in6));
+	clientListenAddress.sin6_family = AF_INET6;
+	clientListenAddress.sin6_port = htons(portNumber);
+	clientListenAddress.sin6_addr = in6addr_any;
+	if (bind(worker->clientSocket, (const struct sockaddr *) &clientListenAddress, sizeof(clientListenAddress)) == -1) {
+		fprintf(stderr, "Could not bind a client listen socket. %s\n", strerror(errno));
+		return EXIT_FAILURE;
+	}
+	//opening sockets for server incoming questions and server answers (kernel picks random source port for each)
+	for (int i = 0; i < serverSocketCount; i++) {
+		worker->serverSockets[i] = openSocket(SOCK_DGRAM, IPPROTO_UDP);
+		if (worker->serverSockets[i] == -1) {
+			fprintf(stderr, "Could not create a new server socket: %s\n", strerror(errno));
+			return EXIT_FAILURE;
 		}
-		// check the names
-		for (k = 0; k < FILE_BUFFER_SIZE; k++) {
-			if (filebuf[k] == '\n') { filebuf[k] = '\0';break; }
-			if (filebuf[k] < ' ') { filebuf[k] = '\0'; }
-			filebuf[k] &= 0x7f;
-		}
-		bufPtr[FILE_BUFFER_SIZE - 1] = '\0';
-		if (blacklist->size == blacklist->allocated) {
-			//allocate more memory
-			char ** tmp;
-			tmp = realloc(blacklist->r, (blacklist->allocated + ALLOC_SIZE) * sizeof(char*));
-			if (!tmp) {
-				fprintf(stderr, "Could not reallocate array of filer names. Not enough memory.\nProgram will continue with %lu filter names loaded.", blacklist->size);
-				return EXIT_SUCCESS;
-			} else {
-				blacklist->r = tmp;
-				blacklist->allocated += ALLOC_SIZE;
-			}
+		struct sockaddr_in6 localAddress;
+		bzero(&localAddress, sizeof(struct sockaddr_in6));
+		localAddress.sin6_family = AF_INET6;
+		localAddress.sin6_port = htons(0);
+		localAddress.sin6_addr = in6addr_any;
+		if (bind(worker->serverSockets[i], (const struct sockaddr *) &localAddress, sizeof(localAddress)) == -1) {
+			fprintf(stderr, "Could not bind a server socket. %s\n", strerror(errno));
+			return EXIT_FAILURE;
+		}
+	}
+	//listening socket for TCP clients on the same port (shared by the workers like the client socket)
+	worker->listenSocket = openSocket(SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (worker->listenSocket == -1) {
+		fprintf(stderr, "Could not create a new TCP listen socket: %s\n", strerror(errno));
+		return EXIT_FAILURE;
+	}
+	if (setsockopt(worker->listenSocket, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)) == -1
+		|| (workerCount > 1 && setsockopt(worker->listenSocket, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse)) == -1)) {
+		fprintf(stderr, "Could not share the TCP port between workers. %s\n", strerror(errno));
+		return EXIT_FAILURE;
+	}
+	if (bind(worker->listenSocket, (const struct sockaddr *) &clientListenAddress, sizeof(clientListenAddress)) == -1
+		|| listen(worker->listenSocket, TCP_LISTEN_BACKLOG) == -1) {
+		fprintf(stderr, "Could not bind a TCP listen socket. %s\n", strerror(errno));
+		return EXIT_FAILURE;
+	}
+	worker->tcpClients = calloc(TCP_MAX_CLIENTS, sizeof(struct tcpConnection));
+	worker->upstreamConnections = calloc(upstreamCount, sizeof(struct upstreamConnection));
+	if (!worker->tcpClients || !worker->upstreamConnections) {
+		fprintf(stderr, "Could not allocate TCP connections. Not enough memory.\n");
+		return EXIT_FAILURE;
+	}
+	for (int i = 0; i < TCP_MAX_CLIENTS; i++) worker->tcpClients[i].fd = -1;
+	for (int i = 0; i < upstreamCount; i++) worker->upstreamConnections[i].connection.fd = -1;
+	// buffers for received packets and queues of packets to send
+	worker->batch = malloc(sizeof(struct packetBatch));
+	worker->clientQueue = calloc(1, sizeof(struct sendQueue));
+	worker->serverQueues = calloc(serverSocketCount, sizeof(struct sendQueue));
+	// forwarded queries waiting for the answer, server gets our own id in order to manage more request at the same time
+	worker->pool = newBufferPool();
+	worker->pending = worker->pool ? newPendingTable(worker->pool) : NULL;
+	worker->timers = newTimerWheel(getTime());
+	worker->inflight = newInflightTable();
+	if (cacheSize > 0 && worker->pool) worker->cache = newAnswerCache(cacheSize, worker->pool);
+	if (queryLogEnabled()) {
+		worker->log = aligned_alloc(64, sizeof(struct logRing));
+		if (worker->log) worker->log->head = worker->log->tail = 0;
+	}
+	if (!worker->batch || !worker->clientQueue || !worker->serverQueues || !worker->pending || !worker->timers
+		|| !worker->inflight || (cacheSize > 0 && !worker->cache) || (queryLogEnabled() && !worker->log)) {
+		fprintf(stderr, "Could not allocate buffers. Not enough memory.\n");
+		return EXIT_FAILURE;
+	}
+	// all sockets of the worker are waited for by one event backend
+	worker->backend = newEventBackend(backendType);
+	if (!worker->backend) {
+		fprintf(stderr, "Could not create the event backend.\n");
+		return EXIT_FAILURE;
+	}
+	if (worker->backend->add(worker->backend, worker->clientSocket, TOKEN_CLIENT, true)) {
+		fprintf(stderr, "Could not register the client socket with the event backend: %s\n", strerror(errno));
+		return EXIT_FAILURE;
+	}
+	for (int i = 0; i < serverSocketCount; i++) {
+		if (worker->backend->add(worker->backend, worker->serverSockets[i], TOKEN_SERVER + i, true)) {
+			fprintf(stderr, "Could not register the server socket with the event backend: %s\n", strerror(errno));
+			return EXIT_FAILURE;
 		}
-		// insert the name
-		blacklist->r[blacklist->size++] = strdup(bufPtr);
-		bufPtr = fgets(filebuf, FILE_BUFFER_SIZE, blacklistFile);
 	}
-	fclose(blacklistFile);
+	if (worker->backend->add(worker->backend, worker->listenSocket, TOKEN_LISTEN, false)) {
+		fprintf(stderr, "Could not register the TCP listen socket with the event backend: %s\n", strerror(errno));
+		return EXIT_FAILURE;
+	}
 	return EXIT_SUCCESS;
 }
 
 /**
- * @fn isBlacklisted()
- * @brief Check if the given name is blacklisted.
- * @param name Address name to filter
- * @return int 1 if it is blacklisted, 0 if it in not blacklisted
-*/
-int isBlacklisted(char *name) {
-	//search the list
-	for(unsigned long i = 0; i < blacklist->size; i++) {
-		if (strstr(name, blacklist->r[i])) {
-			// found a match
-			return 1;
+ * @fn handleQueryPacket()
+ * @brief Process the client query and queue the answer to the client or the query to the server
+ * @param worker Worker
+ * @param buffer Packet (modified in place, has to stay valid until the queues are flushed)
+ * @param length Length of the packet
+ * @param address Address of the client (has to stay valid until the queues are flushed)
+ */
+void handleQueryPacket(struct worker *worker, char *buffer, unsigned length, struct sockaddr_in6 *address) {
+	int serverSocket = 0, upstream = 0;
+	switch (processQuery(worker, buffer, &length, address, -1, &serverSocket, &upstream)) {
+	case ACTION_REPLY:
+		queuePacket(worker->clientQueue, buffer, length, address);
+		break;
+	case ACTION_FORWARD:
+		queuePacket(&worker->serverQueues[serverSocket], buffer, length, &upstreams[upstream]);
+		break;
+	case ACTION_DROP:
+		break;
+	}
+}
+
+/**
+ * @fn handleAnswerPacket()
+ * @brief Process the server answer and queue it to the client
+ * @param worker Worker
+ * @param socketIndex Index of the server socket which received the answer
+ * @param buffer Packet (modified in place, has to stay valid until the queues are flushed)
+ * @param length Length of the packet
+ * @param address Address of the server, replaced by the address of the client
+ */
+void handleAnswerPacket(struct worker *worker, int socketIndex, char *buffer, unsigned length, struct sockaddr_in6 *address) {
+	int connection = -1;
+	if (processAnswer(worker, buffer, &length, address, socketIndex, &connection) == ACTION_REPLY) {
+		if (connection != -1) {
+			replyTcp(worker, connection, buffer, length);
+		} else {
+			queuePacket(worker->clientQueue, buffer, length, address);
 		}
 	}
-	return 0;
 }
 
 /**
- * @fn printIp()
- * @brief Print IPv4 address in readable human-friendly form (dot notation) + print the port
- * @param ip Ip address (unsigned int)
- * @param port Port (int)
+ * @fn handleTcpQuery()
+ * @brief Process one query from the TCP client, answers go back over the connection, forwarded queries over UDP
+ * @param worker Worker
+ * @param token Token of the client connection
+ * @param message Query (stays in the input of the connection, it is copied because the answer can be longer)
+ * @param length Length of the query
+ */
+void handleTcpQuery(struct worker *worker, uint32_t token, char *message, unsigned length) {
+	int index = token - TOKEN_TCP_CLIENT;
+	char buffer[BUFFER_SIZE];
+	if (length > BUFFER_SIZE) {
+		countStat(worker, STAT_TOO_LONG);
+		if (verbose) fprintf(stderr, "Too long query over TCP, dropping it.\n");
+		return;
+	}
+	memcpy(buffer, message, length);
+	int serverSocket = 0, upstream = 0;
+	switch (processQuery(worker, buffer, &length, &worker->tcpClients[index].address, index, &serverSocket, &upstream)) {
+	case ACTION_REPLY:
+		replyTcp(worker, index, buffer, length);
+		break;
+	case ACTION_FORWARD:
+		if (sendto(worker->serverSockets[serverSocket], buffer, length, 0, (struct sockaddr *)&upstreams[upstream],
+			sizeof(struct sockaddr_in6)) == -1) {
+			fprintf(stderr, "Error sending packet. Sendto: %s\n", strerror(errno));
+		}
+		break;
+	case ACTION_DROP:
+		break;
+	}
+}
+
+/**
+ * @fn handleTcpAnswer()
+ * @brief Process one answer from the upstream TCP connection, it is matched to the query by the id on the connection
+ * @param worker Worker
+ * @param token Token of the upstream connection
+ * @param message Answer (modified in place)
+ * @param length Length of the answer
  */
-void printIp(unsigned int ip, int port) {
-    unsigned char bytes[4];
-    bytes[0] = ip & 0xFF;
-    bytes[1] = (ip >> 8) & 0xFF;
-    bytes[2] = (ip >> 16) & 0xFF;
-    bytes[3] = (ip >> 24) & 0xFF;   
-    printf("%d.%d.%d.%d#%d\t", bytes[3], bytes[2], bytes[1], bytes[0], port);        
+void handleTcpAnswer(struct worker *worker, uint32_t token, char *message, unsigned length) {
+	int index = token - TOKEN_UPSTREAM;
+	struct upstreamConnection *upstream = &worker->upstreamConnections[index];
+	if (length < 12) return;
+	uint16_t id = (unsigned char)message[0] << 8 | (unsigned char)message[1];
+	unsigned i = 0;
+	while (i < upstream->count && upstream->queries[i].id != id) i++;
+	if (i == upstream->count) {
+		if (verbose) fprintf(stderr, "Answer with unknown id over TCP, dropping it.\n");
+		countStat(worker, STAT_UNMATCHED);
+		return;
+	}
+	struct tcpQuery sent = upstream->queries[i];
+	upstream->queries[i] = upstream->queries[--upstream->count];
+	// the query was sent again or answered in the meantime
+	struct pendingQuery *query = findPendingSlot(worker->pending, sent.key);
+	if (!query->used || query->serial != sent.serial) return;
+	// the answer continues as if it came over UDP with the id of the pending query
+	message[0] = sent.key >> 8;
+	message[1] = sent.key;
+	struct sockaddr_in6 address = upstreams[index];
+	int connection = -1;
+	if (processAnswer(worker, message, &length, &address, sent.key >> 16, &connection) != ACTION_REPLY) return;
+	if (connection != -1) {
+		replyTcp(worker, connection, message, length);
+	} else if (sendto(worker->clientSocket, message, length, 0, (struct sockaddr *)&address, sizeof(address)) == -1) {
+		fprintf(stderr, "Error sending packet. Sendto: %s\n", strerror(errno));
+	}
 }
 
 /**
- * @fn printVerboseEntry()
- * @brief Prints some packet data on new line
- * @param inIp Ip address of source
- * @param inPort Port of the source
- * @param type Form of the entry (string)
- * @param name Name of the DNS query
- * @param outIp Ip address of the destination
- * @param outPort Port of the destination
- * @param answer Bool whether to print query (0) or answer (1)
+ * @fn readTcpConnection()
+ * @brief Read everything the peer sent and handle all complete messages, closed connection is released
+ * @param worker Worker
+ * @param token Token of the connection
  */
-void printVerboseEntry(unsigned int inIp, int inPort, char* type, char *name, unsigned int outIp, int outPort, bool answer) {
-	if (verbose) {
-		if (answer) {
-			printIp(outIp, outPort); printVerbose("\t<--\t"); printIp(inIp, inPort);
-		} else {
-			printIp(inIp, inPort); printVerbose("\t-->\t"); printIp(outIp, outPort);
+void readTcpConnection(struct worker *worker, uint32_t token) {
+	struct tcpConnection *connection = tokenConnection(worker, token);
+	void (*handle)(struct worker *, uint32_t, char *, unsigned) = token >= TOKEN_TCP_CLIENT ? handleTcpQuery : handleTcpAnswer;
+	while (connection->fd != -1) {
+		ssize_t received = recv(connection->fd, connection->input + connection->inputLength,
+			TCP_BUFFER_SIZE - connection->inputLength, 0);
+		if (received < 0 && errno == EINTR) continue;
+		if (received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return;
+		if (received <= 0) {
+			closeTcpConnection(worker, token);
+			return;
 		}
-		printVerbose("\t");	printVerbose(type);	printVerbose(":\t"); printVerbose(name); printVerbose("\n");
+		connection->lastActive = getTime();
+		connection->inputLength += received;
+		unsigned offset = 0;
+		while (connection->inputLength - offset >= 2) {
+			unsigned length = connection->input[offset] << 8 | connection->input[offset + 1];
+			if (connection->inputLength - offset - 2 < length) break;
+			handle(worker, token, (char *)&connection->input[offset + 2], length);
+			// the client was disconnected by its answer
+			if (connection->fd == -1) return;
+			offset += 2 + length;
+		}
+		memmove(connection->input, connection->input + offset, connection->inputLength - offset);
+		connection->inputLength -= offset;
 	}
 }
 
 /**
- * @fn getDnsRequestData()
- * @brief Get name, type and class from DNS packet
- * @param buffer DNS packet
- * @param urt Destination of the name
- * @param type Destination of the type (int)
- * @param class Destination of the class (int)
+ * @fn acceptTcpClients()
+ * @brief Accept all waiting TCP clients, clients over the limit are closed at once
+ * @param worker Worker
  */
-void getDnsRequestData(char *buffer, char *url, int *type, int *class) {
-	//first we have to skip header
-	char *ptr = buffer + sizeof(HEADER);
-	int sum = ptr[0];
-	int offset = 0, counter = 1, counterDst = 0;
-	// get name from the dns packet (according to RFC 1035)
-	while(sum) {
-		if(offset) url[counterDst++] = '.';
-		while (counter <= offset + sum) {
-			url[counterDst++] = ptr[counter++];
+void acceptTcpClients(struct worker *worker) {
+	while (1) {
+		struct sockaddr_in6 address;
+		socklen_t addressLength = sizeof(address);
+		int fd = accept4(worker->listenSocket, (struct sockaddr *)&address, &addressLength, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (fd == -1) {
+			if (errno == EINTR || errno == ECONNABORTED) continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK) fprintf(stderr, "Could not accept TCP client: %s\n", strerror(errno));
+			return;
+		}
+		int index = 0;
+		while (index < TCP_MAX_CLIENTS && worker->tcpClients[index].fd != -1) index++;
+		if (index == TCP_MAX_CLIENTS) {
+			countStat(worker, STAT_TCP_REJECTED);
+			if (verbose) fprintf(stderr, "Too many TCP clients, closing the connection.\n");
+			close(fd);
+			continue;
 		}
-		sum = ptr[counter];
-		offset = counter++;
+		openTcpConnection(worker, TOKEN_TCP_CLIENT + index, fd, &address);
 	}
-	url[counterDst] = '\0';
-	//now we can extract the type and the class (which are unsigned short number)
-	unsigned short *typePtr = (unsigned short *) &(ptr[counter]);
-	if (type) *type = ntohs(typePtr[0]);
-	if (class) *class = ntohs(typePtr[1]);
 }
 
 /**
- * @fn printHelp()
- * @brief Prints help on stdout and exit the program
+ * @fn closeIdleClients()
+ * @brief Close TCP clients which did not send anything for TCP_IDLE_TIMEOUT
+ * @param worker Worker
+ * @param now Current time in milliseconds
  */
-void printHelp() {
-	printf( "Usage: dns [options]\n"
-			"	-s <ip> or <name>\n"
-			"		(dns server ip)\n"
-			"	-f <file>\n"
-			"		(file with domains to filter)\n"
-			"	[-p <port>]\n"
-			"  		(local bind port, default 53)\n"
-			"	[-h]\n"
-			"		(print help and exit)\n"
-			"	[-v]\n"
-			"		(verbose mode, print status messages on stdout)\n");
-	exit(EXIT_FAILURE);
+void closeIdleClients(struct worker *worker, uint64_t now) {
+	for (int i = 0; i < TCP_MAX_CLIENTS; i++) {
+		struct tcpConnection *connection = &worker->tcpClients[i];
+		if (connection->fd != -1 && now - connection->lastActive >= TCP_IDLE_TIMEOUT) {
+			closeTcpConnection(worker, TOKEN_TCP_CLIENT + i);
+		}
+	}
 }
 
 /**
- * @fn processArgs()
- * @brief Processing command line arguments.
- * @param argc Number of arguments.
- * @param argv Array of arguments.
- * @param serverName String where to write the server name.
- * @param portNumber String to write the port number.
- * @return Integer 0 on successs, 1 on fail.
+ * @fn handleTcpEvent()
+ * @brief Accept clients on the listening socket or finish the connect, write and read the TCP connection
+ * @param worker Worker
+ * @param event Event of the TCP socket
  */
-int processArgs(int argc, char **argv, char *serverName, int *portNumber) {
-	bool serverSelected = false, filterFileSelected = false;
-	int c;
-	//get the command line options
-	while ((c =  getopt(argc, argv, "hvs:p:f:")) != -1) {
-		switch (c) {
-		case 'v':
-			// verbose mode
-			verbose = true;
-			printVerbose("[-v] Verbose mode turned on.\n");
-			break;
-		case 's':;
-			// server name
-			//check ipv4 address (most likely to be)
-			struct sockaddr_in sa;
-			if (inet_pton(AF_INET, optarg, &(sa.sin_addr)) == 1) {
-				//it is valid ipv4 address
-				strcpy(serverName, optarg);
-				serverSelected = true;
-				printVerbose("[-s] Server ip selection: "); printVerbose(serverName); printVerbose("\n");
-				break;
+void handleTcpEvent(struct worker *worker, struct event *event) {
+	if (event->token == TOKEN_LISTEN) {
+		acceptTcpClients(worker);
+		return;
+	}
+	struct tcpConnection *connection = tokenConnection(worker, event->token);
+	// event of the closed connection
+	if (connection->fd == -1) return;
+	if (event->writable) {
+		if (connection->connecting) {
+			int error = 0;
+			socklen_t errorLength = sizeof(error);
+			getsockopt(connection->fd, SOL_SOCKET, SO_ERROR, &error, &errorLength);
+			if (error) {
+				fprintf(stderr, "Could not connect to the server over TCP: %s\n", strerror(error));
+				closeTcpConnection(worker, event->token);
+				return;
+			}
+			connection->connecting = false;
+		}
+		if (flushTcpConnection(worker, event->token)) {
+			closeTcpConnection(worker, event->token);
+			return;
+		}
+	}
+	readTcpConnection(worker, event->token);
+}
+
+/**
+ * @fn flushWorkerQueues()
+ * @brief Send all queued answers to the clients and queries to the server
+ * @param worker Worker
+ */
+void flushWorkerQueues(struct worker *worker) {
+	if (worker->clientQueue->count) flushQueue(worker->clientSocket, worker->clientQueue);
+	for (int i = 0; i < serverSocketCount; i++) {
+		if (worker->serverQueues[i].count) flushQueue(worker->serverSockets[i], &worker->serverQueues[i]);
+	}
+}
+
+// packets prepared by the expired deadlines in the buffers of the worker batch ->worker ->count
+struct expiryContext {
+	struct worker *worker;
+	unsigned count;
+};
+
+/**
+ * @fn queryExpired()
+ * @brief Send the query which was not answered in time to another server or answer SERVFAIL after the last try
+ * @param context Expiry context
+ * @param key Key of the pending query
+ * @param serial Serial of the send which expired
+ */
+void queryExpired(void *context, uint32_t key, uint32_t serial) {
+	struct expiryContext *expiry = context;
+	struct worker *worker = expiry->worker;
+	struct pendingQuery *query = findPendingSlot(worker->pending, key);
+	// answered or sent again in the meantime
+	if (!query->used || query->serial != serial) return;
+	countStat(worker, STAT_TIMEOUTS);
+	upstreamTimedOut(&worker->upstreams[query->upstream]);
+	if (!query->packet) {
+		completePendingQuery(worker, query);
+		return;
+	}
+	// TCP query is sent again over TCP, it does not need the batch buffer
+	if (query->tcp && query->tries < PENDING_MAX_TRIES) {
+		query->tries++;
+		sendTcpQuery(worker, query, selectUpstream(worker, getMicroTime(), query->upstream));
+		return;
+	}
+	// the batch is full, send it before the next packet
+	if (expiry->count == BATCH_SIZE) {
+		flushWorkerQueues(worker);
+		expiry->count = 0;
+	}
+	struct packetBatch *batch = worker->batch;
+	char *buffer = batch->buffers[expiry->count];
+	struct sockaddr_in6 *address = &batch->addresses[expiry->count];
+	expiry->count++;
+	memcpy(buffer, query->packet, query->packetLength);
+	unsigned length = query->packetLength;
+	if (query->tries < PENDING_MAX_TRIES) {
+		query->tries++;
+		int index = sendPendingQuery(worker, query, query->upstream);
+		*address = upstreams[index];
+		queuePacket(&worker->serverQueues[key >> 16], buffer, length, address);
+		return;
+	}
+	//no more tries, the client gets SERVFAIL
+	countStat(worker, STAT_SERVFAILS);
+	HEADER dnsHeader;
+	memcpy(&dnsHeader, buffer, 12);
+	dnsHeader.id = query->clientId;
+	setErrorAnswer(buffer, &dnsHeader, ns_r_servfail);
+	*address = query->clientAddress;
+	//the stored query was checked by the parser
+	struct dnsView view;
+	parseDnsPacket(buffer, length, &view);
+	logEntry(worker, &upstreams[query->upstream], "timeout", &view, address, true);
+	if (query->waiterCount) fanOutAnswer(worker, &view, query);
+	length = fitAnswer(buffer, length, view.questionEnd, view.opt, query->edns, query->payload);
+	if (query->connection == -1) {
+		queuePacket(worker->clientQueue, buffer, length, address);
+	} else if (tcpClientConnected(worker, query)) {
+		replyTcp(worker, query->connection, buffer, length);
+	}
+	completePendingQuery(worker, query);
+}
+
+/**
+ * @fn expireQueries()
+ * @brief Process the expired deadlines of the pending queries and send the retries and SERVFAIL answers
+ * @param worker Worker (its batch buffers are used, so it must not hold received packets)
+ */
+void expireQueries(struct worker *worker) {
+	struct expiryContext expiry = {worker, 0};
+	advanceWheel(worker->timers, getTime(), queryExpired, &expiry);
+	if (expiry.count) flushWorkerQueues(worker);
+}
+
+/**
+ * @fn drainSocket()
+ * @brief Receive and process batches from the readable socket, at most BATCH_ROUNDS batches to keep it fair
+ * @param worker Worker
+ * @param token Token of the socket
+ * @return bool true when the socket may still have waiting packets
+ */
+bool drainSocket(struct worker *worker, uint32_t token) {
+	struct packetBatch *batch = worker->batch;
+	int socket = token == TOKEN_CLIENT ? worker->clientSocket : worker->serverSockets[token - TOKEN_SERVER];
+	for (int round = 0; round < BATCH_ROUNDS; round++) {
+		int count = receiveBatch(socket, batch);
+		for (int i = 0; i < count; i++) {
+			// packet longer than the buffer is not complete
+			if (batch->messages[i].msg_hdr.msg_flags & MSG_TRUNC) {
+				countStat(worker, STAT_TOO_LONG);
+				if (verbose) fprintf(stderr, "Too long packet received, dropping it.\n");
+				continue;
 			}
-			//now check the name server
-			struct hostent *hp = gethostbyname(optarg);
-			if (hp != NULL && hp->h_addrtype == AF_INET) {
-				// found the address
-				struct in_addr **address_list = (struct in_addr **)hp->h_addr_list;
-				strcpy(serverName, inet_ntoa(*(address_list[0])));
-				serverSelected = true;
-				printVerbose("[-s] Server ip selection: "); printVerbose(serverName); printVerbose("\n");
-				break;
+			if (token == TOKEN_CLIENT) {
+				handleQueryPacket(worker, batch->buffers[i], batch->messages[i].msg_len, &batch->addresses[i]);
+			} else {
+				handleAnswerPacket(worker, token - TOKEN_SERVER, batch->buffers[i], batch->messages[i].msg_len, &batch->addresses[i]);
 			}
-			//didnt find any valid server
-			fprintf(stderr, "[-s] Server name must be valid (or valid IPv4 address).\n");
-			return EXIT_FAILURE;
-		case 'f':
-			// filter file name
-			if (getDnsFilter(optarg) == 1) {
-				return EXIT_FAILURE;
+		}
+		flushWorkerQueues(worker);
+		if (count < BATCH_SIZE) return false;
+	}
+	return true;
+}
+
+/**
+ * @fn workerLoop()
+ * @brief Main loop of the worker, wait for its sockets by the event backend and process queries and answers in batches
+ * @param arg Worker
+ * @return void* Never returns
+ */
+void *workerLoop(void *arg) {
+	struct worker *worker = arg;
+	struct eventBackend *backend = worker->backend;
+	struct event events[BATCH_SIZE];
+	//sockets which were not drained in the last round (edge triggered backends do not report them again)
+	bool backlog[MAX_EVENTS] = {false};
+	int backlogCount = 0;
+
+	while(1) {
+		//wait for the sockets until the next deadline (the blacklist is not used while waiting), io_uring wait is
+		//not a cancellation point
+		int timeout = backlogCount ? 0 : nextTimerTimeout(worker->timers, getTime());
+		if ((backend->type == BACKEND_URING || worker->tcpClientCount) && (timeout == -1 || timeout > 1000)) timeout = 1000;
+		readerOffline(worker);
+		int count = backend->wait(backend, events, BATCH_SIZE, timeout);
+		if (count == -1) {
+			fprintf(stderr, "Unable to wait for sockets: %s\n", strerror(errno));
+			clear(EXIT_FAILURE);
+		}
+		if (backend->type == BACKEND_URING) pthread_testcancel();
+		readerOnline(worker);
+		//packets received by the backend itself are processed in one batch, then the buffers are returned
+		bool received = false;
+		for (int i = 0; i < count; i++) {
+			if (events[i].token >= TOKEN_LISTEN) {
+				handleTcpEvent(worker, &events[i]);
+			} else if (events[i].buffer) {
+				if (events[i].token == TOKEN_CLIENT) {
+					handleQueryPacket(worker, events[i].buffer, events[i].length, events[i].address);
+				} else {
+					handleAnswerPacket(worker, events[i].token - TOKEN_SERVER, events[i].buffer, events[i].length, events[i].address);
+				}
+				received = true;
+			} else if (!backlog[events[i].token]) {
+				backlog[events[i].token] = true;
+				backlogCount++;
 			}
-			filterFileSelected = true;
-			if (verbose) fprintf(stderr, "[-f] Filter file name selection: %s\n", optarg);
-			break;
-		case 'p':;
-			// port selection
-			// check port number
-			char* ptr = NULL;
-			int port = strtol(optarg, &ptr, 10);
-			if (*ptr != '\0' || ptr == optarg || port > 65535 || port < 0) {
-				fprintf(stderr, "[-p] Incorrect port number (it has to be integer value from 0 to 65535).\n");
-				return EXIT_FAILURE;
+		}
+		if (received) {
+			flushWorkerQueues(worker);
+			for (int i = 0; i < count; i++) backend->release(backend, &events[i]);
+		}
+		//readable sockets, client queries first
+		for (int token = 0; backlogCount && token <= serverSocketCount; token++) {
+			if (backlog[token] && !drainSocket(worker, token)) {
+				backlog[token] = false;
+				backlogCount--;
 			}
-			*portNumber = port;
-			if (verbose) fprintf(stderr, "[-p] Port selection: %d\n", port);
-			break;
-		case 'h':
-		default:
-			//print help
-			printHelp();
+		}
+		//queries which were not answered in time
+		expireQueries(worker);
+		//TCP clients which do not send anything
+		uint64_t now = getTime();
+		if (worker->tcpClientCount && now >= worker->idleCheck) {
+			closeIdleClients(worker, now);
+			worker->idleCheck = now + 1000;
+		}
+		//gauges for the metrics
+		__atomic_store_n(&worker->stats.pending, worker->pending->count, __ATOMIC_RELAXED);
+		__atomic_store_n(&worker->stats.tcpClients, worker->tcpClientCount, __ATOMIC_RELAXED);
+		for (int i = 0; i < POOL_CLASSES; i++) {
+			__atomic_store_n(&worker->stats.poolBuffers[i], worker->pool->classes[i].buffers, __ATOMIC_RELAXED);
+			__atomic_store_n(&worker->stats.poolInUse[i], worker->pool->classes[i].inUse, __ATOMIC_RELAXED);
+			__atomic_store_n(&worker->stats.poolHighWater[i], worker->pool->classes[i].highWater, __ATOMIC_RELAXED);
 		}
 	}
-	if (!serverSelected) {
-		fprintf(stderr, "[-s] You have to input server name.\n");
+	return NULL;
+}
+
+/**
+ * @fn appendText()
+ * @brief Append formatted text to the buffer, text which does not fit is cut
+ * @param text Buffer
+ * @param size Size of the buffer
+ * @param length Length of the text in the buffer, increased by the appended text
+ * @param format Format of printf()
+ */
+void appendText(char *text, size_t size, size_t *length, const char *format, ...) {
+	if (*length >= size) return;
+	va_list arguments;
+	va_start(arguments, format);
+	int written = vsnprintf(text + *length, size - *length, format, arguments);
+	va_end(arguments);
+	if (written > 0) *length += (size_t)written < size - *length ? (size_t)written : size - *length - 1;
+}
+
+/**
+ * @fn formatMetrics()
+ * @brief Sum the statistics of all workers and write them in the Prometheus text format
+ * @param text Destination
+ * @param size Size of the destination
+ * @return size_t length of the text
+ */
+size_t formatMetrics(char *text, size_t size) {
+	uint64_t counters[STAT_COUNTERS] = {0};
+	uint64_t rtt[STATS_RTT_BUCKETS + 1] = {0};
+	uint64_t rttSum = 0, pending = 0, tcpClients = 0;
+	uint64_t pool[3][POOL_CLASSES] = {{0}};
+	for (int i = 0; i < workerCount; i++) {
+		struct workerStats *stats = &workers[i].stats;
+		for (int j = 0; j < STAT_COUNTERS; j++) counters[j] += __atomic_load_n(&stats->counters[j], __ATOMIC_RELAXED);
+		for (int j = 0; j <= STATS_RTT_BUCKETS; j++) rtt[j] += __atomic_load_n(&stats->rtt[j], __ATOMIC_RELAXED);
+		rttSum += __atomic_load_n(&stats->rttSum, __ATOMIC_RELAXED);
+		pending += __atomic_load_n(&stats->pending, __ATOMIC_RELAXED);
+		tcpClients += __atomic_load_n(&stats->tcpClients, __ATOMIC_RELAXED);
+		for (int j = 0; j < POOL_CLASSES; j++) {
+			pool[0][j] += __atomic_load_n(&stats->poolBuffers[j], __ATOMIC_RELAXED);
+			pool[1][j] += __atomic_load_n(&stats->poolInUse[j], __ATOMIC_RELAXED);
+			pool[2][j] += __atomic_load_n(&stats->poolHighWater[j], __ATOMIC_RELAXED);
+		}
+	}
+	size_t length = 0;
+	for (int i = 0; i < STAT_COUNTERS; i++) {
+		appendText(text, size, &length, "# HELP %s %s\n# TYPE %s counter\n%s %" PRIu64 "\n", statNames[i][0],
+			statNames[i][1], statNames[i][0], statNames[i][0], counters[i]);
+	}
+	// buckets of the histogram are cumulative
+	appendText(text, size, &length, "# HELP dns_upstream_rtt_seconds Round trip time of the answers from the servers.\n"
+		"# TYPE dns_upstream_rtt_seconds histogram\n");
+	uint64_t total = 0;
+	for (int i = 0; i < STATS_RTT_BUCKETS; i++) {
+		total += rtt[i];
+		appendText(text, size, &length, "dns_upstream_rtt_seconds_bucket{le=\"%.7g\"} %" PRIu64 "\n",
+			(double)(UINT64_C(1) << (i + STATS_RTT_MIN_BITS)) / 1e6, total);
+	}
+	total += rtt[STATS_RTT_BUCKETS];
+	appendText(text, size, &length, "dns_upstream_rtt_seconds_bucket{le=\"+Inf\"} %" PRIu64 "\n"
+		"dns_upstream_rtt_seconds_sum %.6f\ndns_upstream_rtt_seconds_count %" PRIu64 "\n", total, rttSum / 1e6, total);
+	appendText(text, size, &length, "# HELP dns_pending_queries Queries waiting for the answer from the servers.\n"
+		"# TYPE dns_pending_queries gauge\ndns_pending_queries %" PRIu64 "\n", pending);
+	appendText(text, size, &length, "# HELP dns_tcp_clients Connected TCP clients.\n"
+		"# TYPE dns_tcp_clients gauge\ndns_tcp_clients %" PRIu64 "\n", tcpClients);
+	// high water mark is the sum of the marks of the workers
+	const char *poolMetrics[3][2] = {
+		{"dns_pool_buffers", "Packet buffers allocated by the pools of the workers."},
+		{"dns_pool_buffers_in_use", "Packet buffers used by pending queries, waiters and cached answers."},
+		{"dns_pool_buffers_high_water", "The most packet buffers used at once."}
+	};
+	for (int i = 0; i < 3; i++) {
+		appendText(text, size, &length, "# HELP %s %s\n# TYPE %s gauge\n", poolMetrics[i][0], poolMetrics[i][1],
+			poolMetrics[i][0]);
+		for (int j = 0; j < POOL_CLASSES; j++) {
+			appendText(text, size, &length, "%s{size=\"%u\"} %" PRIu64 "\n", poolMetrics[i][0], poolSizes[j], pool[i][j]);
+		}
+	}
+	return length;
+}
+
+/**
+ * @fn metricsThread()
+ * @brief Answer every HTTP request on the metrics socket by the current metrics (the path is not checked)
+ * @param arg Not used
+ * @return void* Never returns
+ */
+void *metricsThread(void *arg) {
+	(void)arg;
+	char text[METRICS_BUFFER_SIZE];
+	char header[128];
+	char request[1024];
+	while (1) {
+		int client = accept(metricsSocket, NULL, NULL);
+		if (client == -1) {
+			if (errno != EINTR) fprintf(stderr, "Could not accept metrics connection. Accept: %s\n", strerror(errno));
+			continue;
+		}
+		// slow client does not stop the thread for long
+		struct timeval timeout = {1, 0};
+		setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+		setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+		if (recv(client, request, sizeof(request), 0) > 0) {
+			size_t length = formatMetrics(text, sizeof(text));
+			int headerLength = snprintf(header, sizeof(header), "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+				"Content-Length: %zu\r\nConnection: close\r\n\r\n", length);
+			if (send(client, header, headerLength, MSG_NOSIGNAL) == headerLength) send(client, text, length, MSG_NOSIGNAL);
+		}
+		close(client);
+	}
+	return NULL;
+}
+
+/**
+ * @fn startMetrics()
+ * @brief Open the metrics socket and start the thread which serves it
+ * @return int 0 on success, 1 on error
+ */
+int startMetrics() {
+	metricsSocket = socket(AF_INET, SOCK_STREAM, 0);
+	if (metricsSocket == -1) {
+		fprintf(stderr, "Could not create a metrics socket.\n");
 		return EXIT_FAILURE;
 	}
-	if (!filterFileSelected) {
-		fprintf(stderr, "[-f] You have to input name of filter table.\n");
+	int enable = 1;
+	setsockopt(metricsSocket, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable));
+	if (bind(metricsSocket, (struct sockaddr *)&metricsAddress, sizeof(metricsAddress)) == -1) {
+		fprintf(stderr, "Could not bind a metrics socket. %s\n", strerror(errno));
+		return EXIT_FAILURE;
+	}
+	if (listen(metricsSocket, 16) == -1) {
+		fprintf(stderr, "Could not listen on a metrics socket. %s\n", strerror(errno));
+		return EXIT_FAILURE;
+	}
+	if (pthread_create(&metricsServer, NULL, metricsThread, NULL) != 0) {
+		fprintf(stderr, "Could not create metrics thread.\n");
 		return EXIT_FAILURE;
 	}
+	metricsStarted = true;
 	return EXIT_SUCCESS;
 }
 
-
 int main(int argc, char **argv) {
-	char serverName[20] = "";
 	int portNumber = 53;
 	if (argc < 2) {
 		printHelp();
 	}
+	selectNameFunctions();
+	//only compile the filter file
+	if (strcmp(argv[1], "--compile-filter") == 0) {
+		if (argc < 4) printHelp();
+		return compileFilter(&argv[2], argc - 3, argv[argc - 1]);
+	}
 	//check and process params
-	if (processArgs(argc, argv, serverName, &portNumber)) {
+	if (processArgs(argc, argv, &portNumber)) {
 		return EXIT_FAILURE;
 	}
-	//bind signals to end properly (cleaning sockets)
-	signal(SIGINT, clear);
-    signal(SIGQUIT, clear);
-    signal(SIGTERM, clear);
+	//termination signals and SIGHUP are blocked in all threads, main thread waits for termination and
+	//the reload thread for SIGHUP
+	sigset_t signals;
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGINT);
+	sigaddset(&signals, SIGQUIT);
+	sigaddset(&signals, SIGTERM);
+	sigaddset(&signals, SIGHUP);
+	pthread_sigmask(SIG_BLOCK, &signals, NULL);
+	sigdelset(&signals, SIGHUP);
 
-	//opening socket for client incoming questions and client answers
-	clientSocketDescritor = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
-	if (clientSocketDescritor == -1) {
-		fprintf(stderr, "Could not create a new client socket: %s\n", strerror(errno));
+	//all workers are ready before the reload thread starts
+	workers = aligned_alloc(64, workerCount * sizeof(struct worker));
+	if (!workers) {
+		fprintf(stderr, "Could not allocate workers. Not enough memory.\n");
 		return EXIT_FAILURE;
 	}
-	struct sockaddr_in clientListenAddress;
-	bzero(&clientListenAddress, sizeof(struct sockaddr_in));
-	clientListenAddress.sin_family = AF_INET;
-	clientListenAddress.sin_port = htons(portNumber);
-	clientListenAddress.sin_addr.s_addr = INADDR_ANY;
-	if (bind(clientSocketDescritor, (const struct sockaddr *) &clientListenAddress, sizeof(clientListenAddress)) == -1) {
-		fprintf(stderr, "Could not bind a client listen socket. %s\n", strerror(errno));
-		close(clientSocketDescritor);
-		return EXIT_FAILURE;
+	memset(workers, 0, workerCount * sizeof(struct worker));
+	// one table of buckets for all workers, a client is limited the same whichever worker gets its packets
+	if (clientRate || networkRate) {
+		rateBuckets = aligned_alloc(64, sizeof(struct rateLimiter));
+		if (!rateBuckets) {
+			fprintf(stderr, "Could not allocate rate limit buckets. Not enough memory.\n");
+			free(workers);
+			return EXIT_FAILURE;
+		}
+		memset(rateBuckets, 0, sizeof(struct rateLimiter));
 	}
-
-	//opening socket for server incoming questions and server answers
-	serverSocketDescritor = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
-	if (serverSocketDescritor == -1) {
-		fprintf(stderr, "Could not create a new server socket: %s\n", strerror(errno));
-		close(clientSocketDescritor);
-		return EXIT_FAILURE;
+	for (int i = 0; i < workerCount; i++) {
+		workers[i].index = i;
+		workers[i].clientSocket = -1;
+		workers[i].listenSocket = -1;
+		for (int j = 0; j < serverSocketCount; j++) workers[i].serverSockets[j] = -1;
 	}
-	struct sockaddr_in serverAddress;
-	bzero(&serverAddress, sizeof(struct sockaddr_in));
-	serverAddress.sin_family = AF_INET;
-	serverAddress.sin_port = htons(0);
-	serverAddress.sin_addr.s_addr = INADDR_ANY;
-	if (bind(serverSocketDescritor, (const struct sockaddr *) &serverAddress, sizeof(serverAddress)) == -1) {
-		fprintf(stderr, "Could not bind a server socket. %s\n", strerror(errno));
-		close(serverSocketDescritor);
-		close(clientSocketDescritor);
-		return EXIT_FAILURE;
+	for (int i = 0; i < workerCount; i++) {
+		if (initWorker(&workers[i], portNumber)) clear(EXIT_FAILURE);
 	}
-	//change the server address in order to send correct queries
-	serverAddress.sin_port = htons(53);
-	serverAddress.sin_addr.s_addr = inet_addr(serverName);
-
-	//create shared dns header
-	HEADER dnsHeader;
-	// shared dns response object (buffer and length)
-	resp = (struct response *)malloc(sizeof(struct response));
-	resp->buffer = malloc(BUFFER_SIZE);
-	//temp address to find out client port
-	struct sockaddr_in clientAddress;
-	socklen_t clientAddressLength = sizeof(clientAddress);
-	socklen_t serverAddressLength = sizeof(serverAddress);
-	// counting the port numbers and IDs in order to manage more request at the same time
-	unsigned short ports[32], ids[32], portsCounter = 0;
-	unsigned int addresses[32];
-	for(int i = 0; i<32;i++) {
-		ports[i] = 0; ids[i] = 0; addresses[i] = 0;
-	}
-
-	//create structure for poll
-	struct pollfd fds[2];
-	fds[0].fd = serverSocketDescritor;
-	fds[1].fd = clientSocketDescritor;
-	fds[0].events = POLL_IN;
-	fds[1].events = POLL_IN;
-
-	while(1) {
-		//first have to check both sockets for connection
-		if (poll(fds, 2, -1) == -1) {
-			fprintf(stderr, "Unable to poll descriptors. Poll: %s\n", strerror(errno));
-			clear();
-		}
-		//client question
-		if (fds[1].revents & POLLIN) {
-			resp->length = recvfrom(clientSocketDescritor, resp->buffer, BUFFER_SIZE, MSG_WAITALL, (struct sockaddr *) &clientAddress, &clientAddressLength);
-			if (resp->length < 0) {
-				fprintf(stderr, "Not able to receive packet. Recvfrom: %s\n", strerror(errno));
-				continue;
-			}
-			//get the DNS header
-			memcpy(&dnsHeader, resp->buffer, 12);
-			// check correct bits for query
-			bool badPacket = false;
-			if (dnsHeader.qr != 0 || dnsHeader.unused != 0 || dnsHeader.cd != 0 || dnsHeader.qdcount <= 0 || dnsHeader.ancount > 0) { 
-				badPacket = true;
-			}
-			//get data from dns packet
-			char name[512];
-			int type = 0, class = 0;
-			if (!badPacket) {
-				getDnsRequestData(resp->buffer, &name[0], &type, &class);
-			}
-			//this is bad dns packet (format error)
-			if (type <= 0 || class <= 0 || badPacket) {
-				printVerboseEntry(ntohl(clientAddress.sin_addr.s_addr), ntohs(clientAddress.sin_port), "format error", "unknown name", 
-					ntohl(clientAddress.sin_addr.s_addr), ntohs(clientAddress.sin_port), false);
-				fprintf(stderr, "Wrong query received, sending RCODE=1 (format error).\n"); 
-				//change the answer
-				dnsHeader.qr = 1; // response flag
-				dnsHeader.aa = 1; // authoritive answer
-				dnsHeader.ra = 1; // recursion available
-				dnsHeader.rcode = 1; // response code (FORMAT ERROR)
-				dnsHeader.ancount = 0; // number of answer queries
-				dnsHeader.nscount = 0; // number of authority entries
-				memcpy(resp->buffer, &dnsHeader, 12);
-				if (sendto(clientSocketDescritor, resp->buffer, resp->length, 0, (struct sockaddr *) &clientAddress, clientAddressLength) < 0) {
-					fprintf(stderr, "Error sending packet.\n");
-				}
-				continue;
-			}
-			// this is not implemented
-			if (type != 1 || class != 1) {
-				printVerboseEntry(ntohl(clientAddress.sin_addr.s_addr), ntohs(clientAddress.sin_port), "not implemented", name, 
-					ntohl(clientAddress.sin_addr.s_addr), ntohs(clientAddress.sin_port), false);
-				fprintf(stderr, "Function not implemented, sending RCODE=4 (not implemented error).\n"); 
-				//change the answer
-				dnsHeader.qr = 1; // response flag
-				dnsHeader.aa = 1; // authoritive answer
-				dnsHeader.ra = 1; // recursion available
-				dnsHeader.rcode = 4; // response code (NOT IMPLEMENTED)
-				dnsHeader.ancount = 0; // number of answer queries
-				dnsHeader.nscount = 0; // number of authority entries
-				memcpy(resp->buffer, &dnsHeader, 12);
-				if (sendto(clientSocketDescritor, resp->buffer, resp->length, 0, (struct sockaddr *) &clientAddress, clientAddressLength) < 0) {
-					fprintf(stderr, "Error sending packet.\n");
-				}
-				continue;
-			}
-			//check blacklist
-			if (isBlacklisted(name)) {
-				printVerboseEntry(ntohl(clientAddress.sin_addr.s_addr), ntohs(clientAddress.sin_port), "blacklisted", name, 
-					ntohl(clientAddress.sin_addr.s_addr), ntohs(clientAddress.sin_port), false);
-				//change the answer
-				dnsHeader.qr = 1; // response flag
-				dnsHeader.aa = 1; // authoritive answer
-				dnsHeader.ra = 1; // recursion available
-				dnsHeader.rcode = 5; // response code (REFUSED)
-				dnsHeader.ancount = 0; // number of answer queries
-				dnsHeader.nscount = 0; // number of authority entries
-				memcpy(resp->buffer, &dnsHeader, 12);
-				if (sendto(clientSocketDescritor, resp->buffer, resp->length, 0, (struct sockaddr *) &clientAddress, clientAddressLength) < 0) {
-					fprintf(stderr, "Error sending packet.\n");
-				}
-				continue;
-			}
-			//save port and id
-			ports[portsCounter] = clientAddress.sin_port;
-			ids[portsCounter] = ntohs(dnsHeader.id);
-			addresses[portsCounter] = clientAddress.sin_addr.s_addr;
-			//roll and again to first element
-			portsCounter++;
-			if (portsCounter == 31) portsCounter = 0;
-			printVerboseEntry(ntohl(clientAddress.sin_addr.s_addr), ntohs(clientAddress.sin_port), "query", name, 
-					ntohl(serverAddress.sin_addr.s_addr), ntohs(serverAddress.sin_port), false);
-			if (sendto(serverSocketDescritor, resp->buffer, resp->length, 0, (struct sockaddr *) &serverAddress, serverAddressLength) < 0) {
-					fprintf(stderr, "Error sending packet.\n");
-			}
+	if (pthread_create(&reloader, NULL, reloadThread, NULL) != 0) {
+		fprintf(stderr, "Could not create filter reload thread.\n");
+		clear(EXIT_FAILURE);
+	}
+	reloaderStarted = true;
+	if (metricsEnabled && startMetrics()) clear(EXIT_FAILURE);
+	if (queryLogEnabled()) {
+		if (pthread_create(&logger, NULL, logThread, NULL) != 0) {
+			fprintf(stderr, "Could not create query log thread.\n");
+			clear(EXIT_FAILURE);
 		}
-		//server answer
-		if (fds[0].revents & POLLIN) {
-			//temp address to find out if its good answer
-			struct sockaddr_in tmpAddress;
-			bzero(&tmpAddress, sizeof(struct sockaddr_in));
-			socklen_t tmpLen = sizeof(struct sockaddr_in);
-			resp->length = recvfrom(serverSocketDescritor, resp->buffer, BUFFER_SIZE, MSG_WAITALL, (struct sockaddr *) &tmpAddress, &tmpLen);
-			if (resp->length < 0) {
-				fprintf(stderr, "Not able to receive packet. Recvfrom: %s\n", strerror(errno));
-				continue;
-			}
-			//check the ip and port
-			if (tmpAddress.sin_port != serverAddress.sin_port || tmpAddress.sin_addr.s_addr != serverAddress.sin_addr.s_addr) {
-				fprintf(stderr, "Answer from unexpected source.\n");
-			}
-			memcpy(&dnsHeader, resp->buffer, 12);
-			// get name (for verbose only)
-			char tmpName[512];
-			getDnsRequestData(resp->buffer, &tmpName[0], NULL, NULL);
-			//check which port and address to send it (according to ID)
-			for(int i = 0; i < 32; i++) {
-				if (ids[i] == ntohs(dnsHeader.id)) {
-					clientAddress.sin_port = ports[i];
-					clientAddress.sin_addr.s_addr = addresses[i];
-					printVerboseEntry(ntohl(tmpAddress.sin_addr.s_addr), ntohs(tmpAddress.sin_port), "answer", tmpName, 
-						ntohl(clientAddress.sin_addr.s_addr), ntohs(clientAddress.sin_port), true);
-					sendto(clientSocketDescritor, resp->buffer, resp->length, 0, (struct sockaddr *) &clientAddress, clientAddressLength);
-					break;
-				}
-			}
-			// if ID is not found -> throw it away
+		loggerStarted = true;
+	}
+	for (int i = 0; i < workerCount; i++) {
+		if (pthread_create(&workers[i].thread, NULL, workerLoop, &workers[i]) != 0) {
+			fprintf(stderr, "Could not create worker thread.\n");
+			clear(EXIT_FAILURE);
 		}
+		workers[i].started = true;
 	}
+	//wait for termination signal to end properly (cleaning sockets)
+	int signalNumber;
+	while (sigwait(&signals, &signalNumber) != 0);
+	clear(EXIT_SUCCESS);
 	return 0;
-}
\ No newline at end of file
+}
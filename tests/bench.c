@@ -0,0 +1,703 @@
+/**
+    @file   bench.c
+    @author Daniel Pátek (xpatek08)
+    @brief  Load generator for the DNS resolver and the mock server used as its upstream
+*/
+
+// recvmmsg(), sendmmsg()
+#define _GNU_SOURCE
+// standart C stuff
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <errno.h>
+#include <time.h>
+// network stuff
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+// maximal size of the sent or received packet
+#define PACKET_SIZE 4096
+// number of packets received or sent by one recvmmsg()/sendmmsg() call of the mock server
+#define MOCK_BATCH 64
+// TTL of the answers of the mock server
+#define MOCK_TTL 300
+// time after which the query without answer is lost (ns)
+#define QUERY_TIMEOUT 2000000000ull
+// how often the lost queries are searched (ns)
+#define TIMEOUT_CHECK 100000000ull
+// domain under which the generated names are
+#define BENCH_DOMAIN "bench.test"
+
+// kinds of the generated queries
+enum queryKind {
+	QUERY_HIT,
+	QUERY_MISS,
+	QUERY_BLOCKED,
+	QUERY_MALFORMED,
+	QUERY_KINDS
+};
+
+const char *kindNames[QUERY_KINDS] = {"cache hit", "cache miss", "blocked", "malformed"};
+
+const char *rcodeNames[16] = {"NOERROR", "FORMERR", "SERVFAIL", "NXDOMAIN", "NOTIMP", "REFUSED", "YXDOMAIN", "YXRRSET",
+	"NXRRSET", "NOTAUTH", "NOTZONE", "RCODE11", "RCODE12", "RCODE13", "RCODE14", "RCODE15"};
+
+// one socket with at most one query in flight ->socket ->busy ->id ->kind ->sent
+struct slot {
+	int socket;
+	bool busy;
+	uint16_t id;
+	enum queryKind kind;
+	uint64_t sent;
+};
+
+// latencies of the answered queries of one kind (ns) ->values ->count ->allocated
+struct samples {
+	uint32_t *values;
+	size_t count;
+	size_t allocated;
+};
+
+// options
+struct sockaddr_in server;
+char *filterFileName = "tests/big_filter";
+unsigned qps = 10000;
+unsigned concurrency = 64;
+unsigned duration = 10;
+unsigned blockedPercent = 20;
+unsigned missPercent = 10;
+unsigned malformedPercent = 1;
+unsigned hitNames = 1000;
+int mockPort = -1;
+
+// blocked names from the filter file
+char **blockedNames = NULL;
+size_t blockedCount = 0;
+
+uint64_t randomState = 88172645463325252ull;
+
+/**
+ * @fn getTime()
+ * @brief Get monotonic time
+ * @return uint64_t time in ns
+ */
+uint64_t getTime() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+/**
+ * @fn nextRandom()
+ * @brief Xorshift generator, the quality is enough for the choice of queries
+ * @return uint64_t random number
+ */
+uint64_t nextRandom() {
+	randomState ^= randomState << 13;
+	randomState ^= randomState >> 7;
+	randomState ^= randomState << 17;
+	return randomState;
+}
+
+/**
+ * @fn questionEnd()
+ * @brief Find the end of the question of the query received by the mock server
+ * @param packet Received packet
+ * @param length Length of the packet
+ * @return int offset after the question, -1 if the question is not valid
+ */
+int questionEnd(const unsigned char *packet, int length) {
+	int offset = 12;
+	while (offset < length && packet[offset] != 0) {
+		if (packet[offset] > 63) return -1;
+		offset += packet[offset] + 1;
+	}
+	offset += 5;
+	return offset <= length ? offset : -1;
+}
+
+/**
+ * @fn mockAnswer()
+ * @brief Make the answer of the mock server, every question gets one A record (and OPT when the query has one)
+ * @param query Received query
+ * @param length Length of the query
+ * @param answer Destination of the answer (PACKET_SIZE bytes)
+ * @return int length of the answer, 0 if the query is dropped
+ */
+int mockAnswer(const unsigned char *query, int length, unsigned char *answer) {
+	if (length < 12 || (query[2] & 0x80) || query[4] != 0 || query[5] != 1) return 0;
+	int end = questionEnd(query, length);
+	if (end < 0) return 0;
+	bool opt = end + 11 <= length && query[end] == 0 && query[end + 1] == 0 && query[end + 2] == 41;
+	//header, the question is copied
+	memcpy(answer, query, end);
+	answer[2] = 0x80 | (query[2] & 0x01);
+	answer[3] = 0x80;
+	answer[6] = 0;
+	answer[7] = 1;
+	answer[8] = answer[9] = answer[10] = 0;
+	answer[11] = opt ? 1 : 0;
+	//address is given by the name so that the answers differ
+	uint32_t hash = 2166136261u;
+	for (int i = 12; i < end; i++) hash = (hash ^ query[i]) * 16777619u;
+	unsigned char record[16] = {0xc0, 0x0c, 0, 1, 0, 1, MOCK_TTL >> 24, (MOCK_TTL >> 16) & 0xff, (MOCK_TTL >> 8) & 0xff,
+		MOCK_TTL & 0xff, 0, 4, 10, hash >> 16, hash >> 8, hash};
+	memcpy(answer + end, record, sizeof(record));
+	int answerLength = end + sizeof(record);
+	if (opt) {
+		unsigned char optRecord[11] = {0, 0, 41, PACKET_SIZE >> 8, PACKET_SIZE & 0xff, 0, 0, 0, 0, 0, 0};
+		memcpy(answer + answerLength, optRecord, sizeof(optRecord));
+		answerLength += sizeof(optRecord);
+	}
+	return answerLength;
+}
+
+/**
+ * @fn runMock()
+ * @brief Answer the queries on 127.0.0.1:mockPort until killed
+ * @return int EXIT_FAILURE if the socket can not be made
+ */
+int runMock() {
+	int sock = socket(AF_INET, SOCK_DGRAM, 0);
+	struct sockaddr_in address;
+	bzero(&address, sizeof(address));
+	address.sin_family = AF_INET;
+	address.sin_port = htons(mockPort);
+	address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (sock < 0 || bind(sock, (struct sockaddr *)&address, sizeof(address)) < 0) {
+		fprintf(stderr, "Mock server can not bind to port %d: %s\n", mockPort, strerror(errno));
+		return EXIT_FAILURE;
+	}
+	static unsigned char queries[MOCK_BATCH][PACKET_SIZE];
+	static unsigned char answers[MOCK_BATCH][PACKET_SIZE];
+	struct sockaddr_in addresses[MOCK_BATCH];
+	struct mmsghdr in[MOCK_BATCH], out[MOCK_BATCH];
+	struct iovec inIov[MOCK_BATCH], outIov[MOCK_BATCH];
+	while (true) {
+		for (int i = 0; i < MOCK_BATCH; i++) {
+			inIov[i].iov_base = queries[i];
+			inIov[i].iov_len = PACKET_SIZE;
+			bzero(&in[i].msg_hdr, sizeof(struct msghdr));
+			in[i].msg_hdr.msg_iov = &inIov[i];
+			in[i].msg_hdr.msg_iovlen = 1;
+			in[i].msg_hdr.msg_name = &addresses[i];
+			in[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+		}
+		int received = recvmmsg(sock, in, MOCK_BATCH, MSG_WAITFORONE, NULL);
+		if (received < 0) {
+			if (errno == EINTR) continue;
+			fprintf(stderr, "Mock server can not receive: %s\n", strerror(errno));
+			return EXIT_FAILURE;
+		}
+		int count = 0;
+		for (int i = 0; i < received; i++) {
+			int length = mockAnswer(queries[i], in[i].msg_len, answers[count]);
+			if (length == 0) continue;
+			outIov[count].iov_base = answers[count];
+			outIov[count].iov_len = length;
+			bzero(&out[count].msg_hdr, sizeof(struct msghdr));
+			out[count].msg_hdr.msg_iov = &outIov[count];
+			out[count].msg_hdr.msg_iovlen = 1;
+			out[count].msg_hdr.msg_name = &addresses[i];
+			out[count].msg_hdr.msg_namelen = in[i].msg_hdr.msg_namelen;
+			count++;
+		}
+		for (int sent = 0; sent < count;) {
+			int result = sendmmsg(sock, out + sent, count - sent, 0);
+			if (result < 0) {
+				if (errno == EINTR) continue;
+				//answer which can not be sent is lost, the client sees it as a timeout
+				sent++;
+			} else {
+				sent += result;
+			}
+		}
+	}
+}
+
+/**
+ * @fn loadBlockedNames()
+ * @brief Read the names of the filter file (lines of comments and blank lines are skipped)
+ * @return int EXIT_SUCCESS or EXIT_FAILURE when there is no name
+ */
+int loadBlockedNames() {
+	FILE *file = fopen(filterFileName, "r");
+	if (file == NULL) {
+		fprintf(stderr, "[-f] Filter file %s can not be opened: %s\n", filterFileName, strerror(errno));
+		return EXIT_FAILURE;
+	}
+	char line[512];
+	size_t allocated = 0;
+	while (fgets(line, sizeof(line), file)) {
+		char *name = line + strspn(line, " \t");
+		name[strcspn(name, " \t\r\n#")] = '\0';
+		if (name[0] == '\0' || strlen(name) > 253) continue;
+		if (blockedCount == allocated) {
+			allocated = allocated ? allocated * 2 : 1024;
+			blockedNames = realloc(blockedNames, allocated * sizeof(char *));
+			if (blockedNames == NULL) {
+				fprintf(stderr, "Memory allocation failed.\n");
+				exit(EXIT_FAILURE);
+			}
+		}
+		blockedNames[blockedCount++] = strdup(name);
+	}
+	fclose(file);
+	if (blockedCount == 0) {
+		fprintf(stderr, "[-f] Filter file %s has no names.\n", filterFileName);
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
+
+/**
+ * @fn buildQuery()
+ * @brief Make the A query with recursion desired
+ * @param buffer Destination of the query (PACKET_SIZE bytes)
+ * @param id ID of the query
+ * @param name Queried name
+ * @return int length of the query
+ */
+int buildQuery(unsigned char *buffer, uint16_t id, const char *name) {
+	bzero(buffer, 12);
+	buffer[0] = id >> 8;
+	buffer[1] = id;
+	buffer[2] = 0x01;
+	buffer[5] = 1;
+	int offset = 12;
+	while (*name) {
+		size_t label = strcspn(name, ".");
+		if (label > 63) label = 63;
+		buffer[offset++] = label;
+		memcpy(buffer + offset, name, label);
+		offset += label;
+		name += label;
+		if (*name == '.') name++;
+	}
+	buffer[offset++] = 0;
+	unsigned char question[4] = {0, 1, 0, 1};
+	memcpy(buffer + offset, question, sizeof(question));
+	return offset + sizeof(question);
+}
+
+/**
+ * @fn buildMalformed()
+ * @brief Make the query which the resolver answers by FORMERR, the kinds of the error take turns
+ * @param buffer Destination of the query (PACKET_SIZE bytes)
+ * @param id ID of the query
+ * @param variant Number of the query (chooses the kind of the error)
+ * @return int length of the query
+ */
+int buildMalformed(unsigned char *buffer, uint16_t id, uint64_t variant) {
+	int length = buildQuery(buffer, id, "malformed." BENCH_DOMAIN);
+	switch (variant % 3) {
+	case 0:
+		//label is longer than the rest of the packet
+		buffer[12] = 60;
+		return 12 + 20;
+	case 1:
+		//query with an answer record
+		buffer[7] = 1;
+		return length;
+	default:
+		//question is cut in the middle of the type
+		return length - 3;
+	}
+}
+
+/**
+ * @fn parseServer()
+ * @brief Get the address of the tested resolver from <ip>:<port>
+ * @param text Address from the command line
+ * @return int EXIT_SUCCESS or EXIT_FAILURE
+ */
+int parseServer(const char *text) {
+	char host[INET_ADDRSTRLEN];
+	const char *colon = strrchr(text, ':');
+	size_t hostLength = colon ? (size_t)(colon - text) : 0;
+	char *ptr = NULL;
+	long port = colon ? strtol(colon + 1, &ptr, 10) : 0;
+	if (hostLength == 0 || hostLength >= sizeof(host) || *ptr != '\0' || ptr == colon + 1 || port < 1 || port > 65535) {
+		fprintf(stderr, "[-s] Server has to be <ip>:<port>.\n");
+		return EXIT_FAILURE;
+	}
+	memcpy(host, text, hostLength);
+	host[hostLength] = '\0';
+	bzero(&server, sizeof(server));
+	server.sin_family = AF_INET;
+	server.sin_port = htons(port);
+	if (inet_pton(AF_INET, host, &server.sin_addr) != 1) {
+		fprintf(stderr, "[-s] Server has to be <ip>:<port>.\n");
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
+
+/**
+ * @fn parseNumber()
+ * @brief Get the number of the option
+ * @param option Letter of the option
+ * @param text Value from the command line
+ * @param max Maximal value
+ * @param value Destination of the number
+ * @return int EXIT_SUCCESS or EXIT_FAILURE
+ */
+int parseNumber(char option, const char *text, unsigned long max, unsigned *value) {
+	char *ptr = NULL;
+	unsigned long number = strtoul(text, &ptr, 10);
+	if (*ptr != '\0' || ptr == text || number > max || text[0] == '-') {
+		fprintf(stderr, "[-%c] Value has to be integer from 0 to %lu.\n", option, max);
+		return EXIT_FAILURE;
+	}
+	*value = number;
+	return EXIT_SUCCESS;
+}
+
+/**
+ * @fn printHelp()
+ * @brief Prints help on stdout and exit the program
+ */
+void printHelp() {
+	printf( "Usage: bench [options]\n"
+			"       bench -u <port>\n"
+			"		(mock server on 127.0.0.1 answering every question by one A record)\n"
+			"	[-s <ip>:<port>]\n"
+			"		(tested resolver, default 127.0.0.1:5300)\n"
+			"	[-f <file>]\n"
+			"		(filter file of the resolver, its names are the blocked queries, default tests/big_filter)\n"
+			"	[-q <qps>]\n"
+			"		(sent queries per second, 0 sends as fast as the answers come, default 10000)\n"
+			"	[-c <count>]\n"
+			"		(queries in flight at most, default 64)\n"
+			"	[-d <seconds>]\n"
+			"		(duration of the test, default 10)\n"
+			"	[-b <percent>] [-m <percent>] [-e <percent>]\n"
+			"		(share of blocked, cache miss and malformed queries, default 20, 10 and 1, the rest are cache hits)\n"
+			"	[-n <count>]\n"
+			"		(number of names answered from the cache, default 1000)\n"
+			"	[-h]\n"
+			"		(print help and exit)\n");
+	exit(EXIT_FAILURE);
+}
+
+/**
+ * @fn processArgs()
+ * @brief Process the arguments of the program
+ * @param argc Number of arguments
+ * @param argv Arguments
+ * @return int EXIT_SUCCESS or EXIT_FAILURE
+ */
+int processArgs(int argc, char **argv) {
+	if (parseServer("127.0.0.1:5300")) return EXIT_FAILURE;
+	int option;
+	unsigned port;
+	while ((option = getopt(argc, argv, "s:f:q:c:d:b:m:e:n:u:h")) != -1) {
+		switch (option) {
+		case 's':
+			if (parseServer(optarg)) return EXIT_FAILURE;
+			break;
+		case 'f':
+			filterFileName = optarg;
+			break;
+		case 'q':
+			if (parseNumber(option, optarg, 10000000, &qps)) return EXIT_FAILURE;
+			break;
+		case 'c':
+			if (parseNumber(option, optarg, 65536, &concurrency)) return EXIT_FAILURE;
+			if (concurrency == 0) {
+				fprintf(stderr, "[-c] At least one query has to be in flight.\n");
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'd':
+			if (parseNumber(option, optarg, 86400, &duration)) return EXIT_FAILURE;
+			break;
+		case 'b':
+			if (parseNumber(option, optarg, 100, &blockedPercent)) return EXIT_FAILURE;
+			break;
+		case 'm':
+			if (parseNumber(option, optarg, 100, &missPercent)) return EXIT_FAILURE;
+			break;
+		case 'e':
+			if (parseNumber(option, optarg, 100, &malformedPercent)) return EXIT_FAILURE;
+			break;
+		case 'n':
+			if (parseNumber(option, optarg, 10000000, &hitNames)) return EXIT_FAILURE;
+			break;
+		case 'u':
+			if (parseNumber(option, optarg, 65535, &port)) return EXIT_FAILURE;
+			mockPort = port;
+			break;
+		default:
+			printHelp();
+		}
+	}
+	if (optind < argc) printHelp();
+	if (blockedPercent + missPercent + malformedPercent > 100) {
+		fprintf(stderr, "Shares of blocked, cache miss and malformed queries are more than 100 %%.\n");
+		return EXIT_FAILURE;
+	}
+	if (hitNames == 0 && blockedPercent + missPercent + malformedPercent < 100) {
+		fprintf(stderr, "[-n] Cache hits need at least one name.\n");
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
+
+/**
+ * @fn addSample()
+ * @brief Save the latency of the answered query
+ * @param samples Latencies of the kind of the query
+ * @param latency Latency (ns)
+ */
+void addSample(struct samples *samples, uint64_t latency) {
+	if (samples->count == samples->allocated) {
+		samples->allocated = samples->allocated ? samples->allocated * 2 : 65536;
+		samples->values = realloc(samples->values, samples->allocated * sizeof(uint32_t));
+		if (samples->values == NULL) {
+			fprintf(stderr, "Memory allocation failed.\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+	samples->values[samples->count++] = latency > UINT32_MAX ? UINT32_MAX : latency;
+}
+
+int compareSamples(const void *a, const void *b) {
+	uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+	return (x > y) - (x < y);
+}
+
+/**
+ * @fn percentile()
+ * @brief Get the percentile of the sorted latencies
+ * @param samples Sorted latencies
+ * @param fraction Wanted percentile (0.5 is the median)
+ * @return double latency in us
+ */
+double percentile(const struct samples *samples, double fraction) {
+	if (samples->count == 0) return 0;
+	size_t index = (size_t)(fraction * samples->count);
+	if (index >= samples->count) index = samples->count - 1;
+	return samples->values[index] / 1000.0;
+}
+
+/**
+ * @fn printLatency()
+ * @brief Print one line of the table of latencies
+ * @param name Name of the line
+ * @param samples Latencies (they are sorted)
+ */
+void printLatency(const char *name, struct samples *samples) {
+	qsort(samples->values, samples->count, sizeof(uint32_t), compareSamples);
+	printf("%-12s %10zu %10.1f %10.1f %10.1f %10.1f\n", name, samples->count, percentile(samples, 0.5), percentile(samples, 0.99),
+		percentile(samples, 0.999), samples->count ? samples->values[samples->count - 1] / 1000.0 : 0);
+}
+
+/**
+ * @fn openSlots()
+ * @brief Make the connected non blocking socket for every query in flight
+ * @param slots Array of the concurrency slots
+ * @param epoll Epoll instance watching the sockets
+ * @return int EXIT_SUCCESS or EXIT_FAILURE
+ */
+int openSlots(struct slot *slots, int epoll) {
+	for (unsigned i = 0; i < concurrency; i++) {
+		slots[i].socket = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+		slots[i].busy = false;
+		if (slots[i].socket < 0 || connect(slots[i].socket, (struct sockaddr *)&server, sizeof(server)) < 0) {
+			fprintf(stderr, "Socket for the queries can not be made: %s\n", strerror(errno));
+			return EXIT_FAILURE;
+		}
+		struct epoll_event event = {.events = EPOLLIN, .data.u32 = i};
+		if (epoll_ctl(epoll, EPOLL_CTL_ADD, slots[i].socket, &event) < 0) {
+			fprintf(stderr, "Socket can not be watched: %s\n", strerror(errno));
+			return EXIT_FAILURE;
+		}
+	}
+	return EXIT_SUCCESS;
+}
+
+/**
+ * @fn warmCache()
+ * @brief Ask for every cache hit name once so that the measured queries are answered from the cache
+ * @param slot Slot whose socket is used
+ * @return int EXIT_SUCCESS or EXIT_FAILURE when the resolver does not answer
+ */
+int warmCache(struct slot *slot) {
+	unsigned char buffer[PACKET_SIZE];
+	char name[64];
+	for (unsigned i = 0; i < hitNames; i++) {
+		snprintf(name, sizeof(name), "hit%u." BENCH_DOMAIN, i);
+		uint16_t id = nextRandom();
+		int length = buildQuery(buffer, id, name);
+		bool answered = false;
+		for (int attempt = 0; attempt < 3 && !answered; attempt++) {
+			send(slot->socket, buffer, length, 0);
+			uint64_t deadline = getTime() + QUERY_TIMEOUT / 4;
+			while (!answered && getTime() < deadline) {
+				unsigned char answer[PACKET_SIZE];
+				ssize_t received = recv(slot->socket, answer, sizeof(answer), 0);
+				if (received >= 12 && answer[0] == (id >> 8) && answer[1] == (id & 0xff)) answered = true;
+				else if (received < 0) usleep(50);
+			}
+		}
+		if (!answered) {
+			fprintf(stderr, "Resolver does not answer %s.\n", name);
+			return EXIT_FAILURE;
+		}
+	}
+	return EXIT_SUCCESS;
+}
+
+/**
+ * @fn sendQuery()
+ * @brief Send the next query of the mix by the free slot
+ * @param slot Free slot
+ * @param missCounter Number of the sent cache miss queries (the names never repeat)
+ * @param runId Part of the cache miss names which differs between the runs
+ * @return bool true if the query was sent
+ */
+bool sendQuery(struct slot *slot, uint64_t *missCounter, unsigned runId) {
+	unsigned char buffer[PACKET_SIZE];
+	char name[300];
+	uint64_t choice = nextRandom();
+	unsigned percent = choice % 100;
+	uint16_t id = choice >> 32;
+	int length;
+	if (percent < malformedPercent) {
+		slot->kind = QUERY_MALFORMED;
+		length = buildMalformed(buffer, id, choice >> 48);
+	} else if (percent < malformedPercent + blockedPercent) {
+		slot->kind = QUERY_BLOCKED;
+		length = buildQuery(buffer, id, blockedNames[(choice >> 8) % blockedCount]);
+	} else if (percent < malformedPercent + blockedPercent + missPercent) {
+		slot->kind = QUERY_MISS;
+		snprintf(name, sizeof(name), "miss%llu-%u." BENCH_DOMAIN, (unsigned long long)(*missCounter)++, runId);
+		length = buildQuery(buffer, id, name);
+	} else {
+		slot->kind = QUERY_HIT;
+		snprintf(name, sizeof(name), "hit%u." BENCH_DOMAIN, (unsigned)((choice >> 8) % hitNames));
+		length = buildQuery(buffer, id, name);
+	}
+	slot->sent = getTime();
+	if (send(slot->socket, buffer, length, 0) != length) return false;
+	slot->id = id;
+	slot->busy = true;
+	return true;
+}
+
+/**
+ * @fn main()
+ * @brief Send the query mix for the given time and print throughput and latency percentiles
+ */
+int main(int argc, char **argv) {
+	if (processArgs(argc, argv)) return EXIT_FAILURE;
+	if (mockPort >= 0) return runMock();
+	if (loadBlockedNames()) return EXIT_FAILURE;
+	randomState ^= getTime() * 0x9e3779b97f4a7c15ull;
+	unsigned runId = getpid() ^ (unsigned)time(NULL);
+	int epoll = epoll_create1(0);
+	struct slot *slots = calloc(concurrency, sizeof(struct slot));
+	unsigned *freeSlots = malloc(concurrency * sizeof(unsigned));
+	struct epoll_event *events = malloc((concurrency + 1) * sizeof(struct epoll_event));
+	if (epoll < 0 || slots == NULL || freeSlots == NULL || events == NULL) {
+		fprintf(stderr, "Memory allocation failed.\n");
+		return EXIT_FAILURE;
+	}
+	int timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+	struct epoll_event timerEvent = {.events = EPOLLIN, .data.u32 = concurrency};
+	if (timer < 0 || epoll_ctl(epoll, EPOLL_CTL_ADD, timer, &timerEvent) < 0) {
+		fprintf(stderr, "Timer can not be made: %s\n", strerror(errno));
+		return EXIT_FAILURE;
+	}
+	if (openSlots(slots, epoll) || warmCache(&slots[0])) return EXIT_FAILURE;
+	unsigned freeCount = 0;
+	for (unsigned i = concurrency; i > 0; i--) freeSlots[freeCount++] = i - 1;
+
+	struct samples samples[QUERY_KINDS + 1];
+	bzero(samples, sizeof(samples));
+	uint64_t sent[QUERY_KINDS] = {0}, lost[QUERY_KINDS] = {0}, rcodes[16] = {0};
+	uint64_t missCounter = 0, sendErrors = 0;
+	uint64_t interval = qps ? 1000000000ull / qps : 0;
+	uint64_t start = getTime(), end = start + duration * 1000000000ull;
+	uint64_t nextSend = start, nextCheck = start + TIMEOUT_CHECK, now = start;
+	while (now < end || freeCount < concurrency) {
+		//send the queries which are due
+		while (now < end && freeCount > 0 && nextSend <= now) {
+			struct slot *slot = &slots[freeSlots[freeCount - 1]];
+			if (sendQuery(slot, &missCounter, runId)) {
+				freeCount--;
+				sent[slot->kind]++;
+			} else {
+				sendErrors++;
+			}
+			//the queries which could not be sent in time because of the concurrency are skipped
+			nextSend = interval ? (nextSend + interval < now ? now : nextSend + interval) : now;
+		}
+		//the timer wakes up the loop at the time of the next query (the rate is kept without busy waiting)
+		if (now < end && freeCount > 0 && nextSend > now) {
+			struct itimerspec due = {.it_value = {.tv_sec = nextSend / 1000000000ull, .tv_nsec = nextSend % 1000000000ull}};
+			timerfd_settime(timer, TFD_TIMER_ABSTIME, &due, NULL);
+		}
+		int count = epoll_wait(epoll, events, concurrency + 1, TIMEOUT_CHECK / 1000000);
+		now = getTime();
+		for (int i = 0; i < count; i++) {
+			if (events[i].data.u32 == concurrency) {
+				uint64_t expirations;
+				if (read(timer, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN) return EXIT_FAILURE;
+				continue;
+			}
+			struct slot *slot = &slots[events[i].data.u32];
+			unsigned char answer[PACKET_SIZE];
+			ssize_t received;
+			while ((received = recv(slot->socket, answer, sizeof(answer), 0)) >= 0) {
+				//late answer to the lost query is ignored
+				if (!slot->busy || received < 12 || answer[0] != (slot->id >> 8) || answer[1] != (slot->id & 0xff)) continue;
+				addSample(&samples[slot->kind], now - slot->sent);
+				rcodes[answer[3] & 0x0f]++;
+				slot->busy = false;
+				freeSlots[freeCount++] = events[i].data.u32;
+			}
+		}
+		//queries without the answer are lost
+		if (now >= nextCheck) {
+			for (unsigned i = 0; i < concurrency; i++) {
+				if (slots[i].busy && now - slots[i].sent > QUERY_TIMEOUT) {
+					lost[slots[i].kind]++;
+					slots[i].busy = false;
+					freeSlots[freeCount++] = i;
+				}
+			}
+			nextCheck = now + TIMEOUT_CHECK;
+		}
+	}
+
+	//report
+	double seconds = duration ? duration : 1;
+	uint64_t totalSent = 0, totalLost = 0;
+	for (int kind = 0; kind < QUERY_KINDS; kind++) {
+		totalSent += sent[kind];
+		totalLost += lost[kind];
+		for (size_t i = 0; i < samples[kind].count; i++) addSample(&samples[QUERY_KINDS], samples[kind].values[i]);
+	}
+	printf("sent %llu queries in %u s (%llu lost, %llu not sent), %u in flight at most\n", (unsigned long long)totalSent,
+		duration, (unsigned long long)totalLost, (unsigned long long)sendErrors, concurrency);
+	printf("throughput %.0f answers/s\n\n", samples[QUERY_KINDS].count / seconds);
+	printf("%-12s %10s %10s %10s %10s %10s\n", "latency us", "answers", "p50", "p99", "p999", "max");
+	for (int kind = 0; kind < QUERY_KINDS; kind++) printLatency(kindNames[kind], &samples[kind]);
+	printLatency("all", &samples[QUERY_KINDS]);
+	printf("\nrcodes");
+	for (int rcode = 0; rcode < 16; rcode++) {
+		if (rcodes[rcode]) printf(" %s %llu", rcodeNames[rcode], (unsigned long long)rcodes[rcode]);
+	}
+	printf("\n");
+	return EXIT_SUCCESS;
+}
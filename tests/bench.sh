@@ -0,0 +1,26 @@
+#!/bin/sh
+# load test of the resolver against the mock server, the parameters can be changed by the environment, e.g.
+# QPS=50000 CONCURRENCY=256 DURATION=30 make bench
+
+PORT=${PORT:-5300}
+MOCKPORT=${MOCKPORT:-5350}
+FILTER=${FILTER:-tests/big_filter}
+QPS=${QPS:-10000}
+CONCURRENCY=${CONCURRENCY:-64}
+DURATION=${DURATION:-10}
+BLOCKED=${BLOCKED:-20}
+MISS=${MISS:-10}
+MALFORMED=${MALFORMED:-1}
+
+printf "RUNNING MOCK SERVER \"./tests/bench -u $MOCKPORT\"\n"
+./tests/bench -u "$MOCKPORT" & mockpid=$!
+printf "RUNNING SERVER \"./tests/dns_bench -s 127.0.0.1:$MOCKPORT -f $FILTER -p $PORT $DNSFLAGS\"\n"
+./tests/dns_bench -s "127.0.0.1:$MOCKPORT" -f "$FILTER" -p "$PORT" $DNSFLAGS 2>/dev/null & pid=$!
+sleep 1
+
+printf "RUNNING \"./tests/bench -s 127.0.0.1:$PORT -f $FILTER -q $QPS -c $CONCURRENCY -d $DURATION -b $BLOCKED -m $MISS -e $MALFORMED\"\n\n"
+./tests/bench -s "127.0.0.1:$PORT" -f "$FILTER" -q "$QPS" -c "$CONCURRENCY" -d "$DURATION" -b "$BLOCKED" -m "$MISS" -e "$MALFORMED"
+result=$?
+
+kill $pid $mockpid
+exit $result
@@ -0,0 +1,379 @@
+/**
+    @file   filter_bench.c
+    @author Daniel Pátek (xpatek08)
+    @brief  Microbenchmark of loading and looking up the filter on generated filter lists, it is built together
+            with dns.c so that the measured functions are the ones of the server
+*/
+
+// main() of the server is not used
+#define main dnsMain
+#include "../dns.c"
+#undef main
+
+#include <sys/wait.h>
+
+// number of prepared queries of every workload, number of lookups of every measurement and its repetitions (the
+// fastest one is reported, the others were disturbed by the system)
+#define BENCH_KEYS 16384
+#define BENCH_LOOKUPS 1000000
+#define BENCH_REPEATS 3
+// list sizes measured without arguments
+const unsigned long defaultSizes[] = {10000, 100000, 1000000, 10000000};
+
+const char *topDomains[] = {"com", "net", "org", "de", "info", "ru", "io", "xyz"};
+const char *subdomains[] = {"ads", "cdn", "track", "www"};
+
+// query of the workload, one cache line (the key is made from it for every lookup as the server does, so the key
+// is hot and only the filter is spread over the memory) ->length ->packet
+struct benchQuery {
+	uint8_t length;
+	char packet[63];
+} __attribute__((aligned(64)));
+
+// blocked suffix hashes in open addressing table (node index, 0 is empty slot), the contender of the trie
+// ->slots ->mask
+struct hashFilter {
+	uint32_t *slots;
+	uint32_t mask;
+};
+
+/**
+ * @fn benchTime()
+ * @brief Get monotonic time
+ * @return double time in ns
+ */
+double benchTime() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1e9 + now.tv_nsec;
+}
+
+/**
+ * @fn statusValue()
+ * @brief Read the memory value of the process from /proc/self/status
+ * @param field Name of the field with the colon (VmRSS:, VmHWM:)
+ * @return size_t value in bytes, 0 when it is not known
+ */
+size_t statusValue(const char *field) {
+	FILE *file = fopen("/proc/self/status", "r");
+	if (!file) return 0;
+	char line[256];
+	size_t value = 0;
+	while (fgets(line, sizeof(line), file)) {
+		if (strncmp(line, field, strlen(field)) == 0) {
+			value = strtoull(line + strlen(field), NULL, 10) * 1024;
+			break;
+		}
+	}
+	fclose(file);
+	return value;
+}
+
+/**
+ * @fn mixIndex()
+ * @brief Bijective mix of the 32 bit number, different indexes give different names
+ * @param x Index
+ * @return uint32_t mixed index
+ */
+uint32_t mixIndex(uint32_t x) {
+	x ^= x >> 16;
+	x *= 0x7feb352du;
+	x ^= x >> 15;
+	x *= 0x846ca68bu;
+	x ^= x >> 16;
+	return x;
+}
+
+/**
+ * @fn generatedName()
+ * @brief Make the index-th generated name ([subdomain.]label.tld), label is 0 to 6 letters and the mixed index
+ * in 7 letters, so the names never repeat and none is a parent of other one
+ * @param index Index of the name
+ * @param name Destination, at least 64 bytes
+ * @return int length of the name
+ */
+int generatedName(uint32_t index, char *name) {
+	uint32_t mixed = mixIndex(index), extra = mixIndex(mixed ^ 0x9e3779b9u);
+	int length = 0;
+	if (extra % 4 == 0) length = sprintf(name, "%s.", subdomains[(extra >> 2) % 4]);
+	for (unsigned i = 0; i < (extra >> 4) % 7; i++) name[length++] = 'a' + (extra >> (8 + i * 3)) % 26;
+	for (int i = 0; i < 7; i++, mixed /= 26) name[length++] = 'a' + mixed % 26;
+	return length + sprintf(name + length, ".%s", topDomains[(extra >> 29) % 8]);
+}
+
+/**
+ * @fn writeFilterList()
+ * @brief Write the filter file with the first count generated names
+ * @param fileName Name of the file
+ * @param count Number of names
+ * @return int EXIT_SUCCESS or EXIT_FAILURE
+ */
+int writeFilterList(const char *fileName, unsigned long count) {
+	FILE *file = fopen(fileName, "w");
+	if (!file) {
+		fprintf(stderr, "Could not write the filter list %s: %s\n", fileName, strerror(errno));
+		return EXIT_FAILURE;
+	}
+	char name[64];
+	for (unsigned long i = 0; i < count; i++) {
+		int length = generatedName(i, name);
+		name[length++] = '\n';
+		fwrite(name, 1, length, file);
+	}
+	if (fclose(file) != 0) {
+		fprintf(stderr, "Could not write the filter list %s\n", fileName);
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
+
+/**
+ * @fn writeCompiledList()
+ * @brief Write the built blacklist as the compiled filter file
+ * @param fileName Name of the file
+ * @return int EXIT_SUCCESS or EXIT_FAILURE
+ */
+int writeCompiledList(const char *fileName) {
+	int fd = open(fileName, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	const char *data = (const char *)blacklist->header;
+	size_t done = 0;
+	while (fd != -1 && done < blacklist->header->totalSize) {
+		ssize_t length = write(fd, data + done, blacklist->header->totalSize - done);
+		if (length < 0) break;
+		done += length;
+	}
+	if (fd != -1) close(fd);
+	if (done < blacklist->header->totalSize) {
+		fprintf(stderr, "Could not write the compiled filter %s\n", fileName);
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
+
+/**
+ * @fn makeQuery()
+ * @brief Make the A query for the name
+ * @param name Name (dot notation)
+ * @param query Destination of the query
+ */
+void makeQuery(const char *name, struct benchQuery *query) {
+	char *packet = query->packet;
+	memset(packet, 0, sizeof(query->packet));
+	packet[5] = 1;
+	unsigned offset = 12;
+	while (*name) {
+		size_t label = strcspn(name, ".");
+		packet[offset++] = label;
+		memcpy(packet + offset, name, label);
+		offset += label;
+		name += label;
+		if (*name == '.') name++;
+	}
+	packet[offset++] = 0;
+	packet[offset + 1] = ns_t_a;
+	packet[offset + 3] = ns_c_in;
+	query->length = offset + 4;
+}
+
+/**
+ * @fn newHashFilter()
+ * @brief Put suffix hashes of all blocked nodes to the open addressing table (the generated lists have no allow rules)
+ * @param list Blacklist whose nodes are verified on a match
+ * @param filter Destination filter
+ * @return int EXIT_SUCCESS or EXIT_FAILURE
+ */
+int newHashFilter(const struct blacklist_s *list, struct hashFilter *filter) {
+	size_t tableSize = 2;
+	while (tableSize < 2 * list->header->size) tableSize *= 2;
+	filter->slots = calloc(tableSize, sizeof(uint32_t));
+	if (!filter->slots) return EXIT_FAILURE;
+	filter->mask = tableSize - 1;
+	for (uint32_t i = 1; i < list->header->nodeCount; i++) {
+		if (!(list->nodes[i].rules & (RULE_BLOCK_NAME | RULE_BLOCK_SUBDOMAINS))) continue;
+		uint32_t slot = list->nodes[i].hash & filter->mask;
+		while (filter->slots[slot] != 0) slot = (slot + 1) & filter->mask;
+		filter->slots[slot] = i;
+	}
+	return EXIT_SUCCESS;
+}
+
+/**
+ * @fn sameSuffix()
+ * @brief Compare the node and its parents with the suffix of the key
+ * @param list Blacklist
+ * @param node Index of the node
+ * @param key Folded name
+ * @param label Index of the first label of the suffix
+ * @return bool true when the names are the same
+ */
+bool sameSuffix(const struct blacklist_s *list, uint32_t node, const struct nameKey *key, unsigned label) {
+	for (; label < key->labelCount; label++, node = list->nodes[node].parent) {
+		const unsigned char *bytes = &key->bytes[key->labels[label]];
+		if (node == 0 || list->nodes[node].length != bytes[0]
+			|| memcmp(&list->pool[list->nodes[node].label], bytes + 1, bytes[0]) != 0) {
+			return false;
+		}
+	}
+	return node == 0;
+}
+
+/**
+ * @fn findHashed()
+ * @brief Probe every suffix of the name in the hash table (probes do not depend on each other)
+ * @param list Blacklist
+ * @param filter Hash table of the blocked nodes
+ * @param key Folded name with the suffix hashes
+ * @return int 1 if it is blacklisted, 0 if it in not blacklisted
+ */
+int findHashed(const struct blacklist_s *list, const struct hashFilter *filter, const struct nameKey *key) {
+	for (unsigned i = 0; i < key->labelCount; i++) __builtin_prefetch(&filter->slots[key->suffixHashes[i] & filter->mask]);
+	for (unsigned i = key->labelCount; i > 0; i--) {
+		uint32_t hash = key->suffixHashes[i - 1];
+		uint8_t rule = i == 1 ? RULE_BLOCK_NAME : RULE_BLOCK_SUBDOMAINS;
+		for (uint32_t slot = hash & filter->mask; filter->slots[slot] != 0; slot = (slot + 1) & filter->mask) {
+			uint32_t node = filter->slots[slot];
+			if (list->nodes[node].hash == hash && (list->nodes[node].rules & rule) && sameSuffix(list, node, key, i - 1)) return 1;
+		}
+	}
+	return 0;
+}
+
+/**
+ * @fn measureLookups()
+ * @brief Time the parsing, the key and the lookup of one variant of the filter, the result of every name is checked
+ * @param variant 0 only the key, 1 Bloom and trie (isBlacklisted()), 2 trie, 3 hash table, 4 Bloom and hash table
+ * @param filter Hash table of the blocked nodes
+ * @param queries Prepared queries
+ * @param expected Expected result of all names
+ * @return double ns per name
+ */
+double measureLookups(int variant, const struct hashFilter *filter, const struct benchQuery *queries, int expected) {
+	const struct blacklist_s *list = blacklist;
+	unsigned long wrong = 0;
+	struct dnsView view;
+	struct nameKey key;
+	double best = 0;
+	for (int repeat = 0; repeat < BENCH_REPEATS; repeat++) {
+		double start = benchTime();
+		for (unsigned long i = 0; i < BENCH_LOOKUPS; i++) {
+			const struct benchQuery *query = &queries[i % BENCH_KEYS];
+			parseDnsPacket(query->packet, query->length, &view);
+			makeNameKey(&view, &key);
+			int result;
+			switch (variant) {
+			case 0:
+				result = key.labelCount == 0;
+				break;
+			case 1:
+				result = isBlacklisted(&key);
+				break;
+			case 2:
+				result = findBlacklisted(list, &key);
+				break;
+			case 3:
+				result = findHashed(list, filter, &key);
+				break;
+			default:
+				result = mayBeBlacklisted(list, &key) && findHashed(list, filter, &key);
+			}
+			wrong += result != expected;
+		}
+		double elapsed = benchTime() - start;
+		if (repeat == 0 || elapsed < best) best = elapsed;
+	}
+	if (wrong && variant) fprintf(stderr, "Variant %d gave %lu wrong results.\n", variant, wrong);
+	return best / BENCH_LOOKUPS;
+}
+
+/**
+ * @fn benchSize()
+ * @brief Measure the list of the given size (runs in its own process, so the peak RSS belongs to this list)
+ * @param count Number of names of the list
+ * @return int EXIT_SUCCESS or EXIT_FAILURE
+ */
+int benchSize(unsigned long count) {
+	char textName[64], compiledName[64];
+	snprintf(textName, sizeof(textName), "/tmp/filter_bench_%d.txt", (int)getpid());
+	snprintf(compiledName, sizeof(compiledName), "/tmp/filter_bench_%d.bin", (int)getpid());
+	if (writeFilterList(textName, count)) return EXIT_FAILURE;
+	//the names of the workloads are ready before the filter is loaded
+	struct benchQuery *hits = aligned_alloc(64, BENCH_KEYS * sizeof(struct benchQuery));
+	struct benchQuery *misses = aligned_alloc(64, BENCH_KEYS * sizeof(struct benchQuery));
+	if (!hits || !misses) {
+		fprintf(stderr, "Could not allocate names. Not enough memory.\n");
+		return EXIT_FAILURE;
+	}
+	char name[128];
+	for (unsigned i = 0; i < BENCH_KEYS; i++) {
+		// half of the hits are the subdomains of the blocked names
+		int length = sprintf(name, "%s", i % 2 ? "" : "img.");
+		generatedName(mixIndex(i) % count, name + length);
+		makeQuery(name, &hits[i]);
+		generatedName(count + i, name);
+		makeQuery(name, &misses[i]);
+	}
+	size_t baseline = statusValue("VmRSS:");
+	double start = benchTime();
+	char *textNames[] = {textName}, *compiledNames[] = {compiledName};
+	int result = getDnsFilter(textNames, 1);
+	double loadTime = benchTime() - start;
+	size_t peak = statusValue("VmHWM:");
+	if (result || writeCompiledList(compiledName)) return EXIT_FAILURE;
+	start = benchTime();
+	struct blacklist_s *compiled = loadFilter(compiledNames, 1);
+	double mapTime = benchTime() - start;
+	if (!compiled) return EXIT_FAILURE;
+	freeBlacklist(compiled);
+	unlink(textName);
+	unlink(compiledName);
+	struct hashFilter filter;
+	if (newHashFilter(blacklist, &filter)) {
+		fprintf(stderr, "Could not allocate hash table. Not enough memory.\n");
+		return EXIT_FAILURE;
+	}
+	// bytes of the data shared by all variants (nodes and labels) and of every lookup structure
+	size_t bloomBytes = blacklist->header->bloomBlocks * BLOOM_BLOCK_WORDS * sizeof(uint32_t);
+	size_t edgesBytes = ((size_t)blacklist->tableMask + 1) * sizeof(uint32_t);
+	size_t hashBytes = ((size_t)filter.mask + 1) * sizeof(uint32_t);
+	double entries = blacklist->header->size;
+	printf("%lu names (%u nodes)\n", count, blacklist->header->nodeCount);
+	printf("  load %.1f ms (compiled %.3f ms), peak RSS %.1f MB (%.0f B/name), filter %.1f B/name "
+		"(edges %.1f, bloom %.1f, hash table %.1f)\n", loadTime / 1e6, mapTime / 1e6, (peak - baseline) / 1e6,
+		(peak - baseline) / entries, blacklist->header->totalSize / entries, edgesBytes / entries, bloomBytes / entries,
+		hashBytes / entries);
+	// the parsing and the key are measured alone and subtracted, the server does them for the cache anyway
+	double keyHit = measureLookups(0, &filter, hits, 0), keyMiss = measureLookups(0, &filter, misses, 0);
+	printf("  %-10s hit %6.1f ns  miss %6.1f ns\n", "key", keyHit, keyMiss);
+	const char *variants[] = {"bloom+trie", "trie", "hash", "bloom+hash"};
+	for (int variant = 1; variant <= 4; variant++) {
+		double hit = measureLookups(variant, &filter, hits, 1) - keyHit;
+		double miss = measureLookups(variant, &filter, misses, 0) - keyMiss;
+		printf("  %-10s hit %6.1f ns  miss %6.1f ns\n", variants[variant - 1], hit, miss);
+	}
+	return EXIT_SUCCESS;
+}
+
+/**
+ * @fn main()
+ * @brief Measure the filter lists of the sizes given by the arguments (10k, 100k, 1M and 10M names by default)
+ */
+int main(int argc, char **argv) {
+	selectNameFunctions();
+	size_t count = argc > 1 ? (size_t)argc - 1 : sizeof(defaultSizes) / sizeof(defaultSizes[0]);
+	for (size_t i = 0; i < count; i++) {
+		char *ptr = NULL;
+		unsigned long size = argc > 1 ? strtoul(argv[i + 1], &ptr, 10) : defaultSizes[i];
+		if (argc > 1 && (*ptr != '\0' || ptr == argv[i + 1] || size == 0 || size > UINT32_MAX / 4)) {
+			fprintf(stderr, "Usage: filter_bench [<number of names> ...]\n");
+			return EXIT_FAILURE;
+		}
+		fflush(stdout);
+		pid_t pid = fork();
+		if (pid == 0) exit(benchSize(size));
+		int status;
+		if (pid < 0 || waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS) {
+			return EXIT_FAILURE;
+		}
+	}
+	return EXIT_SUCCESS;
+}
@@ -2,45 +2,141 @@
 
 GOODDOMAINLIST="./tests/good_domains"
 BADDOMAINLIST="./tests/bad_domains"
+# upstream server of the tested resolver (SERVER=127.0.0.1:5353 make test runs the tests against a local one)
+SERVER="${SERVER:-8.8.8.8}"
 
 RED='\033[0;31m'
 GREEN='\033[0;32m'
 NC='\033[0m'
 
-printf "RUNNING SERVER \"./dns -s 8.8.8.8 -f tests/filter -p 5300\"\n"
-./dns -s 8.8.8.8 -f tests/filter -p 5300 & pid=$!
-sleep 1
+# testDomains <title> <dig options>: every good domain gets an address and no bad domain gets one
+testDomains() {
+    printf "________________________________________________________________\n"
+    printf "                 TESTING GOOD DOMAINS %-26s\n" "$1"
+    printf "________________________________________________________________\n"
+    printf "\n"
 
-printf "________________________________________________________________\n"
-printf "                      TESTING GOOD DOMAINS                      \n"
-printf "________________________________________________________________\n"
-printf "\n"
+    while read DOMAIN; do
+        echo "RUNNING \"dig $2 +short $DOMAIN\""
+        address=$(dig $2 +short "$DOMAIN" | head -1)
+        if [ -z "$address" ]
+        then
+        printf "${RED}TEST FAILED${NC} - no address received\n"
+        else
+        printf "${GREEN}TEST PASSED${NC} - received ${address}\n"
+        fi
+    done < "$GOODDOMAINLIST"
 
-while read DOMAIN; do
-    echo "RUNNING \"dig -p 5300 @127.0.0.1 +short $DOMAIN\""
-    address=$(dig -p 5300 @127.0.0.1 +short "$DOMAIN" | head -1)
-    if [ -z "$address" ]
+    printf "________________________________________________________________\n"
+    printf "                 TESTING BAD DOMAINS %-27s\n" "$1"
+    printf "________________________________________________________________\n"
+    printf "\n"
+
+    while read DOMAIN; do
+        echo "RUNNING \"dig $2 +short $DOMAIN\""
+        address=$(dig $2 +short "$DOMAIN" | head -1)
+        if [ -z "$address" ]
+        then
+        printf "${GREEN}TEST PASSED${NC} - no address received\n"
+        else
+        printf "${RED}TEST FAILED${NC} - expected nothing but received ${address}\n"
+        fi
+    done < "$BADDOMAINLIST"
+}
+
+# testBurst <title> <queries> <minimum> <dig options> [<second source address>]: quick burst of queries for a blocked
+# name (answered without the upstream), the first one is answered and at least minimum are over the rate limit
+# (TC or no answer), every second query comes from the second source address when it is given
+testBurst() {
+    printf "________________________________________________________________\n"
+    printf "                 TESTING RATE LIMIT %-28s\n" "$1"
+    printf "________________________________________________________________\n"
+    printf "\n"
+
+    limited=0
+    first=""
+    i=1
+    while [ $i -le $2 ]; do
+        source=""
+        if [ -n "$5" ] && [ $((i % 2)) -eq 0 ]; then source="-b $5"; fi
+        reply=$(dig $4 $source +ignore +tries=1 +time=1 +noall +comments adbot.com)
+        if echo "$reply" | grep -q -e "flags:[^;]* tc" -e "timed out"; then
+            limited=$((limited + 1))
+            [ $i -eq 1 ] && first="limited"
+        fi
+        i=$((i + 1))
+    done
+    echo "RUNNING $2 times \"dig $4 +ignore adbot.com\""
+    if [ -z "$first" ] && [ $limited -ge $3 ]
     then
-    printf "${RED}TEST FAILED${NC} - no address received\n"
+    printf "${GREEN}TEST PASSED${NC} - ${limited} of $2 queries over the limit\n"
     else
-    printf "${GREEN}TEST PASSED${NC} - received ${address}\n"
+    printf "${RED}TEST FAILED${NC} - ${limited} of $2 queries over the limit (expected $3 at least, the first one answered)\n"
     fi
-done < "$GOODDOMAINLIST"
+}
+
+# rules of this server, a hosts file and adblock rules are merged to one filter
+FILTERS="-f tests/filter -f tests/hosts_filter -f tests/adblock_filter"
+
+# query log of the server (written when it ends)
+QUERYLOG=$(mktemp)
+
+printf "RUNNING SERVER \"./dns -s $SERVER $FILTERS -p 5300 -q $QUERYLOG\"\n"
+./dns -s "$SERVER" $FILTERS -p 5300 -q "$QUERYLOG" & pid=$!
+sleep 1
+
+testDomains "(UDP)" "-p 5300 @127.0.0.1"
+# TCP clients go through the same filter and their queries are forwarded over UDP
+testDomains "(TCP)" "-p 5300 @127.0.0.1 +tcp"
+# IPv6 clients use the same dual-stack sockets (IPv4 is v4-mapped inside), their answers are matched the same way
+testDomains "(IPv6)" "-p 5300 @::1"
+
+kill $pid; wait $pid
 
 printf "________________________________________________________________\n"
-printf "                      TESTING BAD DOMAINS                       \n"
+printf "                      TESTING QUERY LOG                         \n"
 printf "________________________________________________________________\n"
 printf "\n"
 
-while read DOMAIN; do
-    echo "RUNNING \"dig -p 5300 @127.0.0.1 +short $DOMAIN\""
-    address=$(dig -p 5300 @127.0.0.1 +short "$DOMAIN" | head -1)
-    if [ -z "$address" ]
+# both clients are in the log by their plain addresses, v4-mapped addresses are printed as IPv4
+TAB=$(printf '\t')
+for ADDRESS in "127.0.0.1" "::1"; do
+    if grep -q "${TAB}${ADDRESS}#" "$QUERYLOG"
     then
-    printf "${GREEN}TEST PASSED${NC} - no address received\n"
+    printf "${GREEN}TEST PASSED${NC} - queries of ${ADDRESS} logged\n"
     else
-    printf "${RED}TEST FAILED${NC} - expected nothing but received ${address}\n"
+    printf "${RED}TEST FAILED${NC} - no query of ${ADDRESS} in the log\n"
     fi
-done < "$BADDOMAINLIST"
+done
+if grep -q "::ffff:" "$QUERYLOG"
+then
+printf "${RED}TEST FAILED${NC} - v4-mapped address in the log\n"
+else
+printf "${GREEN}TEST PASSED${NC} - no v4-mapped address in the log\n"
+fi
+rm -f "$QUERYLOG"
+
+# token bucket of one query per second: the burst empties it, clients over the limit get TC (-T) or nothing,
+# the network limit is shared by the addresses of one /24, the buckets are shared by the worker threads which get
+# the queries from the new source ports of dig (<flags>:<queries>:<minimum>[:<second source address>])
+for LIMIT in "-R 1 -T:10:7" "-R 1:2:1" "-R 0,1 -T:4:3:127.0.0.2" "-R 1 -T -t 4:10:7"; do
+    FLAGS="${LIMIT%%:*}"
+    REST="${LIMIT#*:}"
+    QUERIES="${REST%%:*}"
+    REST="${REST#*:}"
+    MINIMUM="${REST%%:*}"
+    SOURCE=""
+    if [ "$REST" != "$MINIMUM" ]; then SOURCE="${REST#*:}"; fi
+    printf "RUNNING SERVER \"./dns -s $SERVER $FILTERS -p 5301 $FLAGS\"\n"
+    ./dns -s "$SERVER" $FILTERS -p 5301 $FLAGS & pid=$!
+    sleep 1
+    testBurst "($FLAGS)" "$QUERIES" "$MINIMUM" "-p 5301 @127.0.0.1" "$SOURCE"
+    kill $pid; wait $pid
+done
 
-kill $pid
\ No newline at end of file
+# IPv6 client has its own bucket (by its /64)
+printf "RUNNING SERVER \"./dns -s $SERVER $FILTERS -p 5301 -R 1 -T\"\n"
+./dns -s "$SERVER" $FILTERS -p 5301 -R 1 -T & pid=$!
+sleep 1
+testBurst "(-R 1 -T, IPv6)" 10 7 "-p 5301 @::1"
+kill $pid; wait $pid